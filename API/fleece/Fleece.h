@@ -618,6 +618,16 @@ while (NULL != (value = FLDictIterator_GetValue(&iter))) {
         be stored inside the FLDictKey that will speed up subsequent lookups. */
     FLValue FLDict_GetWithKey(FLDict, FLDictKey* FLNONNULL) FLAPI;
 
+    /** Looks up several keys in a dictionary at once, storing each key's value (or NULL) in the
+        corresponding item of `values`. This is faster than calling \ref FLDict_GetWithKey for
+        each key, since all the keys are found in one pass over the dictionary.
+        @param d  The dictionary (may be NULL.)
+        @param keys  An array of `count` initialized FLDictKeys; they'll be updated with hints.
+        @param count  The number of keys.
+        @param values  An array of `count` FLValues, which will be filled in.
+        @return  The number of keys that were found. */
+    size_t FLDict_GetMany(FLDict d, FLDictKey keys[], size_t count, FLValue values[]) FLAPI;
+
 
     //////// MUTABLE DICT
 
@@ -324,6 +324,16 @@ FLValue FLDict_GetWithKey(FLDict d, FLDictKey *k) FLAPI {
     return d->get(key);
 }
 
+size_t FLDict_GetMany(FLDict d, FLDictKey keys[], size_t count, FLValue values[]) FLAPI {
+    static_assert(sizeof(FLDictKey) == sizeof(Dict::key), "FLDictKey array won't match");
+    if (!d) {
+        for (size_t i = 0; i < count; ++i)
+            values[i] = nullptr;
+        return 0;
+    }
+    return d->getMany((Dict::key*)keys, count, values);
+}
+
 
 static FLMutableDict _newMutableDict(FLDict d, FLCopyFlags flags) noexcept {
     try {
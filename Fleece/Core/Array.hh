@@ -107,6 +107,7 @@ namespace fleece { namespace impl {
     private:
         friend class Value;
         friend class Dict;
+        friend class JSONEncoder;
         template <bool WIDE> friend struct dictImpl;
         friend class internal::HeapArray;
     };
@@ -17,11 +17,13 @@
 //
 
 #include "Dict.hh"
+#include "DictSearch.hh"
 #include "MutableDict.hh"
 #include "SharedKeys.hh"
 #include "Doc.hh"
 #include "Internal.hh"
 #include "PlatformCompat.hh"
+#include <algorithm>
 #include <atomic>
 #include <string>
 #include "betterassert.hh"
@@ -62,39 +64,50 @@ namespace fleece { namespace impl {
             return Doc::sharedKeys(_first);
         }
 
+        // Returns the first key, skipping the parent pointer if any.
+        const Value* firstKey() const {
+            if (_count == 0)
+                return nullptr;
+            const Value *key = _first;
+            if (_usuallyFalse(Dict::isMagicParentKey(key))) {
+                if (_count == 1)
+                    return nullptr;
+                key = offsetby(key, 2*_width);
+            }
+            return key;
+        }
+
         bool usesSharedKeys() const {
-            // Check if the first key is an int (the second, if the 1st is a parent ptr)
-            return _count > 0 && _first->tag() == kShortIntTag
-                && !(Dict::isMagicParentKey(_first)
-                     && (_count == 1 || offsetby(_first, 2*_width)->tag() != kShortIntTag));
+            // Check if the first key is a short int. This is cheap, but misses the rare Dict
+            // whose shared keys are all long ints; lookups check for that only after a miss.
+            auto key = firstKey();
+            return key && key->tag() == kShortIntTag;
+        }
+
+        bool usesOnlyLongSharedKeys() const {
+            auto key = firstKey();
+            return key && isLongIntKey(key);
         }
 
         template <class KEY>
         __hot
         const Value* finishGet(const Value *keyFound, KEY &keyToFind) const noexcept {
             if (keyFound) {
-                auto value = deref(next(keyFound));
-                if (_usuallyFalse(value->isUndefined()))
-                    value = nullptr;
-                return value;
+                return valueOf(keyFound);
             } else {
                 const Dict *parent = getParent();
                 return parent ? parent->get(keyToFind) : nullptr;
             }
         }
 
-        __hot
-        inline const Value* getUnshared(slice keyToFind) const noexcept {
-            auto key = search(keyToFind, [](slice target, const Value *val) {
-                countComparison();
-                return compareKeys(target, val);
-            });
-            return finishGet(key, keyToFind);
-        }
-
         __hot
         inline const Value* get(int keyToFind) const noexcept {
             assert_precondition(keyToFind >= 0);
+            if (_usuallyTrue(keyToFind < 2048)) {
+                // Short-int key: use the faster branchless or SIMD search
+                auto key = internal::ShortKeySearch<WIDE>::find(_first, _count, keyToFind);
+                return finishGet(key, keyToFind);
+            }
             auto key = search(keyToFind, [](int target, const Value *key) {
                 countComparison();
                 return compareKeys(target, key);
@@ -111,7 +124,16 @@ namespace fleece { namespace impl {
             int encoded;
             if (sharedKeys && lookupSharedKey(keyToFind, sharedKeys, encoded))
                 return get(encoded);
-            return getUnshared(keyToFind);
+            auto key = search(keyToFind, [](slice target, const Value *val) {
+                countComparison();
+                return compareKeys(target, val);
+            });
+            if (!key && !sharedKeys && _usuallyFalse(usesOnlyLongSharedKeys())) {
+                sharedKeys = findSharedKeys();
+                if (sharedKeys && lookupSharedKey(keyToFind, sharedKeys, encoded))
+                    return get(encoded);
+            }
+            return finishGet(key, keyToFind);
         }
 
         __hot
@@ -139,9 +161,77 @@ namespace fleece { namespace impl {
             const Value *key = findKeyByHint(keyToFind);
             if (!key)
                 key = findKeyBySearch(keyToFind);
+            if (!key && !sharedKeys && _usuallyFalse(usesOnlyLongSharedKeys())) {
+                sharedKeys = findSharedKeys();
+                if (sharedKeys) {
+                    keyToFind.setSharedKeys(sharedKeys);
+                    if (lookupSharedKey(keyToFind._rawString, sharedKeys, keyToFind._numericKey)) {
+                        keyToFind._hasNumericKey = true;
+                        return get(keyToFind._numericKey);
+                    }
+                }
+            }
             return finishGet(key, keyToFind);
         }
 
+        // Looks up as many as kMaxBatch keys. The shared (integer) keys are found in a single
+        // pass over the Dict: they're sorted into the Dict's order, then each search starts from
+        // where the last one ended. String keys don't need that, since they usually hit the
+        // index cached in the Dict::key.
+        __hot
+        size_t getMany(Dict::key keys[], size_t nKeys, const Value* values[]) const noexcept {
+            assert_precondition(nKeys <= kMaxBatch);
+            size_t found = 0;
+            if (_usuallyFalse(hasParent() || (!usesSharedKeys() && usesOnlyLongSharedKeys()))) {
+                // These need the full lookup logic, key by key:
+                for (size_t i = 0; i < nKeys; ++i)
+                    found += ((values[i] = get(keys[i])) != nullptr);
+                return found;
+            }
+
+            Target targets[kMaxBatch];
+            size_t nTargets = 0;
+            SharedKeys *sharedKeys = nullptr;
+            bool checkedSharedKeys = false;
+            for (size_t i = 0; i < nKeys; ++i) {
+                Dict::key &key = keys[i];
+                if (!key._sharedKeys && !checkedSharedKeys) {
+                    checkedSharedKeys = true;
+                    if (usesSharedKeys()) {
+                        sharedKeys = findSharedKeys();
+                        assert_precondition(sharedKeys || gDisableNecessarySharedKeysCheck);
+                    }
+                }
+                if (!key._sharedKeys && sharedKeys)
+                    key.setSharedKeys(sharedKeys);
+                if (key._sharedKeys && _count > 0 && !key._hasNumericKey)
+                    key._hasNumericKey = lookupSharedKey(key._rawString, key._sharedKeys,
+                                                         key._numericKey);
+                if (_usuallyTrue(key._sharedKeys && key._hasNumericKey)) {
+                    targets[nTargets++] = {key._numericKey, &values[i]};
+                } else {
+                    const Value *k = findKeyByHint(key);
+                    if (!k)
+                        k = findKeyBySearch(key);
+                    found += ((values[i] = valueOf(k)) != nullptr);
+                }
+            }
+
+            // Integer keys are in ascending order in the Dict:
+            std::sort(&targets[0], &targets[nTargets], [](const Target &a, const Target &b) {
+                return a.key < b.key;
+            });
+            const Value *cursor = _first;
+            uint32_t remaining = _count;
+            for (size_t i = 0; i < nTargets; ++i) {
+                auto k = seek(cursor, remaining, targets[i].key);
+                found += ((*targets[i].out = valueOf(k)) != nullptr);
+            }
+            return found;
+        }
+
+        static constexpr size_t kMaxBatch = 64;
+
         bool hasParent() const {
             return _usuallyTrue(_count > 0) && _usuallyFalse(Dict::isMagicParentKey(_first));
         }
@@ -151,26 +241,46 @@ namespace fleece { namespace impl {
         }
 
 
+        // Shared keys past 2047 don't fit in a short int, so they're stored as regular ints,
+        // which are always out of line. Integer keys sort before strings, so these come after
+        // the short-int keys and before the string keys.
+        static bool isLongIntKey(const Value *key) {
+            return key->tag() == kIntTag
+                || (key->isPointer() && deref(key)->tag() == kIntTag);
+        }
+
         __hot
         static int compareKeys(slice keyToFind, const Value *key) {
             if (_usuallyTrue(key->isInteger()))
                 return 1;
-            else
-                return keyToFind.compare(keyBytes(key));
+            const Value *keyValue = deref(key);
+            if (_usuallyFalse(keyValue->tag() != kStringTag))
+                return 1;                                               // long int key
+            return keyToFind.compare(keyValue->getStringBytes());
         }
 
         __hot
         static int compareKeys(int keyToFind, const Value *key) {
-            assert_precondition(key->tag() == kShortIntTag || key->tag() == kStringTag
-                                                           || key->tag() >= kPointerTagFirst);
+            assert_precondition(key->tag() == kShortIntTag || key->tag() == kIntTag
+                                || key->tag() == kStringTag || key->tag() >= kPointerTagFirst);
             // This is optimized using the knowledge that short ints have a tag of 0.
             uint8_t hiByte = key->_byte[0];
             if (_usuallyTrue(hiByte <= 0x07))
                 return keyToFind - ((hiByte << 8) | key->_byte[1]);     // positive int key
             else if (_usuallyFalse(hiByte <= 0x0F))
                 return keyToFind - (int16_t)(0xF0 | (hiByte << 8) | key->_byte[1]); // negative
+            else if (_usuallyFalse(keyToFind >= 2048))
+                return compareLongIntKey(keyToFind, key);
             else
-                return -1;                                              // string, or ptr to string
+                return -1;              // long int, string, or ptr to either, is greater
+        }
+
+        static int compareLongIntKey(int keyToFind, const Value *key) {
+            const Value *keyValue = deref(key);
+            if (keyValue->tag() != kIntTag)
+                return -1;                                              // string
+            int64_t keyInt = keyValue->asInt();
+            return (keyToFind > keyInt) - (keyToFind < keyInt);
         }
 
         __hot
@@ -206,6 +316,47 @@ namespace fleece { namespace impl {
             return nullptr;
         }
 
+        // An integer key being looked up by getMany, and where to store its value.
+        struct Target {
+            int key;
+            const Value* *out;
+        };
+
+        // The value of a key found by a search, or nullptr.
+        const Value* valueOf(const Value *keyFound) const noexcept {
+            if (!keyFound)
+                return nullptr;
+            auto value = deref(next(keyFound));
+            return _usuallyFalse(value->isUndefined()) ? nullptr : value;
+        }
+
+        // Searches for an integer key among the `remaining` keys starting at `cursor`, then
+        // advances the cursor past every key less than it (but not past a match, in case the next
+        // key to find is the same.) It gallops forward first, so nearby keys are found quickly.
+        __hot
+        const Value* seek(const Value* &cursor, uint32_t &remaining, int target) const {
+            auto keyAt = [&](size_t i) {return offsetby(cursor, i * 2*kWidth);};
+            size_t lo = 0, hi = 1;
+            while (hi < remaining && compareKeys(target, keyAt(hi)) > 0) {
+                lo = hi + 1;
+                hi *= 2;
+            }
+            hi = std::min(hi, size_t(remaining));
+            // Now the key at `lo` is the first one that might match, and `hi` is past the last.
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (compareKeys(target, keyAt(mid)) > 0)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            cursor = keyAt(lo);
+            remaining -= uint32_t(lo);
+            if (remaining > 0 && compareKeys(target, cursor) == 0)
+                return cursor;
+            return nullptr;
+        }
+
         __hot
         const Value* findKeyByHint(Dict::key &keyToFind) const {
             if (keyToFind._hint < _count) {
@@ -234,20 +385,19 @@ namespace fleece { namespace impl {
         bool lookupSharedKey(slice keyToFind, SharedKeys *sharedKeys, int &encoded) const noexcept {
             if (sharedKeys->encode(keyToFind, encoded))
                 return true;
-            // Key is not known to my SharedKeys; see if dict contains any unknown keys:
-            if (_count == 0)
-                return false;
-            const Value *v = offsetby(_first, (_count-1)*2*kWidth);
-            do {
-                if (v->isInteger()) {
-                    if (sharedKeys->isUnknownKey((int)v->asInt())) {
+            // Key is not known to my SharedKeys; see if dict contains any unknown keys.
+            // Integer keys sort first, so only the last one needs to be checked:
+            for (uint32_t i = _count; i-- > 0; ) {
+                const Value *key = deref(offsetby(_first, i*2*kWidth));
+                if (key->isInteger()) {
+                    if (sharedKeys->isUnknownKey((int)key->asInt())) {
                         // Yup, try updating SharedKeys and re-encoding:
                         sharedKeys->refresh();
                         return sharedKeys->encode(keyToFind, encoded);
                     }
                     return false;
                 }
-            } while (--v >= _first);
+            }
             return false;
         }
 
@@ -349,6 +499,26 @@ namespace fleece { namespace impl {
             return dictImpl<false>(this).get(keyToFind);
     }
 
+    __hot
+    size_t Dict::getMany(key keys[], size_t nKeys, const Value* values[]) const noexcept {
+        if (_usuallyFalse(isMutable())) {
+            size_t found = 0;
+            for (size_t i = 0; i < nKeys; ++i)
+                found += ((values[i] = heapDict()->get(keys[i])) != nullptr);
+            return found;
+        }
+        bool wide = isWideArray();
+        size_t found = 0;
+        for (size_t i = 0; i < nKeys; i += dictImpl<false>::kMaxBatch) {
+            size_t n = std::min(nKeys - i, dictImpl<false>::kMaxBatch);
+            if (wide)
+                found += dictImpl<true>(this).getMany(&keys[i], n, &values[i]);
+            else
+                found += dictImpl<false>(this).getMany(&keys[i], n, &values[i]);
+        }
+        return found;
+    }
+
     __hot
     const Value* Dict::get(const key_t &keyToFind) const noexcept {
         if (_usuallyFalse(isMutable()))
@@ -139,6 +139,11 @@ namespace fleece { namespace impl {
 
         const Value* get(const key_t&) const noexcept;
 
+        /** Looks up several keys at once, storing each one's Value (or nullptr) in the
+            corresponding item of `values`, and returns the number found. This is faster than
+            calling `get(key&)` for each key, since it finds them all in one pass over the Dict. */
+        size_t getMany(key keys[], size_t nKeys, const Value* values[]) const noexcept;
+
         constexpr Dict()  :Value(internal::kDictTag, 0, 0) { }
 
     protected:
@@ -152,6 +157,7 @@ namespace fleece { namespace impl {
         template <bool WIDE> friend struct dictImpl;
         friend class Value;
         friend class Encoder;
+        friend class JSONEncoder;
         friend class internal::HeapDict;
     };
 
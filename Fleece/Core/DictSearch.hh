@@ -0,0 +1,111 @@
+//
+// DictSearch.hh
+//
+// Copyright (c) 2021 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "Value.hh"
+#include "Bitmap.hh"
+#include "PlatformCompat.hh"
+#include <algorithm>
+
+#if FL_HAVE_SSE2
+    #include <emmintrin.h>
+#endif
+
+namespace fleece { namespace impl { namespace internal {
+
+    /*  Finding a short-int (shared) key in a Dict.
+        A Dict is an array of key/value pairs sorted by key, and short ints (-2048..2047) sort
+        first. A short int is two big-endian bytes whose high nibble (the tag) is 0; every other
+        kind of key starts with a nonzero nibble. So short-int keys can be compared using just
+        their first two bytes, without dereferencing anything or branching on the key's type,
+        which makes these searches much cheaper than the general binary search in Dict.cc. */
+
+
+    // Maps the first two bytes of a key to a number that orders the same way keys do: a short
+    // int maps to its value, and any other key (long int, string, pointer) to 2048 or more.
+    static inline int shortKeyOrder(const void *key) noexcept {
+        auto b = (const uint8_t*)key;
+        return int(((b[0] << 8) | b[1]) ^ 0x0800) - 0x0800;
+    }
+
+
+    template <bool WIDE>
+    struct ShortKeySearch {
+        static constexpr size_t kPairSize = WIDE ? 8 : 4;
+
+        // `linear` is faster than `binary` for Dicts of this many bytes ("Perf DictIntSearch"
+        // shows the crossover); it loads the whole Dict at once, so it can't go beyond 64.
+        static constexpr size_t kMinLinearSize = 16, kMaxLinearSize = 64;
+
+        /** Returns the key equal to `key` (0..2047) among the `count` pairs at `first`, or
+            nullptr. Picks the faster algorithm for the Dict's size. */
+        static const Value* find(const Value *first, uint32_t count, int key) noexcept {
+#if FL_HAVE_SSE2
+            size_t size = count * kPairSize;
+            if (size >= kMinLinearSize && size <= kMaxLinearSize)
+                return linear(first, count, key);
+#endif
+            return binary(first, count, key);
+        }
+
+#if FL_HAVE_SSE2
+        /** Compares every key at once using SSE2, with no branches at all. The Dict must be
+            16 to 64 bytes long, i.e. 4 to 16 narrow or 2 to 8 wide pairs. */
+        static const Value* linear(const Value *first, uint32_t count, int key) noexcept {
+            auto start = (const uint8_t*)first;
+            size_t size = count * kPairSize;
+            assert_precondition(size >= kMinLinearSize && size <= kMaxLinearSize);
+            // Only the 2-byte lanes at the start of a pair hold keys; values can't match.
+            constexpr unsigned kKeyLanes = WIDE ? 0x0303 : 0x3333;
+            const __m128i needle = _mm_set1_epi16(int16_t(((key & 0xFF) << 8) | (key >> 8)));
+            // Four 16-byte loads cover 64 bytes; in a smaller Dict the last loads are moved back
+            // to end at the end of the Dict, and overlaps just find the same key again.
+            uint64_t matches = 0;
+            for (size_t i = 0; i < kMaxLinearSize; i += 16) {
+                size_t offset = std::min(i, size - 16);
+                __m128i chunk = _mm_loadu_si128((const __m128i*)(start + offset));
+                unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi16(chunk, needle)) & kKeyLanes;
+                matches |= uint64_t(m) << offset;
+            }
+            return matches ? (const Value*)(start + countTrailingZeros(matches)) : nullptr;
+        }
+#endif
+
+        /** Binary search whose loop has no data-dependent branches, so it doesn't suffer branch
+            mispredictions; the compiler turns the comparison into a conditional move. */
+        static const Value* binary(const Value *first, uint32_t count, int key) noexcept {
+            if (count == 0)
+                return nullptr;
+            auto base = (const uint8_t*)first;
+            for (size_t n = count; n > 1; ) {
+                size_t half = n / 2;
+                base = (shortKeyOrder(base + half * kPairSize) < key) ? base + half * kPairSize
+                                                                      : base;
+                n -= half;
+            }
+            // Now `base` is the last pair whose key is less than `key`, or else the first pair:
+            if (shortKeyOrder(base) < key) {
+                base += kPairSize;
+                if (base == (const uint8_t*)first + count * kPairSize)
+                    return nullptr;
+            }
+            return (shortKeyOrder(base) == key) ? (const Value*)base : nullptr;
+        }
+    };
+
+} } }
@@ -24,9 +24,11 @@
 #include "MutableDict.hh"
 #include "MutableArray.hh"
 #include <algorithm>
+#include <atomic>
 #include <functional>
+#include <memory>
 #include <mutex>
-#include <vector>
+#include <thread>
 #include "betterassert.hh"
 
 #if 0
@@ -43,21 +45,183 @@ namespace fleece { namespace impl {
     using namespace internal;
 
 
-    // `sMemoryMap` is a global mapping from pointers to Scopes.
+    /*  `sMemoryMap` is a global mapping from address ranges to Scopes: an array with an entry
+        for each registered Scope, sorted by the end of its range.
+
+        Lookups don't lock. Writers (registr and unregister) are serialized by `sMutex`, and make
+        `sSequence` odd while they change the array; a reader searches the array optimistically,
+        then starts over if the sequence changed meanwhile. Every field a reader looks at is
+        atomic, so a reader racing a writer just gets a garbage result, which it throws away.
+        An entry holds copies of the Scope's fields, so a reader never touches a Scope, which may
+        be getting freed; the exception is Doc::containing, which locks the mutex.
+
+        To keep writes short, unregistering a Scope just clears its entry's `scope`, leaving a
+        "tombstone" that lookups skip. A new entry takes the place of the nearest tombstone,
+        shifting the entries in between over by one. When over half the entries are tombstones,
+        they're all removed in one pass.
+
+        When the array outgrows its buffer it's copied to one twice as big. The old buffer is
+        never freed, since readers may still be looking at it, but the retired buffers add up to
+        less than the current one. */
     struct memEntry {
-        const void *endOfRange; // The _end_ of the memory range covered by the Scope
-        Scope *scope;           // The Scope
-        bool operator< (const memEntry &other) const        {return endOfRange < other.endOfRange;}
+        atomic<const void*> start;  // The start of the memory range covered by the Scope
+        atomic<const void*> end;    // The _end_ of the memory range covered by the Scope
+        atomic<Scope*> scope;       // The Scope, or nullptr if this is a tombstone
+        atomic<SharedKeys*> sk;     // The Scope's SharedKeys
+        atomic<const void*> externStart, externEnd; // The Scope's extern destination
+
+        const void* getEnd() const              {return end.load(memory_order_relaxed);}
+        Scope* getScope() const                 {return scope.load(memory_order_relaxed);}
+        SharedKeys* getSharedKeys() const       {return sk.load(memory_order_relaxed);}
+        slice getExternDestination() const {
+            return slice(externStart.load(memory_order_relaxed),
+                         externEnd.load(memory_order_relaxed));
+        }
+
+        void set(const void *s, const void *e, Scope *sc, SharedKeys *k, slice extern_) {
+            start.store(s, memory_order_relaxed);
+            end.store(e, memory_order_relaxed);
+            scope.store(sc, memory_order_relaxed);
+            sk.store(k, memory_order_relaxed);
+            externStart.store(extern_.buf, memory_order_relaxed);
+            externEnd.store(extern_.end(), memory_order_relaxed);
+        }
+
+        void operator= (const memEntry &other) {
+            set(other.start.load(memory_order_relaxed), other.getEnd(), other.getScope(),
+                other.getSharedKeys(), other.getExternDestination());
+        }
     };
 
-    using memoryMap = smallVector<memEntry, 10>;
 
-    static memoryMap *sMemoryMap;
+    // What a lookup found out about the Scope containing an address. It's copied from the
+    // Scope's memEntry, so lock-free readers never have to touch the Scope itself, which another
+    // thread may be unregistering and freeing.
+    struct scopeInfo {
+        Scope *scope;               // Only for comparison, unless you know it's still alive
+        SharedKeys *sk;
+        const void *dataStart;      // The start of the Scope's data
+        slice externDestination;
+    };
 
-    // Mutex for access to `sMemoryMap`
+    struct memoryMap {
+        explicit memoryMap(size_t cap, memoryMap *prev)
+        :capacity(cap), entries(new memEntry[cap]()), retired(prev) { }
+
+        size_t const capacity;
+        unique_ptr<memEntry[]> const entries;
+        memoryMap* const retired;       // The previous, smaller buffer
+    };
+
+    static atomic<memoryMap*> sMemoryMap {nullptr};
+    static atomic<size_t> sMemoryMapSize {0};   // Number of entries, including tombstones
+    static size_t sTombstones = 0;              // Number of tombstones (guarded by sMutex)
+
+    // Odd while `sMemoryMap` is being changed. (It's 64-bit so it can't wrap around, which
+    // could make a stale ScopeHint look current.)
+    static atomic<uint64_t> sSequence {0};
+
+    // Mutex for changing `sMemoryMap`
     static mutex sMutex;
 
 
+    // Index of the first entry whose range ends after `addr`. Call with sMutex locked, or within
+    // a read of the sequence lock.
+    static size_t upperBound(const memEntry *entries, size_t size, const void *addr) noexcept {
+        size_t lo = 0, hi = size;
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (entries[mid].getEnd() <= addr)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+
+    // Brackets a change to `sMemoryMap`. Call with sMutex locked.
+    static void beginWrite() noexcept {
+        sSequence.store(sSequence.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+
+    static void endWrite() noexcept {
+        sSequence.store(sSequence.load(memory_order_relaxed) + 1, memory_order_release);
+    }
+
+
+    // Inserts an entry before index `pos`. Call within beginWrite/endWrite.
+    static void insertEntry(size_t pos, const void *start, const void *end, Scope *scope,
+                            SharedKeys *sk, slice externDestination)
+    {
+        memoryMap *map = sMemoryMap.load(memory_order_relaxed);
+        size_t size = sMemoryMapSize.load(memory_order_relaxed);
+        memEntry *entries = map ? map->entries.get() : nullptr;
+
+        // Look for the nearest tombstone on either side:
+        size_t right = pos;
+        while (right < size && entries[right].getScope())
+            ++right;
+        size_t left = pos;
+        while (left > 0 && pos - left < right - pos && entries[left-1].getScope())
+            --left;
+
+        if (left > 0 && pos - left < right - pos) {
+            // Shift entries down into the tombstone at left-1:
+            for (size_t i = left - 1; i + 1 < pos; ++i)
+                entries[i] = entries[i+1];
+            --pos;
+            --sTombstones;
+        } else if (right < size) {
+            // Shift entries up into the tombstone at `right`:
+            for (size_t i = right; i > pos; --i)
+                entries[i] = entries[i-1];
+            --sTombstones;
+        } else {
+            // No tombstones; add an entry at the end:
+            if (_usuallyFalse(!map || size == map->capacity)) {
+                auto newMap = new memoryMap(map ? 2 * map->capacity : 64, map);
+                for (size_t i = 0; i < size; ++i)
+                    newMap->entries[i] = entries[i];
+                sMemoryMap.store(newMap, memory_order_relaxed);
+                entries = newMap->entries.get();
+            }
+            for (size_t i = size; i > pos; --i)
+                entries[i] = entries[i-1];
+            sMemoryMapSize.store(size + 1, memory_order_relaxed);
+        }
+        entries[pos].set(start, end, scope, sk, externDestination);
+    }
+
+
+    // Removes the entry at `pos`, usually by making it a tombstone. Call within
+    // beginWrite/endWrite.
+    static void removeEntry(size_t pos) {
+        memEntry *entries = sMemoryMap.load(memory_order_relaxed)->entries.get();
+        size_t size = sMemoryMapSize.load(memory_order_relaxed);
+        entries[pos].scope.store(nullptr, memory_order_relaxed);
+        ++sTombstones;
+        if (pos == size - 1) {
+            // Tombstones at the end can just be dropped:
+            while (size > 0 && !entries[size-1].getScope()) {
+                --size;
+                --sTombstones;
+            }
+        } else if (sTombstones > size / 2) {
+            size_t n = 0;
+            for (size_t i = 0; i < size; ++i) {
+                if (entries[i].getScope())
+                    entries[n++] = entries[i];
+            }
+            size = n;
+            sTombstones = 0;
+        }
+        sMemoryMapSize.store(size, memory_order_relaxed);
+    }
+
+
+
     Scope::Scope(slice data, SharedKeys *sk, slice destination) noexcept
     :_sk(sk)
     ,_externDestination(destination)
@@ -104,19 +268,21 @@ namespace fleece { namespace impl {
         _dataHash = _data.hash();
 #endif
         lock_guard<mutex> lock(sMutex);
-        if (_usuallyFalse(!sMemoryMap))
-            sMemoryMap = new memoryMap;
+        memoryMap *map = sMemoryMap.load(memory_order_relaxed);
+        size_t size = sMemoryMapSize.load(memory_order_relaxed);
         Log("Register   (%p ... %p) --> Scope %p, sk=%p [Now %zu]",
-            _data.buf, _data.end(), this, _sk.get(), sMemoryMap->size()+1);
+            _data.buf, _data.end(), this, _sk.get(), size+1);
 
-        memEntry entry = {_data.end(), this};
-        memoryMap::iterator iter = upper_bound(sMemoryMap->begin(), sMemoryMap->end(), entry);
+        size_t pos = map ? upperBound(map->entries.get(), size, _data.end()) : 0;
 
         // Assert that there isn't another conflicting Scope registered for this data:
-        if (iter != sMemoryMap->begin() && prev(iter)->endOfRange == entry.endOfRange) {
-            Scope *existing = prev(iter)->scope;
-            if (existing->_data == _data && existing->_externDestination == _externDestination
-                && existing->_sk == _sk) {
+        for (size_t i = pos; i > 0 && map->entries[i-1].getEnd() == _data.end(); --i) {
+            const memEntry &existing = map->entries[i-1];
+            if (!existing.getScope())
+                continue;
+            const void *existingStart = existing.start.load(memory_order_relaxed);
+            if (existingStart == _data.buf && existing.getExternDestination() == _externDestination
+                && existing.getSharedKeys() == _sk) {
                 Log("Duplicate  (%p ... %p) --> Scope %p, sk=%p",
                     _data.buf, _data.end(), this, _sk.get());
             } else {
@@ -124,12 +290,15 @@ namespace fleece { namespace impl {
                     "Incompatible duplicate Scope %p for (%p .. %p) with sk=%p: "
                     "conflicts with %p for (%p .. %p) with sk=%p",
                     this, _data.buf, _data.end(), _sk.get(),
-                    existing, existing->_data.buf, existing->_data.end(),
-                    existing->_sk.get());
+                    existing.getScope(), existingStart, existing.getEnd(),
+                    existing.getSharedKeys());
             }
+            break;
         }
 
-        sMemoryMap->insert(iter, entry);
+        beginWrite();
+        insertEntry(pos, _data.buf, _data.end(), this, _sk, _externDestination);
+        endWrite();
         _unregistered.clear();
     }
 
@@ -147,16 +316,19 @@ namespace fleece { namespace impl {
 #endif
 
             lock_guard<mutex> lock(sMutex);
+            memoryMap *map = sMemoryMap.load(memory_order_relaxed);
+            size_t size = sMemoryMapSize.load(memory_order_relaxed);
             Log("Unregister (%p ... %p) --> Scope %p, sk=%p   [now %zu]",
-                _data.buf, _data.end(), this, _sk.get(), sMemoryMap->size()-1);
-            memEntry entry = {_data.end(), this};
-            auto iter = lower_bound(sMemoryMap->begin(), sMemoryMap->end(), entry);
-            while (iter != sMemoryMap->end() && iter->endOfRange == entry.endOfRange) {
-                if (iter->scope == this) {
-                    sMemoryMap->erase(iter);
+                _data.buf, _data.end(), this, _sk.get(), size-1);
+            const memEntry *entries = map->entries.get();
+            // Find the first entry with my end address, then look for mine among its duplicates:
+            size_t pos = upperBound(entries, size, (const char*)_data.end() - 1);
+            for (; pos < size && entries[pos].getEnd() == _data.end(); ++pos) {
+                if (entries[pos].getScope() == this) {
+                    beginWrite();
+                    removeEntry(pos);
+                    endWrite();
                     return;
-                } else {
-                    ++iter;
                 }
             }
             Warn("unregister(%p) couldn't find an entry for (%p ... %p)", this, _data.buf, _data.end());
@@ -177,17 +349,85 @@ namespace fleece { namespace impl {
     }
 
 
-    /*static*/ __hot const Scope* Scope::_containing(const Value *src) noexcept {
-        // must have sMutex to call this
-        if (_usuallyFalse(!sMemoryMap))
-            return nullptr;
-        auto iter = upper_bound(sMemoryMap->begin(), sMemoryMap->end(), memEntry{src, nullptr});
-        if (_usuallyFalse(iter == sMemoryMap->end()))
-            return nullptr;
-        Scope *scope = iter->scope;
-        if (_usuallyFalse(src < scope->_data.buf))
+    namespace {
+        // The last Scope found by findScope() on this thread, and the range of addresses it's the
+        // answer for. It's valid as long as `sSequence` hasn't changed, i.e. nothing has been
+        // registered or unregistered since. Since the Values a thread looks at tend to be in the
+        // same Doc, this usually skips the search (and touching the shared array.)
+        // Like a lookup's result, the hint is a copy of the Scope's entry, not a reference to
+        // the Scope.
+        struct ScopeHint {
+            uint64_t sequence;          // Value of sSequence; odd means empty
+            const void *start, *end;    // Range of addresses
+            scopeInfo info;
+        };
+
+        thread_local ScopeHint tScopeHint {1, nullptr, nullptr, { }};
+    }
+
+
+    // Looks up the Scope whose data contains `src`. Returns false if there isn't one.
+    __hot static bool findScope(const void *src, scopeInfo &info) noexcept {
+        ScopeHint &hint = tScopeHint;
+        uint64_t seq = sSequence.load(memory_order_acquire);
+        if (_usuallyTrue(seq == hint.sequence && src >= hint.start && src < hint.end)) {
+            info = hint.info;
+            return true;
+        }
+
+        // This is the reader side of the sequence lock described at the top of this file:
+        while (true) {
+            if (_usuallyFalse(seq & 1)) {
+                this_thread::yield();       // a writer is busy
+                seq = sSequence.load(memory_order_acquire);
+                continue;
+            }
+            bool found = false;
+            const void *start = nullptr, *end = nullptr;
+            memoryMap *map = sMemoryMap.load(memory_order_relaxed);
+            if (_usuallyTrue(map != nullptr)) {
+                size_t size = min(sMemoryMapSize.load(memory_order_relaxed), map->capacity);
+                const memEntry *entries = map->entries.get();
+                size_t pos = upperBound(entries, size, src);
+                // Any address after the previous entry's end would have landed here too:
+                const void *prevEnd = (pos > 0) ? entries[pos-1].getEnd() : nullptr;
+                while (pos < size && !entries[pos].getScope())
+                    ++pos;                  // skip tombstones
+                if (pos < size) {
+                    const memEntry &entry = entries[pos];
+                    info.scope = entry.getScope();
+                    info.sk = entry.getSharedKeys();
+                    info.dataStart = entry.start.load(memory_order_relaxed);
+                    info.externDestination = entry.getExternDestination();
+                    start = max(info.dataStart, prevEnd);
+                    end = entry.getEnd();
+                    found = (info.scope != nullptr && src >= start);
+                }
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (_usuallyTrue(sSequence.load(memory_order_relaxed) == seq)) {
+                if (found)
+                    hint = {seq, start, end, info};
+                return found;
+            }
+            seq = sSequence.load(memory_order_acquire);
+        }
+    }
+
+
+    static const Value* resolveExternPointer(const void* dst, const void *dataStart,
+                                             slice externDestination) noexcept
+    {
+        dst = offsetby(dst, (char*)externDestination.end() - (char*)dataStart);
+        if (_usuallyFalse(!externDestination.containsAddress(dst)))
             return nullptr;
-        return scope;
+        return (const Value*)dst;
+    }
+
+
+    /*static*/ __hot const Scope* Scope::_containing(const Value *src) noexcept {
+        scopeInfo info;
+        return findScope(src, info) ? info.scope : nullptr;
     }
 
 
@@ -195,54 +435,54 @@ namespace fleece { namespace impl {
         v = resolveMutable(v);
         if (!v)
             return nullptr;
-        lock_guard<mutex> lock(sMutex);
         return _containing(v);
     }
 
 
     /*static*/ __hot SharedKeys* Scope::sharedKeys(const Value *v) noexcept {
-        lock_guard<mutex> lock(sMutex);
-        auto scope = _containing(v);
-        return scope ? scope->sharedKeys() : nullptr;
+        scopeInfo info;
+        return findScope(v, info) ? info.sk : nullptr;
     }
 
 
     const Value* Scope::resolveExternPointerTo(const void* dst) const noexcept {
-        dst = offsetby(dst, (char*)_externDestination.end() - (char*)_data.buf);
-        if (_usuallyFalse(!_externDestination.containsAddress(dst)))
-            return nullptr;
-        return (const Value*)dst;
+        return resolveExternPointer(dst, _data.buf, _externDestination);
     }
 
 
     /*static*/ const Value* Scope::resolvePointerFrom(const internal::Pointer* src,
                                                       const void *dst) noexcept
     {
-        lock_guard<mutex> lock(sMutex);
-        auto scope = _containing((const Value*)src);
-        return scope ? scope->resolveExternPointerTo(dst) : nullptr;
+        scopeInfo info;
+        if (!findScope(src, info))
+            return nullptr;
+        return resolveExternPointer(dst, info.dataStart, info.externDestination);
     }
 
 
     /*static*/ pair<const Value*,slice> Scope::resolvePointerFromWithRange(const Pointer* src,
                                                                          const void* dst) noexcept
     {
-        lock_guard<mutex> lock(sMutex);
-        auto scope = _containing((const Value*)src);
-        if (!scope)
+        scopeInfo info;
+        if (!findScope(src, info))
             return { };
-        return {scope->resolveExternPointerTo(dst), scope->externDestination()};
+        return {resolveExternPointer(dst, info.dataStart, info.externDestination),
+                info.externDestination};
     }
 
 
     void Scope::dumpAll() {
         lock_guard<mutex> lock(sMutex);
-        if (_usuallyFalse(!sMemoryMap)) {
+        memoryMap *map = sMemoryMap.load(memory_order_relaxed);
+        if (_usuallyFalse(!map)) {
             fprintf(stderr, "No Scopes have ever been registered.\n");
             return;
         }
-        for (auto &entry : *sMemoryMap) {
-            auto scope = entry.scope;
+        size_t size = sMemoryMapSize.load(memory_order_relaxed);
+        for (size_t i = 0; i < size; ++i) {
+            auto scope = map->entries[i].getScope();
+            if (!scope)
+                continue;
             fprintf(stderr, "%p -- %p (%4zu bytes) --> SharedKeys[%p]%s\n",
                     scope->_data.buf, scope->_data.end(), scope->_data.size, scope->sharedKeys(),
                     (scope->_isDoc ? " (Doc)" : ""));
@@ -297,12 +537,18 @@ namespace fleece { namespace impl {
         src = resolveMutable(src);
         if (!src)
             return nullptr;
+        // This has to use the Scope itself, so it locks sMutex to keep the Scope from being
+        // unregistered and freed meanwhile. The Doc may be still in its constructor, or already
+        // in its destructor waiting for the mutex, so it's only retained if its ref-count isn't
+        // zero.
         lock_guard<mutex> lock(sMutex);
-        const Scope *scope = _containing(src);
-        if (!scope)
+        auto doc = (const Doc*)_containing(src);
+        if (!doc || !tryRetain(doc))
             return nullptr;
-        assert_postcondition(scope->_isDoc);
-        return RetainedConst<Doc>((const Doc*)scope);
+        assert_postcondition(doc->_isDoc);
+        RetainedConst<Doc> result(doc);
+        release(doc);               // balances tryRetain
+        return result;
     }
 
 } }
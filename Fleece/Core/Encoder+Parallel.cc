@@ -0,0 +1,108 @@
+//
+// Encoder+Parallel.cc
+//
+// Copyright (c) 2021 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "Encoder.hh"
+#include "ParallelEncoding.hh"
+#include "FleeceImpl.hh"
+#include "SharedKeys.hh"
+#include "FleeceException.hh"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace fleece { namespace impl {
+    using namespace std;
+    using namespace internal;
+
+
+    // Walks an item on this thread before the parallel encoding starts:
+    // - Mutable arrays copy in their source's items the first time they're iterated, so each
+    //   mutable collection gets iterated here, before several threads read it.
+    // - Dict keys are added to the SharedKeys `sk` (if not null) in the order they're found, so
+    //   that the keys' numbers don't depend on the order the threads get to them.
+    static void prepareItem(const Value *value, SharedKeys* &sk) {
+        if (!value->isMutable() && !sk)
+            return;
+        if (auto array = value->asArray()) {
+            for (Array::iterator i(array); i; ++i)
+                prepareItem(i.value(), sk);
+        } else if (auto dict = value->asDict()) {
+            const SharedKeys *dictSK = nullptr;
+            for (Dict::iterator i(dict); i; ++i) {
+                if (sk && sk->count() >= sk->maxCount())
+                    sk = nullptr;           // It's full, so no more keys can be added
+                if (sk) {
+                    slice keyStr;
+                    if (i.key()->isInteger()) {
+                        if (!dictSK)
+                            dictSK = dict->sharedKeys();
+                        if (dictSK && dictSK != sk)
+                            keyStr = dictSK->decode((int)i.key()->asInt());
+                    } else {
+                        keyStr = i.key()->asString();
+                    }
+                    int key;
+                    if (keyStr)
+                        sk->encodeAndAdd(keyStr, key);
+                }
+                prepareItem(i.value(), sk);
+            }
+        }
+    }
+
+
+    // Writes an array whose items are encoded on multiple threads. Returns false, having written
+    // nothing, if the array is too small or the Encoder's configuration doesn't allow it.
+    bool Encoder::writeArrayInParallel(const Array *array) {
+        if (_base)
+            return false;
+        unsigned nThreads = _maxThreads ? _maxThreads : thread::hardware_concurrency();
+        nThreads = unsigned(min(size_t(nThreads), array->count() / kMinParallelItemsPerThread));
+        if (nThreads <= 1)
+            return false;
+
+        vector<const Value*> items;
+        items.reserve(array->count());
+        SharedKeys *sk = _sharedKeys;
+        for (Array::iterator i(array); i; ++i) {
+            items.push_back(i.value());
+            prepareItem(i.value(), sk);
+        }
+
+        // Encode fragments with about the same number of items, each on its own thread:
+        auto fragments = encodeFragments(nThreads, [&](unsigned f, EncodedFragment &frag) {
+            auto begin = items.data() + items.size() * f / nThreads;
+            auto end   = items.data() + items.size() * (f + 1) / nThreads;
+            Encoder enc;
+            enc.setSharedKeys(_sharedKeys);
+            enc.uniqueStrings(_uniqueStrings);
+            enc.setUniqueStringLimits(_maxUniqueStringSize, _maxUniqueStrings);
+            frag.positions.reserve(end - begin);
+            for (auto item = begin; item != end; ++item) {
+                enc.writeValue(*item);
+                frag.positions.push_back(enc.finishItem());
+            }
+            frag.data = enc.finish();
+        });
+
+        // Append the fragments, then write the array as pointers to every item:
+        writeFragmentsAsArray(fragments, *this);
+        return true;
+    }
+
+} }
@@ -37,6 +37,16 @@
 namespace fleece { namespace impl {
     using namespace internal;
 
+    // Flag set in a _strings entry's offset when the string is reused.
+    static constexpr uint32_t kStringReusedFlag = 0x80000000;
+
+    // Marks an integer key in valueArray::keys; its value is stored in the slice's size.
+    static const uint8_t kIntKeyMarker = 0;
+
+    static inline bool isIntKey(slice key) {
+        return key.buf == &kIntKeyMarker;
+    }
+
     const slice Encoder::kPreEncodedTrue  = {Value::kTrueValue,  kNarrow};
     const slice Encoder::kPreEncodedFalse = {Value::kFalseValue, kNarrow};
     const slice Encoder::kPreEncodedNull  = {Value::kNullValue,  kNarrow};
@@ -57,6 +67,14 @@ namespace fleece { namespace impl {
         init();
     }
 
+    Encoder::Encoder(WriterSink *sink)
+    :_out(sink),
+     _stack(kInitialStackSize),
+     _strings(10)
+    {
+        init();
+    }
+
     Encoder::~Encoder() {
     }
 
@@ -74,14 +92,40 @@ namespace fleece { namespace impl {
     }
 
     void Encoder::reset() {
-        if (_items)
-            _items->clear();
+        // Clear every open collection, not just the innermost, in case encoding was abandoned
+        // partway through (e.g. after a JSON parse error.)
+        for (unsigned i = 0; i < _stackDepth; ++i)
+            _stack[i].clear();
         _out.reset();
         _strings.clear();
+        _stringStorage.reset();
         _writingKey = _blockedOnKey = false;
         resetStack();
     }
 
+    void Encoder::setRetainsCapacity(bool retain) {
+        _out.setRetainsCapacity(retain);
+        _stringStorage.setRetainsCapacity(retain);
+    }
+
+    // Restores the configuration set by the constructor; used when returning to the pool.
+    void Encoder::restoreDefaults() {
+        reset();
+        _uniqueStrings = true;
+        setUniqueStringLimits(kDefaultMaxUniqueStringSize, kDefaultMaxUniqueStrings);
+        resetStringStats();
+        _sharedKeys = nullptr;
+        setBase(nullslice);
+        _trailer = true;
+        _maxThreads = 1;
+    }
+
+    void Encoder::setUniqueStringLimits(size_t maxSize, size_t maxCount) {
+        assert_precondition(maxCount > 0);
+        _maxUniqueStringSize = maxSize;
+        _maxUniqueStrings = maxCount;
+    }
+
     void Encoder::setSharedKeys(SharedKeys *s) {
         _sharedKeys = s;
     }
@@ -306,30 +350,40 @@ namespace fleece { namespace impl {
                 buf += PutUVarInt(buf, s.size);
             }
             memcpy(buf, s.buf, s.size);
-            if (_out.outputFile())
-                buf = nullptr;          // ephemeral if writing to file
+            if (_out.sink())
+                buf = nullptr;          // ephemeral if writing to a sink
         }
         return buf;
     }
 
     // Writes a string, or a pointer to an already-written copy of the same string.
-    // This is the main body of writeString() and writeKey().
+    // This is the main body of writeString() and writeKey(). The hash may be Empty if it's not
+    // known yet.
     // Returns the address where s got written to, if possible, just like writeData above.
-    const void* Encoder::_writeString(slice s) {
-        if (!_usuallyTrue(_uniqueStrings && s.size >= kNarrow && s.size <= kMaxSharedStringSize)) {
+    const void* Encoder::_writeString(slice s, StringTable::hash_t hash) {
+        if (!_usuallyTrue(_uniqueStrings && s.size >= kNarrow && s.size <= _maxUniqueStringSize)) {
             // Not uniquing this string, so just write it:
+            if (_uniqueStrings && s.size > _maxUniqueStringSize)
+                ++_stringStats.skipped;
             return writeData(kStringTag, s);
         }
 
+        if (_usuallyFalse(_strings.count() >= _maxUniqueStrings))
+            evictStrings();
+
         // Check whether this string's already been written:
         StringTable::entry_t *entry;
         bool isNew;
-        std::tie(entry, isNew) = _strings.insert(s, 0);
+        if (hash == StringTable::hash_t::Empty)
+            hash = StringTable::hashCode(s);
+        std::tie(entry, isNew) = _strings.insert(s, 0, hash);
         if (!isNew) {
             // String exists: Write pointer to it, as long as the offset's not too large:
-            ssize_t offset = entry->second - _base.size;
+            ssize_t offset = (entry->second & ~kStringReusedFlag) - _base.size;
             if (_items->wide || nextWritePos() - offset <= Pointer::kMaxNarrowOffset - 32) {
                 writePointer(offset);
+                entry->second |= kStringReusedFlag;
+                ++_stringStats.hits;
                 if (offset < 0) {
                     const void *stringVal = &_base[_base.size + offset];
                     if (stringVal < _baseMinUsed)
@@ -344,7 +398,8 @@ namespace fleece { namespace impl {
 
         // Write the string to the output:
         auto offset = _base.size + nextWritePos();
-        throwIf(offset > 1u<<31, MemoryError, "encoded data too large");
+        throwIf(offset >= kStringReusedFlag, MemoryError, "encoded data too large");
+        ++_stringStats.misses;
         const void* writtenStr = writeData(kStringTag, s);
 
         if (!writtenStr) {
@@ -356,10 +411,31 @@ namespace fleece { namespace impl {
         return writtenStr;
     }
 
+    // Makes room in _strings by evicting the strings that haven't been reused since the last
+    // eviction, and clearing the flags of those that have. If that doesn't free at least half
+    // the table, evicts everything.
+    void Encoder::evictStrings() {
+        size_t evicted = _strings.removeIf([](StringTable::entry_t &entry) {
+            if (entry.second & kStringReusedFlag) {
+                entry.second &= ~kStringReusedFlag;
+                return false;
+            }
+            return true;
+        });
+        if (_strings.count() > _maxUniqueStrings / 2) {
+            evicted += _strings.count();
+            _strings.clear();
+        }
+        _stringStats.evicted += evicted;
+    }
+
     // Adds a preexisting string to the cache
     void Encoder::cacheString(slice s, size_t offsetInBase) {
-        if (_usuallyTrue(_uniqueStrings && s.size >= kNarrow && s.size <= kMaxSharedStringSize))
+        if (_usuallyTrue(_uniqueStrings && s.size >= kNarrow && s.size <= _maxUniqueStringSize)) {
+            if (_usuallyFalse(_strings.count() >= _maxUniqueStrings))
+                evictStrings();
             _strings.insert(s, uint32_t(offsetInBase));
+        }
     }
 
     void Encoder::writeData(slice s) {
@@ -472,6 +548,9 @@ namespace fleece { namespace impl {
                 writeData(value->asData());
                 break;
             case kArrayTag: {
+                if (_usuallyFalse(_maxThreads != 1) && !writeNestedValue
+                        && writeArrayInParallel(value->asArray()))
+                    break;
                 ++_copyingCollection;
                 auto iter = value->asArray()->begin();
                 beginArray(iter.count());
@@ -489,16 +568,38 @@ namespace fleece { namespace impl {
                 if (dict->isMutable()) {
                     dict->heapDict()->writeTo(*this/*, writeNestedValue*/);
                 } else {
+                    // The source's keys are already sorted. They stay sorted if each key is
+                    // written as the same kind (integer or string), and integer keys belong to
+                    // the same SharedKeys; in that case the Dict doesn't need to be sorted again.
+                    bool presorted = true;
+                    size_t knownKeyCount = 0;
                     auto iter = dict->begin();
                     beginDictionary(iter.count());
                     for (; iter; ++iter) {
                         if (!writeNestedValue || !(*writeNestedValue)(iter.key(), iter.value())) {
-                            if (!sk && iter.key()->isInteger())
+                            bool intKey = iter.key()->isInteger();
+                            if (!sk && intKey)
                                 sk = value->sharedKeys();
-                            writeKey(iter.key(), sk);
+                            if (intKey && sk && sk == _sharedKeys) {
+                                // Same SharedKeys, so copy the key as-is. Checking it against a
+                                // cached count avoids locking the SharedKeys for every key.
+                                int key = (int)iter.key()->asInt();
+                                if ((size_t)key >= knownKeyCount)
+                                    knownKeyCount = sk->count();
+                                throwIf((size_t)key >= knownKeyCount,
+                                        InvalidData, "Unrecognized integer key");
+                                writeKey(key);
+                            } else {
+                                writeKey(iter.key(), sk);
+                                if (presorted)
+                                    presorted = !intKey && !isIntKey(_items->keys.back());
+                            }
                             writeValue(iter.value(), sk, writeNestedValue);
+                        } else {
+                            presorted = false;      // callback may have written a different key
                         }
                     }
+                    _items->presorted = presorted;
                     endDictionary();
                 }
                 --_copyingCollection;
@@ -579,14 +680,18 @@ namespace fleece { namespace impl {
         _blockedOnKey = false;
     }
 
-    void Encoder::writeKey(slice s) {
-        int encoded;
-        if (_sharedKeys && _sharedKeys->encodeAndAdd(s, encoded)) {
-            writeKey(encoded);
-            return;
+    void Encoder::writeKey(slice s, StringTable::hash_t hash) {
+        if (_sharedKeys) {
+            if (hash == StringTable::hash_t::Empty)
+                hash = StringTable::hashCode(s);
+            int encoded;
+            if (_sharedKeys->encodeAndAdd(s, encoded, hash)) {
+                writeKey(encoded);
+                return;
+            }
         }
         addingKey();
-        const void* writtenKey = _writeString(s);
+        const void* writtenKey = _writeString(s, hash);
         if (!writtenKey && _copyingCollection)
             writtenKey = s.buf;         // Workaround for written strings not being kept in memory by the Writer if it's writing to a file
         addedKey({writtenKey, s.size});
@@ -596,7 +701,7 @@ namespace fleece { namespace impl {
         assert_precondition(_sharedKeys || n == Dict::kMagicParentKey || gDisableNecessarySharedKeysCheck);
         addingKey();
         writeInt(n);
-        addedKey(nullslice);
+        addedKey(slice(&kIntKeyMarker, size_t(n)));
     }
 
     void Encoder::writeKey(const Value *key, const SharedKeys *sk) {
@@ -636,7 +741,7 @@ namespace fleece { namespace impl {
     }
 
     void Encoder::addedKey(slice str) {
-        // Note: str will be nullslice iff the key is numeric
+        // Note: str.buf will be null if the key is an inline string, or kIntKeyMarker if numeric
         _items->keys.push_back(str);
     }
 
@@ -706,7 +811,8 @@ namespace fleece { namespace impl {
         if (_usuallyTrue(count > 0)) {
             if (_usuallyTrue(tag == kDictTag)) {
                 count /= 2;
-                sortDict(*items);
+                if (!items->presorted)
+                    sortDict(*items);
             }
 
             // Write the array/dict header to the outer Value:
@@ -751,47 +857,147 @@ namespace fleece { namespace impl {
         items->clear();
     }
 
-    // compares dictionary keys as slices. If a slice has a null `buf`, it represents an integer
-    // key, whose value is in the `size` field.
-    static inline int compareKeysByIndex(const slice *sa, const slice *sb) {
-        if (sa->buf) {
-            if (sb->buf)
-                return sa->compare(*sb) < 0;                // string key comparison
+    // Compares dictionary keys as slices. If a slice has a null `buf`, it represents an integer
+    // key, whose value is in the `size` field. Integer keys sort before string keys.
+    static inline bool keyLessThan(const slice &a, const slice &b) {
+        if (a.buf) {
+            if (b.buf)
+                return a.compare(b) < 0;                    // string key comparison
             else
                 return false;
         } else {
-            if (sb->buf)
+            if (b.buf)
                 return true;
             else
-                return (int)sa->size < (int)sb->size;       // integer key comparison
+                return (int)a.size < (int)b.size;           // integer key comparison
         }
     }
 
+    // A string key, with its first 8 bytes as a big-endian integer for fast comparison.
+    struct PrefixedKey {
+        uint64_t prefix;
+        const slice *key;
+
+        void set(const slice *k) {
+            key = k;
+            prefix = 0;
+            memcpy(&prefix, k->buf, std::min(k->size, sizeof(prefix)));
+            prefix = endian::enc64(prefix);
+        }
+
+        // Zero-padding a short key keeps the prefixes in lexicographic order, as long as
+        // equal prefixes fall back to comparing the whole keys.
+        bool operator< (const PrefixedKey &other) const {
+            if (prefix != other.prefix)
+                return prefix < other.prefix;
+            return key->compare(*other.key) < 0;
+        }
+    };
+
+    template <class T, class LESS>
+    static void insertionSort(T *items, size_t n, LESS less) {
+        for (size_t i = 1; i < n; i++) {
+            T item = items[i];
+            size_t j = i;
+            for (; j > 0 && less(item, items[j-1]); --j)
+                items[j] = items[j-1];
+            items[j] = item;
+        }
+    }
+
+    static constexpr size_t kMaxInsertionSort = 16;
+
+    // Sorts integer keys with a radix sort on their values biased by 2048, 6 bits per pass.
+    // They're usually short ints (-2048...2047), which take two passes; extended shared keys
+    // (up to SharedKeys::kMaxExtendedCount) take three. Any other ints get a comparison sort.
+    static void sortIntKeys(const slice* *keys, size_t n) {
+        auto intLess = [](const slice *a, const slice *b) {return (int)a->size < (int)b->size;};
+        if (n <= kMaxInsertionSort) {
+            insertionSort(keys, n, intLess);
+            return;
+        }
+        auto biased = [](const slice *k) {return unsigned(int(k->size) + 2048);};
+        unsigned maxKey = 0;
+        for (size_t i = 0; i < n; i++)
+            maxKey = std::max(maxKey, biased(keys[i]));     // (keys < -2048 become huge)
+        if (_usuallyFalse(maxKey >= (1u << 18))) {
+            std::sort(keys, keys + n, intLess);
+            return;
+        }
+        unsigned nBits = (maxKey < 4096) ? 12 : 18;
+        auto digit = [&](const slice *k, unsigned shift) {
+            return (biased(k) >> shift) & 0x3F;
+        };
+        TempArray(tmp, const slice*, n);
+        const slice* *src = keys, * *dst = tmp;
+        for (unsigned shift = 0; shift < nBits; shift += 6) {
+            size_t offsets[64] = { };
+            for (size_t i = 0; i < n; i++)
+                ++offsets[digit(src[i], shift)];
+            size_t total = 0;
+            for (auto &offset : offsets) {
+                size_t count = offset;
+                offset = total;
+                total += count;
+            }
+            for (size_t i = 0; i < n; i++)
+                dst[offsets[digit(src[i], shift)]++] = src[i];
+            std::swap(src, dst);
+        }
+        if (src != keys)
+            memcpy(keys, src, n * sizeof(keys[0]));     // after an odd number of passes
+    }
+
+    static void sortStringKeys(const slice* *keys, size_t n) {
+        TempArray(prefixed, PrefixedKey, n);
+        for (size_t i = 0; i < n; i++)
+            prefixed[i].set(keys[i]);
+        if (n <= kMaxInsertionSort)
+            insertionSort(&prefixed[0], n, std::less<PrefixedKey>());
+        else
+            std::sort(&prefixed[0], &prefixed[n]);
+        for (size_t i = 0; i < n; i++)
+            keys[i] = prefixed[i].key;
+    }
+
     void Encoder::sortDict(valueArray &items) {
         auto &keys = items.keys;
         size_t n = keys.size();
         if (n < 2)
             return;
 
-        // Fill in the pointers of any keys that refer to inline strings:
+        // Fill in the pointers of any keys that refer to inline strings, and check whether the
+        // keys are already in order, as they are when copying a Dict or a MutableDict:
+        bool sorted = true;
+        size_t nIntKeys = 0;
         for (unsigned i = 0; i < n; i++) {
-            if (keys[i].buf == nullptr) {
+            if (isIntKey(keys[i])) {
+                keys[i].setBuf(nullptr);                                    // integer
+                ++nIntKeys;
+            } else if (keys[i].buf == nullptr) {
                 const Value *item = &items[2*i];
-                if (item->tag() == kStringTag) {
-                    keys[i].setBuf(offsetby(item, 1));                      // inline string
-                } else {
-                    assert(item->tag() == kShortIntTag);
-                    keys[i] = slice(nullptr, (size_t)item->asUnsigned());   // integer
-                }
+                assert(item->tag() == kStringTag);
+                keys[i].setBuf(offsetby(item, 1));                          // inline string
             }
+            if (sorted && i > 0 && keyLessThan(keys[i], keys[i-1]))
+                sorted = false;
         }
+        if (sorted)
+            return;
 
-        // Construct an array that describes the permutation of item indices:
+        // Construct an array that describes the permutation of item indices. Integer keys go
+        // first, then string keys; each group is sorted separately:
         TempArray(indices, const slice*, n);
         const slice* base = &keys[0];
-        for (unsigned i = 0; i < n; i++)
-            indices[i] = base + i;
-        std::sort(&indices[0], &indices[n], &compareKeysByIndex);
+        size_t nInts = 0, nStrings = nIntKeys;
+        for (unsigned i = 0; i < n; i++) {
+            if (base[i].buf)
+                indices[nStrings++] = base + i;
+            else
+                indices[nInts++] = base + i;
+        }
+        sortIntKeys(&indices[0], nIntKeys);
+        sortStringKeys(&indices[nIntKeys], n - nIntKeys);
         // indices[i] is now a pointer to the Value that should go at index i
 
         // Now rewrite items according to the permutation in indices:
@@ -807,4 +1013,35 @@ namespace fleece { namespace impl {
         }
     }
 
+
+#pragma mark - POOLEDENCODER:
+
+
+    static constexpr size_t kMaxPooledEncoders = 4;
+
+    // Idle Encoders available to be borrowed by the current thread.
+    static thread_local std::vector<std::unique_ptr<Encoder>> tEncoderPool;
+
+
+    PooledEncoder::PooledEncoder() {
+        if (!tEncoderPool.empty()) {
+            _encoder = std::move(tEncoderPool.back());
+            tEncoderPool.pop_back();
+        } else {
+            _encoder.reset(new Encoder);
+            _encoder->setRetainsCapacity(true);
+        }
+    }
+
+
+    PooledEncoder::~PooledEncoder() {
+        if (tEncoderPool.size() < kMaxPooledEncoders) {
+            try {
+                _encoder->restoreDefaults();
+                tEncoderPool.reserve(kMaxPooledEncoders);
+                tEncoderPool.push_back(std::move(_encoder));
+            } catch (...) { }       // if anything goes wrong, just let the Encoder be freed
+        }
+    }
+
 } }
@@ -24,6 +24,7 @@
 #include "StringTable.hh"
 #include "SmallVector.hh"
 #include "function_ref.hh"
+#include <memory>
 
 
 namespace fleece { namespace impl {
@@ -37,12 +38,39 @@ namespace fleece { namespace impl {
         /** Constructs an encoder. */
         Encoder(size_t reserveOutputSize =256);
         Encoder(FILE* NONNULL);
+
+        /** Constructs an encoder that writes directly into memory provided by a sink, such as
+            a mapped file region. The output is committed to the sink by `end()`. */
+        explicit Encoder(WriterSink* NONNULL);
         ~Encoder();
 
         /** Sets the uniqueStrings property. If true (the default), the encoder tries to write
             each unique string only once. This saves space but makes the encoder slightly slower. */
         void uniqueStrings(bool b)      {_uniqueStrings = b;}
 
+        static constexpr size_t kDefaultMaxUniqueStringSize = internal::kMaxSharedStringSize;
+        static constexpr size_t kDefaultMaxUniqueStrings = 64 * 1024;
+
+        /** Limits the work and memory spent on uniqueStrings. Only strings of up to `maxSize`
+            bytes are de-duplicated, and at most `maxCount` of them are remembered at once.
+            When that many are remembered, the ones that haven't been reused since the last
+            eviction are forgotten (or all of them, if most have been reused.)
+            (When writing to a file or sink, the bytes of forgotten strings are only freed by
+            `reset()`.) */
+        void setUniqueStringLimits(size_t maxSize, size_t maxCount);
+
+        /** Statistics about uniqueStrings, to help tune its limits. */
+        struct StringStats {
+            size_t hits;        ///< Strings written as pointers to an earlier copy
+            size_t misses;      ///< Strings written in full and remembered
+            size_t skipped;     ///< Strings too long to de-duplicate
+            size_t evicted;     ///< Strings forgotten to stay under the count limit
+        };
+
+        /** Returns the statistics accumulated since construction or `resetStringStats()`. */
+        const StringStats& stringStats() const  {return _stringStats;}
+        void resetStringStats()                 {_stringStats = { };}
+
         /** Sets the base Fleece data that the encoded data will be (logically) appended to.
             Any writeValue() calls whose Value points into the base data will be written as
             pointers.
@@ -63,6 +91,21 @@ namespace fleece { namespace impl {
 
         bool valueIsInBase(const Value *value) const;
 
+        /** Sets the maximum number of threads `writeValue()` may use; the default is 1.
+            With more than one, the items of a large array (such as a big MutableArray of
+            dicts) are divided into contiguous ranges that are encoded concurrently into
+            separate fragments, which are then appended to the output, followed by an array of
+            pointers to the items.
+            The result is valid Fleece with the same contents, but not byte-for-byte identical:
+            strings are only de-duplicated within a fragment, and every item is referenced by
+            pointer. Not used when a base is set.
+            The values being written must not be modified, by any thread, during the call.
+            @param maxThreads  The maximum number of threads, or 0 to use one per CPU core. */
+        void setMaxThreads(unsigned maxThreads)     {_maxThreads = maxThreads;}
+
+        /** Arrays with fewer items than this (per thread) are not worth encoding in parallel. */
+        static constexpr size_t kMinParallelItemsPerThread = 64;
+
         bool isEmpty() const            {return _out.length() == 0 && _stackDepth == 1 && _items->empty();}
         size_t bytesWritten() const     {return _out.length();} // may be an underestimate
 
@@ -78,6 +121,12 @@ namespace fleece { namespace impl {
         /** Resets the encoder so it can be used again. */
         void reset();
 
+        /** If true, `reset()` and `finish()` keep all the memory the encoder has allocated
+            (output buffers, string table, collection stacks), so that encoding a similar
+            document again doesn't allocate anything apart from the output `alloc_slice`.
+            `PooledEncoder` turns this on. */
+        void setRetainsCapacity(bool);
+
         /////// Writing data:
 
         void writeNull();
@@ -91,6 +140,10 @@ namespace fleece { namespace impl {
 
         void writeString(slice s)                           {(void)_writeString(s);}
 
+        /** Same as writeString(slice), but takes the string's hash, which must be equal to
+            `StringTable::hashCode(s)`. Saves time if the caller already has the hash. */
+        void writeString(slice s, StringTable::hash_t hash) {(void)_writeString(s, hash);}
+
         void writeDateString(int64_t timestamp, bool asUTC =true);
 
         void writeData(slice s);
@@ -139,7 +192,12 @@ namespace fleece { namespace impl {
         void endDictionary();
 
         /** Writes a key to the current dictionary. This must be called before adding a value. */
-        void writeKey(slice);
+        void writeKey(slice s)                  {writeKey(s, StringTable::hash_t::Empty);}
+
+        /** Same as writeKey(slice), but takes the key's hash, which must be equal to
+            `StringTable::hashCode(s)`. The hash is used both to look up the key in the
+            SharedKeys and to de-duplicate it, so it's computed at most once. */
+        void writeKey(slice s, StringTable::hash_t hash);
 
         /** Writes a string or int Value as a key to the current dictionary. */
         void writeKey(const Value* NONNULL, const SharedKeys* =nullptr);
@@ -174,6 +232,9 @@ namespace fleece { namespace impl {
         void writeRaw(slice s)                  {_out.write(s);}
         size_t nextWritePos();
         size_t finishItem();
+        /** Writes a pointer to a Value already written to the output at position `pos`,
+            e.g. as returned by finishItem(), or inside data written by writeRaw(). */
+        void writePointerTo(size_t pos)         {writePointer(ssize_t(pos));}
         slice base() const                      {return _base;}
         slice baseUsed() const                  {return _baseMinUsed != 0 ? slice(_baseMinUsed, _base.end()) : slice();}
         const StringTable& strings() const      {return _strings;}
@@ -187,6 +248,8 @@ namespace fleece { namespace impl {
     private:
         using byte = uint8_t;
 
+        void restoreDefaults();
+
         static constexpr size_t kInitialStackSize = 4;
         static constexpr size_t kInitialCollectionCapacity = 16;
 
@@ -194,10 +257,11 @@ namespace fleece { namespace impl {
         class valueArray : public smallVector<Value, kInitialCollectionCapacity> {
         public:
             valueArray()                    { }
-            void reset(internal::tags t)    {tag = t; wide = false; keys.clear();}
+            void reset(internal::tags t)    {tag = t; wide = false; presorted = false; keys.clear();}
             
             internal::tags tag;
             bool wide;
+            bool presorted;                 // Dict keys are known to be in order already
             smallVector<slice, kInitialCollectionCapacity> keys;
         };
 
@@ -215,7 +279,8 @@ namespace fleece { namespace impl {
         void writeInt(uint64_t i, bool isShort, bool isUnsigned);
         void _writeFloat(float);
         const void* writeData(internal::tags, slice s);
-        const void* _writeString(slice);
+        const void* _writeString(slice, StringTable::hash_t =StringTable::hash_t::Empty);
+        void evictStrings();
         void addingKey();
         void addedKey(slice str);
         void sortDict(valueArray &items);
@@ -227,6 +292,7 @@ namespace fleece { namespace impl {
         void writeKey(int);
         void writeValue(const Value* NONNULL, const WriteValueFunc*);
         void writeValue(const Value* NONNULL, const SharedKeys* &, const WriteValueFunc*);
+        bool writeArrayInParallel(const Array* NONNULL);
         const Value* minUsed(const Value *value);
 
         Encoder(const Encoder&) = delete;
@@ -243,6 +309,9 @@ namespace fleece { namespace impl {
         PreallocatedStringTable<kInitialStringTableSize> _strings; // Maps strings to the offsets where they appear as values
         Writer _stringStorage;       // Backing store for strings in _strings
         bool _uniqueStrings {true};  // Should strings be uniqued before writing?
+        size_t _maxUniqueStringSize {kDefaultMaxUniqueStringSize}; // Longest string to unique
+        size_t _maxUniqueStrings {kDefaultMaxUniqueStrings}; // Max entries in _strings
+        StringStats _stringStats { }; // uniqueStrings statistics
         Retained<SharedKeys> _sharedKeys;  // Client-provided key-to-int mapping
         slice _base;                 // Base Fleece data being appended to (if any)
         const void* _baseCutoff {0}; // Lowest addr in _base that I can write a ptr to
@@ -252,8 +321,10 @@ namespace fleece { namespace impl {
         bool _blockedOnKey  {false}; // True if writes should be refused
         bool _trailer       {true};  // Write standard trailer at end?
         bool _markExternPtrs{false}; // Mark pointers outside encoded data as 'extern'
+        unsigned _maxThreads {1};    // Max threads for encoding large arrays
 
         friend class EncoderTests;
+        friend class PooledEncoder;
 #ifndef NDEBUG
     public: // Statistics for use in tests
         unsigned _numNarrow {0}, _numWide {0}, _narrowCount {0}, _wideCount {0},
@@ -261,4 +332,24 @@ namespace fleece { namespace impl {
 #endif
     };
 
+
+    /** Borrows an Encoder from a per-thread pool, and returns it to the pool when destroyed.
+        Pooled Encoders retain their capacity, so encoding many small documents with them avoids
+        reallocating the encoder's internal buffers for each one. The Encoder is in its default
+        configuration when borrowed. */
+    class PooledEncoder {
+    public:
+        PooledEncoder();
+        ~PooledEncoder();
+
+        Encoder& operator* () const             {return *_encoder;}
+        Encoder* operator-> () const            {return _encoder.get();}
+
+    private:
+        PooledEncoder(const PooledEncoder&) = delete;
+        PooledEncoder& operator=(const PooledEncoder&) = delete;
+
+        std::unique_ptr<Encoder> _encoder;
+    };
+
 } }
@@ -0,0 +1,199 @@
+//
+// JSONConverter+Parallel.cc
+//
+// Copyright (c) 2021 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "JSONConverter.hh"
+#include "ParallelEncoding.hh"
+#include "SharedKeys.hh"
+#include "FleeceException.hh"
+#include "SmallVector.hh"
+#include "jsonsl.h"
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fleece { namespace impl {
+    using namespace std;
+    using namespace internal;
+
+
+    namespace {
+        // A top-level array element, as a range of the structural index.
+        struct Element {
+            const uint32_t *begin, *end;
+        };
+    }
+
+
+    // Finds the elements of the root array by walking the structural index. Returns false if
+    // the root isn't an array, or if the top level of the array has any syntax errors (nested
+    // values get checked later, when they're parsed.)
+    static bool findElements(slice json, const JSONScanner &scanner, vector<Element> &elements) {
+        auto start = (const char*)json.buf;
+        const uint32_t *i = scanner.begin(), *end = scanner.end();
+        if (i == end || start[*i] != '[' || scanner.endsInString())
+            return false;
+        const uint32_t *elementStart = ++i;
+        int depth = 0;
+        for (; i != end; ++i) {
+            switch (start[*i]) {
+                case '"':
+                    ++i;                    // skip closing quote
+                    break;
+                case '[':
+                case '{':
+                    ++depth;
+                    break;
+                case ']':
+                case '}':
+                    if (depth-- > 0)
+                        break;
+                    // End of the root array:
+                    if (start[*i] != ']' || i + 1 != end)
+                        return false;
+                    if (i == elementStart) {
+                        if (!elements.empty())
+                            return false;   // trailing comma
+                    } else {
+                        elements.push_back({elementStart, i});
+                    }
+                    return true;
+                case ',':
+                    if (depth == 0) {
+                        if (i == elementStart)
+                            return false;   // missing element
+                        elements.push_back({elementStart, i});
+                        elementStart = i + 1;
+                    }
+                    break;
+            }
+        }
+        return false;                       // root array isn't closed
+    }
+
+
+    // Adds the keys of every dict in the JSON to the SharedKeys, in the order they appear.
+    static void addSharedKeys(slice json, const JSONScanner &scanner, SharedKeys *sk) {
+        if (!sk)
+            return;
+        auto start = (const char*)json.buf;
+        smallVector<char, 32> stack;        // '[' or '{' for every open collection
+        char prev = 0;                      // The previous structural character
+        string unescaped;
+        for (const uint32_t *i = scanner.begin(), *end = scanner.end(); i != end; ++i) {
+            char c = start[*i];
+            switch (c) {
+                case '"':
+                    if (i + 1 == end)
+                        return;
+                    if (!stack.empty() && stack.back() == '{' && (prev == '{' || prev == ',')) {
+                        if (sk->count() >= sk->maxCount())
+                            return;         // It's full, so no more keys can be added
+                        slice str(&start[i[0] + 1], i[1] - i[0] - 1);
+                        if (str.findByte('\\')) {
+                            unescaped.resize(str.size);
+                            jsonsl_error_t err = JSONSL_ERROR_SUCCESS;
+                            const char *errat;
+                            auto size = jsonsl_util_unescape_ex((const char*)str.buf,
+                                                                &unescaped[0], str.size,
+                                                                nullptr, nullptr, &err, &errat);
+                            str = err ? slice() : slice(unescaped.data(), size);
+                        }
+                        int key;
+                        if (str)
+                            sk->encodeAndAdd(str, key);
+                    }
+                    ++i;                    // skip closing quote
+                    break;
+                case '[':
+                case '{':
+                    stack.push_back(c);
+                    break;
+                case ']':
+                case '}':
+                    if (!stack.empty())
+                        stack.pop_back();
+                    break;
+            }
+            prev = c;
+        }
+    }
+
+
+    /*static*/ alloc_slice JSONConverter::convertJSONParallel(slice json, SharedKeys *sk,
+                                                            unsigned maxThreads)
+    {
+        unsigned nThreads = maxThreads ? maxThreads : thread::hardware_concurrency();
+        nThreads = unsigned(min(size_t(nThreads), json.size / kMinParallelBytesPerThread));
+        if (nThreads <= 1 || json.size > UINT32_MAX)
+            return convertJSON(json, sk, kStructuralParser);
+
+        // Index the JSON, and find the root array's elements:
+        JSONScanner scanner;
+        scanner.scan(json);
+        vector<Element> elements;
+        if (!findElements(json, scanner, elements) || elements.size() < nThreads)
+            return convertJSON(json, sk, kStructuralParser);
+
+        // Add the dict keys to the SharedKeys up front, so their numbers don't depend on the
+        // order the threads get to them:
+        addSharedKeys(json, scanner, sk);
+
+        // Divide the elements into fragments of about the same size in bytes:
+        vector<const Element*> fragmentStart(nThreads + 1);
+        const Element *elem = elements.data(), *lastElem = elem + elements.size();
+        for (unsigned f = 0; f < nThreads; ++f) {
+            size_t endPos = json.size * (f + 1) / nThreads;
+            fragmentStart[f] = elem;
+            while (elem < lastElem && (*elem->begin < endPos || f == nThreads - 1))
+                ++elem;
+        }
+        fragmentStart[nThreads] = lastElem;
+
+        // Convert each fragment to Fleece on its own thread:
+        auto fragments = encodeFragments(nThreads, [&](unsigned f, EncodedFragment &frag) {
+            auto begin = fragmentStart[f], end = fragmentStart[f + 1];
+            if (begin == end)
+                return;
+            size_t nBytes = *(end - 1)->end - *begin->begin;
+            Encoder enc(nBytes);
+            enc.setSharedKeys(sk);
+            JSONConverter cvt(enc, kStructuralParser);
+            cvt.beginInput();
+            cvt._input = json;
+            frag.positions.reserve(end - begin);
+            for (auto e = begin; e != end; ++e) {
+                cvt.encodeStructural(json, e->begin, e->end);
+                throwIf(cvt._jsonError != JSONSL_ERROR_SUCCESS, JSONError, cvt.errorMessage());
+                frag.positions.push_back(enc.finishItem());
+            }
+            frag.data = enc.finish();
+        });
+
+        // Concatenate the fragments, then add a root array pointing to every element:
+        size_t totalSize = 0;
+        for (auto &frag : fragments)
+            totalSize += frag.data.size;
+        throwIf(totalSize > 1u<<31, MemoryError, "encoded data too large");
+
+        Encoder enc(totalSize + 4 * elements.size() + 64);
+        writeFragmentsAsArray(fragments, enc);
+        return enc.finish();
+    }
+
+} }
@@ -36,9 +36,10 @@ namespace fleece { namespace impl {
                                  struct jsonsl_state_st *state,
                                  const char *buf) noexcept;
 
-    JSONConverter::JSONConverter(Encoder &e) noexcept
+    JSONConverter::JSONConverter(Encoder &e, Parser parser) noexcept
     :_encoder(e),
-     _jsn(jsonsl_new(50)),      // never returns nullptr, according to source code
+     _parser(parser),
+     _jsn(jsonsl_new(kMaxLevels)),      // never returns nullptr, according to source code
      _jsonError(JSONSL_ERROR_SUCCESS),
      _errorPos(0)
     {
@@ -51,6 +52,8 @@ namespace fleece { namespace impl {
 
     void JSONConverter::reset() {
         jsonsl_reset(_jsn);
+        _feeding = false;
+        _pending.clear();
         _jsonError = JSONSL_ERROR_SUCCESS;
         _errorPos = 0;
     }
@@ -67,33 +70,94 @@ namespace fleece { namespace impl {
     }
 
 
-    bool JSONConverter::encodeJSON(slice json) {
-        _input = json;
+    void JSONConverter::beginInput() {
         _errorMessage.clear();
         _errorCode = NoError;
         _jsonError = JSONSL_ERROR_SUCCESS;
         _errorPos = 0;
+        _inputStart = 0;
+        _tokenStart = kNoToken;
+        _pending.clear();
+    }
 
-        _jsn->data = this;
-        _jsn->action_callback_PUSH = writePushCallback;
-        _jsn->action_callback_POP  = writePopCallback;
-        _jsn->error_callback = errorCallback;
-        jsonsl_enable_all_callbacks(_jsn);
 
-        jsonsl_feed(_jsn, (char*)json.buf, json.size);
+    bool JSONConverter::encodeJSON(slice json) {
+        if (_parser == kStructuralParser && _usuallyTrue(json.size <= UINT32_MAX)) {
+            beginInput();
+            _input = json;
+            _scanner.scan(json);
+            encodeStructural(json, _scanner.begin(), _scanner.end());
+            return (_jsonError == JSONSL_ERROR_SUCCESS);
+        }
+        feed(json);
+        return finish();
+    }
+
+
+    bool JSONConverter::feed(slice chunk) {
+        if (!_feeding) {
+            beginInput();
+            _jsn->data = this;
+            _jsn->action_callback_PUSH = writePushCallback;
+            _jsn->action_callback_POP  = writePopCallback;
+            _jsn->error_callback = errorCallback;
+            jsonsl_enable_all_callbacks(_jsn);
+            _feeding = true;
+        }
+        if (_jsonError)
+            return false;
+
+        _input = chunk;
+        jsonsl_feed(_jsn, (char*)chunk.buf, chunk.size);
+
+        // If a string or number is still open, save its bytes for when it ends in a later chunk:
+        if (_tokenStart != kNoToken && !_jsonError) {
+            if (_tokenStart >= _inputStart) {
+                _pending.assign((const char*)chunk.buf + (_tokenStart - _inputStart),
+                                (const char*)chunk.end());
+                _pendingStart = _tokenStart;
+            } else {
+                _pending.append((const char*)chunk.buf, chunk.size);
+            }
+        } else {
+            _pending.clear();
+        }
+        _inputStart += chunk.size;
+        _input = nullslice;
+        return (_jsonError == JSONSL_ERROR_SUCCESS);
+    }
+
+
+    bool JSONConverter::finish() {
         if (_jsn->level > 0 && !_jsonError) {
             // Input is valid JSON so far, but truncated:
             _jsonError = kErrTruncatedJSON;
-            _errorPos = json.size;
+            _errorPos = _inputStart;
         }
         jsonsl_reset(_jsn);
+        _feeding = false;
+        _pending.clear();
+        _pending.shrink_to_fit();
         return (_jsonError == JSONSL_ERROR_SUCCESS);
     }
 
-    /*static*/ alloc_slice JSONConverter::convertJSON(slice json, SharedKeys *sk) {
+
+    // Returns a pointer to the start of the current string/number token in the input.
+    // If the token began in an earlier chunk passed to feed(), the rest of it (up to and including
+    // the delimiter at `pos_cur`) is appended to the bytes saved in `_pending`.
+    const char* JSONConverter::tokenStart(struct jsonsl_state_st *state) {
+        _tokenStart = kNoToken;
+        if (_usuallyTrue(state->pos_begin >= _inputStart))
+            return (const char*)_input.buf + (state->pos_begin - _inputStart);
+        _pending.append((const char*)_input.buf, state->pos_cur - _inputStart + 1);
+        return _pending.data() + (state->pos_begin - _pendingStart);
+    }
+
+
+    /*static*/ alloc_slice JSONConverter::convertJSON(slice json, SharedKeys *sk, Parser parser) {
         Encoder enc;
         enc.setSharedKeys(sk);
-        JSONConverter cvt(enc);
+        JSONConverter cvt(enc, parser);
         throwIf(!cvt.encodeJSON(slice(json)), JSONError, cvt.errorMessage());
         return enc.finish();
     }
@@ -106,44 +170,40 @@ namespace fleece { namespace impl {
             case JSONSL_T_OBJECT:
                 _encoder.beginDictionary();
                 break;
+            default:
+                _tokenStart = state->pos_begin;
+                break;
         }
     }
 
-    void JSONConverter::writeDouble(struct jsonsl_state_st *state) {
-        char *start = (char*)&_input[state->pos_begin];
-        _encoder.writeDouble(ParseDouble(start));
-    }
-
     inline void JSONConverter::pop(struct jsonsl_state_st *state) {
         switch (state->type) {
             case JSONSL_T_SPECIAL: {
+                const char *start = tokenStart(state);
                 unsigned f = state->special_flags;
                 if (f & JSONSL_SPECIALf_FLOAT || f & JSONSL_SPECIALf_EXPONENT) {
-                    char *start = (char*)&_input[state->pos_begin];
                     _encoder.writeDouble(ParseDouble(start));
                 } else if (f & JSONSL_SPECIALf_UNSIGNED) {
                     if (_usuallyTrue(state->pos_cur - state->pos_begin < 19)) {
                         _encoder.writeUInt(state->nelem);
                     } else {
                         // Parse super long numbers carefully; go to double on overflow:
-                        char *start = (char*)&_input[state->pos_begin];
                         uint64_t n;
                         if (ParseUnsignedInteger(start, n, true))
                             _encoder.writeUInt(n);
                         else
-                            writeDouble(state);
+                            _encoder.writeDouble(ParseDouble(start));
                     }
                 } else if (f & JSONSL_SPECIALf_SIGNED) {
                     if (_usuallyTrue(state->pos_cur - state->pos_begin < 20)) {
                         _encoder.writeInt(-(int64_t)state->nelem);
                     } else {
                         // Parse super long numbers carefully; go to double on overflow:
-                        char *start = (char*)&_input[state->pos_begin];
                         int64_t n;
                         if (ParseInteger(start, n, true))
                             _encoder.writeInt(n);
                         else
-                            writeDouble(state);
+                            _encoder.writeDouble(ParseDouble(start));
                     }
                 } else if (f & JSONSL_SPECIALf_TRUE) {
                     _encoder.writeBool(true);
@@ -156,32 +216,8 @@ namespace fleece { namespace impl {
             }
             case JSONSL_T_STRING:
             case JSONSL_T_HKEY: {
-                slice str(&_input[state->pos_begin + 1],
-                          state->pos_cur - state->pos_begin - 1);
-                char *buf = nullptr;
-                bool mallocedBuf = false;
-                if (state->nescapes > 0) {
-                    // De-escape str:
-                    mallocedBuf = str.size > 100;
-                    buf = (char*)(mallocedBuf ? malloc(str.size) : alloca(str.size));
-                    jsonsl_error_t err = JSONSL_ERROR_SUCCESS;
-                    const char *errat;
-                    auto size = jsonsl_util_unescape_ex((const char*)str.buf, buf, str.size,
-                                                        nullptr, nullptr, &err, &errat);
-                    if (err) {
-                        errorCallback(_jsn, err, state, (char*)errat);
-                        if (mallocedBuf)
-                            free(buf);
-                        return;
-                    }
-                    str = slice(buf, size);
-                }
-                if (state->type == JSONSL_T_STRING)
-                    _encoder.writeString(str);
-                else
-                    _encoder.writeKey(str);
-                if (mallocedBuf)
-                    free(buf);
+                slice str(tokenStart(state) + 1, state->pos_cur - state->pos_begin - 1);
+                writeString(str, (state->nescapes > 0), (state->type == JSONSL_T_HKEY));
                 break;
             }
             case JSONSL_T_LIST:
@@ -193,6 +229,33 @@ namespace fleece { namespace impl {
         }
     }
 
+    void JSONConverter::writeString(slice str, bool escaped, bool isKey) {
+        char *buf = nullptr;
+        bool mallocedBuf = false;
+        if (escaped) {
+            // De-escape str:
+            mallocedBuf = str.size > 100;
+            buf = (char*)(mallocedBuf ? malloc(str.size) : alloca(str.size));
+            jsonsl_error_t err = JSONSL_ERROR_SUCCESS;
+            const char *errat;
+            auto size = jsonsl_util_unescape_ex((const char*)str.buf, buf, str.size,
+                                                nullptr, nullptr, &err, &errat);
+            if (err) {
+                gotError(err, errat);
+                if (mallocedBuf)
+                    free(buf);
+                return;
+            }
+            str = slice(buf, size);
+        }
+        if (isKey)
+            _encoder.writeKey(str);
+        else
+            _encoder.writeString(str);
+        if (mallocedBuf)
+            free(buf);
+    }
+
     int JSONConverter::gotError(int err, size_t pos) noexcept {
         _jsonError = err;
         _errorPos = pos;
@@ -202,7 +265,14 @@ namespace fleece { namespace impl {
     }
 
     int JSONConverter::gotError(int err, const char *errat) noexcept {
-        return gotError(err, errat ? (errat - (char*)_input.buf) : 0);
+        size_t pos = 0;
+        if (errat) {
+            if (_input.containsAddress(errat))
+                pos = _inputStart + (errat - (const char*)_input.buf);
+            else if (errat >= _pending.data() && errat <= _pending.data() + _pending.size())
+                pos = _pendingStart + (errat - _pending.data());    // in a token split across chunks
+        }
+        return gotError(err, pos);
     }
 
     void JSONConverter::gotException(ErrorCode code, const char *what, size_t pos) noexcept {
@@ -253,4 +323,317 @@ namespace fleece { namespace impl {
         return converter(jsn)->gotError(err, errat);
     }
 
+
+#pragma mark - JSON LINES:
+
+
+    JSONLinesConverter::JSONLinesConverter(SharedKeys *sk, JSONConverter::Parser parser)
+    :_converter(_encoder, parser)
+    {
+        _encoder.setSharedKeys(sk);
+    }
+
+
+    bool JSONLinesConverter::convert(slice input, RecordCallback callback) {
+        _errorLine = 0;
+        size_t lineNo = 0;
+        while (input.size > 0) {
+            ++lineNo;
+            // Include the newline in the line: jsonsl needs a delimiter after a top-level number.
+            auto eol = input.findByte('\n');
+            slice line(input.buf, eol ? (eol + 1) : input.end());
+            input.setStart(line.end());
+            std::string lastLine;
+            if (!eol) {
+                // The last line has no newline, so add one:
+                lastLine = std::string(line) + '\n';
+                line = slice(lastLine);
+            }
+
+            if (!_converter.encodeJSON(line)) {
+                _errorLine = lineNo;
+                _encoder.reset();
+                return false;
+            }
+            alloc_slice fleece = _encoder.finish();
+            _encoder.reset();                       // Keeps the Writer's buffer and string table
+            if (fleece)
+                callback(fleece);                   // (blank line produces no data)
+        }
+        return true;
+    }
+
+
+    std::vector<alloc_slice> JSONLinesConverter::convert(slice input) {
+        std::vector<alloc_slice> records;
+        if (!convert(input, [&](alloc_slice fleece) {records.push_back(fleece);}))
+            FleeceException::_throw(JSONError, "%s at line %zu",
+                                    _converter.errorMessage(), _errorLine);
+        return records;
+    }
+
+
+#pragma mark - STRUCTURAL PARSER:
+
+
+    // Characters that can end a number or literal token
+    static bool isDelimiter(char c) {
+        switch (c) {
+            case ',': case ']': case '}': case ':': case ' ': case '\t': case '\n': case '\r':
+            case '[': case '{': case '"':
+                return true;
+            default:
+                return false;
+        }
+    }
+
+
+    // Second stage of the structural parser: walks the offsets found by the JSONScanner,
+    // checking the grammar and calling the Encoder. Each string costs a single step, since the
+    // scanner indexes its closing quote; numbers and literals are parsed in place.
+    __hot void JSONConverter::encodeStructural(slice json,
+                                               const uint32_t *next, const uint32_t *last)
+    {
+        enum State : uint8_t {
+            kValue,             // expecting a value
+            kValueOrEnd,        // just after '['
+            kKey,               // expecting a dict key
+            kKeyOrEnd,          // just after '{'
+            kColon,             // just after a key
+            kCommaOrEnd,        // just after an item
+            kDone               // finished the root value
+        };
+
+        auto start = (const char*)json.buf, end = (const char*)json.end();
+        if (next == last)
+            return;                         // Empty input; jsonsl accepts this too
+
+        smallVector<char, 32> stack;        // '[' or '{' for every open collection
+        State state = kValue;
+        size_t pos = 0;
+        auto valueWritten = [&] {
+            state = stack.empty() ? kDone : kCommaOrEnd;
+        };
+
+        try {
+            while (next != last) {
+                pos = *next++;
+                char c = start[pos];
+                if (_usuallyFalse(state == kDone)) {
+                    gotError(JSONSL_ERROR_GARBAGE_TRAILING, pos);
+                    return;
+                } else if (_usuallyFalse(stack.size() + 1 >= kMaxLevels)
+                                && c != ']' && c != '}' && c != ':' && c != ',') {
+                    // Same nesting limit as jsonsl:
+                    gotError(JSONSL_ERROR_LEVELS_EXCEEDED, pos);
+                    return;
+                }
+                switch (c) {
+                    case '"': {
+                        if (_usuallyFalse(next == last))
+                            break;          // unterminated string; reported as truncation
+                        size_t endPos = *next++;
+                        slice str(&start[pos + 1], endPos - pos - 1);
+                        bool escaped = str.findByte('\\') != nullptr;
+                        if (state == kKey || state == kKeyOrEnd) {
+                            writeString(str, escaped, true);
+                            state = kColon;
+                        } else if (state == kValue || state == kValueOrEnd) {
+                            writeString(str, escaped, false);
+                            valueWritten();
+                        } else {
+                            gotError(JSONSL_ERROR_STRAY_TOKEN, pos);
+                        }
+                        break;
+                    }
+                    case '[':
+                    case '{':
+                        if (_usuallyFalse(state != kValue && state != kValueOrEnd)) {
+                            gotError((state == kKey || state == kKeyOrEnd)
+                                        ? JSONSL_ERROR_HKEY_EXPECTED : JSONSL_ERROR_STRAY_TOKEN,
+                                     pos);
+                            break;
+                        }
+                        stack.push_back(c);
+                        if (c == '[') {
+                            _encoder.beginArray();
+                            state = kValueOrEnd;
+                        } else {
+                            _encoder.beginDictionary();
+                            state = kKeyOrEnd;
+                        }
+                        break;
+                    case ']':
+                    case '}': {
+                        char open = (c == ']') ? '[' : '{';
+                        if (_usuallyFalse(stack.empty() || stack.back() != open)) {
+                            gotError(JSONSL_ERROR_BRACKET_MISMATCH, pos);
+                            break;
+                        } else if (_usuallyFalse(state != kCommaOrEnd
+                                        && !(state == kValueOrEnd && c == ']')
+                                        && !(state == kKeyOrEnd && c == '}'))) {
+                            gotError((state == kValue || state == kKey)
+                                        ? JSONSL_ERROR_TRAILING_COMMA : JSONSL_ERROR_VALUE_EXPECTED,
+                                     pos);
+                            break;
+                        }
+                        stack.pop_back();
+                        if (c == ']')
+                            _encoder.endArray();
+                        else
+                            _encoder.endDictionary();
+                        valueWritten();
+                        break;
+                    }
+                    case ':':
+                        if (_usuallyFalse(state != kColon))
+                            gotError(JSONSL_ERROR_STRAY_TOKEN, pos);
+                        state = kValue;
+                        break;
+                    case ',':
+                        if (_usuallyFalse(state != kCommaOrEnd))
+                            gotError(JSONSL_ERROR_STRAY_TOKEN, pos);
+                        else
+                            state = (stack.back() == '[') ? kValue : kKey;
+                        break;
+                    default: {
+                        if (_usuallyFalse(state != kValue && state != kValueOrEnd)) {
+                            gotError((state == kKey || state == kKeyOrEnd)
+                                        ? JSONSL_ERROR_HKEY_EXPECTED : JSONSL_ERROR_MISSING_TOKEN,
+                                     pos);
+                            break;
+                        }
+                        const char *tokenEnd = &start[pos + 1];
+                        while (tokenEnd < end && !isDelimiter(*tokenEnd))
+                            ++tokenEnd;
+                        if (_usuallyFalse(!writeToken(&start[pos], tokenEnd))) {
+                            bool numeric = (c == '-' || (c >= '0' && c <= '9'));
+                            gotError(numeric ? JSONSL_ERROR_INVALID_NUMBER
+                                             : JSONSL_ERROR_SPECIAL_EXPECTED,
+                                     pos);
+                            break;
+                        }
+                        valueWritten();
+                        break;
+                    }
+                }
+                if (_usuallyFalse(_jsonError != JSONSL_ERROR_SUCCESS))
+                    return;
+            }
+        } catch (const FleeceException &x) {
+            gotException(x.code, x.what(), pos);
+            return;
+        } catch (...) {
+            gotException(InternalError, nullptr, pos);
+            return;
+        }
+
+        if (state != kDone) {
+            // Input is valid JSON so far, but truncated:
+            _jsonError = kErrTruncatedJSON;
+            _errorPos = json.size;
+        }
+    }
+
+
+    // Writes a number or literal occupying the range [start, end). Returns false if invalid.
+    inline bool JSONConverter::writeToken(const char *start, const char *end) {
+        switch (*start) {
+            case 't':
+                if (end - start != 4 || memcmp(start, "true", 4) != 0)
+                    return false;
+                _encoder.writeBool(true);
+                return true;
+            case 'f':
+                if (end - start != 5 || memcmp(start, "false", 5) != 0)
+                    return false;
+                _encoder.writeBool(false);
+                return true;
+            case 'n':
+                if (end - start != 4 || memcmp(start, "null", 4) != 0)
+                    return false;
+                _encoder.writeNull();
+                return true;
+            default:
+                return writeNumber(start, end);
+        }
+    }
+
+
+    static inline bool isDigit(char c)      {return c >= '0' && c <= '9';}
+
+
+    bool JSONConverter::writeNumber(const char *start, const char *end) {
+        const char *cp = start;
+        bool negative = (*cp == '-');
+        if (negative)
+            ++cp;
+        const char *digits = cp;
+        uint64_t n = 0;
+        while (cp < end && isDigit(*cp))
+            n = 10 * n + (*cp++ - '0');     // may overflow, but then we won't use it
+        size_t nDigits = cp - digits;
+        if (_usuallyFalse(nDigits == 0))
+            return false;
+
+        if (_usuallyTrue(cp == end)) {
+            // Integer:
+            if (_usuallyTrue(nDigits < 19)) {
+                if (negative)
+                    _encoder.writeInt(-(int64_t)n);
+                else
+                    _encoder.writeUInt(n);
+            } else {
+                // Parse super long numbers carefully; go to double on overflow:
+                std::string str(start, end);
+                int64_t i;
+                uint64_t u;
+                if (negative && ParseInteger(str.c_str(), i))
+                    _encoder.writeInt(i);
+                else if (!negative && ParseUnsignedInteger(str.c_str(), u))
+                    _encoder.writeUInt(u);
+                else
+                    writeDouble(start, end);
+            }
+            return true;
+        }
+
+        // Floating point; check the syntax of the fraction and exponent:
+        if (*cp == '.') {
+            digits = ++cp;
+            while (cp < end && isDigit(*cp))
+                ++cp;
+            if (cp == digits)
+                return false;
+        }
+        if (cp < end && (*cp == 'e' || *cp == 'E')) {
+            ++cp;
+            if (cp < end && (*cp == '-' || *cp == '+'))
+                ++cp;
+            digits = cp;
+            while (cp < end && isDigit(*cp))
+                ++cp;
+            if (cp == digits)
+                return false;
+        }
+        if (cp != end)
+            return false;
+        writeDouble(start, end);
+        return true;
+    }
+
+
+    void JSONConverter::writeDouble(const char *start, const char *end) {
+        // ParseDouble needs a null-terminated string, which the input may not be:
+        char buf[64];
+        size_t len = end - start;
+        if (_usuallyTrue(len < sizeof(buf))) {
+            memcpy(buf, start, len);
+            buf[len] = '\0';
+            _encoder.writeDouble(ParseDouble(buf));
+        } else {
+            _encoder.writeDouble(ParseDouble(std::string(start, end).c_str()));
+        }
+    }
+
 } }
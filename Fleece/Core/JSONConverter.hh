@@ -21,8 +21,10 @@
 #include "Encoder.hh"
 #include "Doc.hh"
 #include "FleeceException.hh"
+#include "JSONScanner.hh"
 #include "fleece/slice.hh"
 #include <map>
+#include <vector>
 
 extern "C" {
     struct jsonsl_state_st;
@@ -34,19 +36,41 @@ namespace fleece { namespace impl {
     /** Parses JSON data and writes the values in it to a Fleece encoder. */
     class JSONConverter {
     public:
-        JSONConverter(Encoder&) noexcept;
+        /** The available JSON parser implementations. */
+        enum Parser {
+            kJsonslParser,          ///< jsonsl's byte-at-a-time state machine
+            kStructuralParser,      ///< Two-stage parser: SIMD structural index (JSONScanner),
+                                    ///< then a direct walk of the index that drives the Encoder
+        };
+
+        JSONConverter(Encoder&, Parser =kJsonslParser) noexcept;
         ~JSONConverter();
 
         /** Parses JSON data and writes the values to the encoder.
             @return  True if parsing succeeded, false if the JSON is invalid. */
         bool encodeJSON(slice json);
 
+        /** Parses the next chunk of a JSON document, writing values to the encoder as soon as
+            they're complete. Chunks may be split anywhere, even inside a string or number; only
+            the bytes of a token that spans chunks are kept between calls, so memory use is
+            bounded by the chunk size rather than the document size.
+            After the last chunk, call \ref finish.
+            Incremental parsing always uses the jsonsl parser, since the structural parser
+            indexes the entire document up front.
+            @return  True if the JSON is valid so far, false if it's invalid. */
+        bool feed(slice chunk);
+
+        /** Ends a document whose input was given to \ref feed, and prepares for another one.
+            @return  True if parsing succeeded, false if the JSON is invalid or incomplete. */
+        bool finish();
+
         /** See jsonsl_error_t for error codes, plus a few more defined below. */
         int jsonError() noexcept                {return _jsonError;}
         ErrorCode errorCode() noexcept          {return _errorCode;}
         const char* errorMessage() noexcept;
         
-        /** Byte offset in input where error occurred */
+        /** Byte offset in input where error occurred. (If the input was given to \ref feed,
+            this is relative to the start of the first chunk.) */
         size_t errorPos() noexcept              {return _errorPos;}
 
         /** Extra error codes beyond those in jsonsl_error_t. */
@@ -59,7 +83,28 @@ namespace fleece { namespace impl {
         void reset();
 
         /** Convenience method to convert JSON to Fleece data. Throws FleeceException on error. */
-        static alloc_slice convertJSON(slice json, SharedKeys *sk =nullptr);
+        static alloc_slice convertJSON(slice json, SharedKeys *sk =nullptr,
+                                       Parser =kJsonslParser);
+
+        /** Converts JSON to Fleece using multiple threads, if the root is an array.
+            The array's elements are divided into contiguous ranges that are converted
+            concurrently into separate Fleece fragments, which are then concatenated and given a
+            root array pointing to each element. (Since Fleece pointers are relative, values in
+            a fragment stay valid wherever it's placed.)
+            The result is valid Fleece equivalent to \ref convertJSON's, but not byte-for-byte
+            identical: strings are only de-duplicated within a fragment, and every element is
+            referenced by pointer.
+            Uses the structural parser. Falls back to \ref convertJSON if the root isn't an
+            array or the input is too small to be worth splitting.
+            @param json  The JSON to convert.
+            @param sk  SharedKeys to use, or nullptr.
+            @param maxThreads  The maximum number of threads to use, or 0 to use one per CPU core.
+            @return  The Fleece data. Throws FleeceException on error. */
+        static alloc_slice convertJSONParallel(slice json, SharedKeys *sk =nullptr,
+                                               unsigned maxThreads =0);
+
+        /** Inputs smaller than this (per thread) are not worth converting in parallel. */
+        static constexpr size_t kMinParallelBytesPerThread = 128 * 1024;
 
     //private:
         void push(struct jsonsl_state_st *state NONNULL);
@@ -69,16 +114,72 @@ namespace fleece { namespace impl {
         void gotException(ErrorCode code, const char *what NONNULL, size_t pos) noexcept;
 
     private:
-        void writeDouble(struct jsonsl_state_st *);
+        void beginInput();
+        const char* tokenStart(struct jsonsl_state_st *state NONNULL);
+        void writeString(slice str, bool escaped, bool isKey);
+        void encodeStructural(slice json, const uint32_t *begin, const uint32_t *end);
+        bool writeToken(const char *start NONNULL, const char *end NONNULL);
+        bool writeNumber(const char *start NONNULL, const char *end NONNULL);
+        void writeDouble(const char *start NONNULL, const char *end NONNULL);
         typedef std::map<size_t, uint64_t> startToLengthMap;
 
+        // Maximum nesting depth, passed to jsonsl_new. (jsonsl counts strings and other scalars
+        // as levels too, and reserves one level for the root.)
+        static constexpr int kMaxLevels = 50;
+
         Encoder &_encoder;                  // encoder to write to
+        Parser _parser;                     // which parser implementation to use
+        JSONScanner _scanner;               // structural index (if _parser==kStructuralParser)
         struct jsonsl_st * _jsn {nullptr};  // JSON parser
         int _jsonError {0};                 // Parse error from jsonsl
         ErrorCode _errorCode {NoError};
         std::string _errorMessage;
         size_t _errorPos {0};               // Byte index where parse error occurred
-        slice _input;                       // Current JSON being parsed
+        slice _input;                       // Current JSON (or chunk) being parsed
+        size_t _inputStart {0};             // Offset of _input in the whole document
+        size_t _tokenStart {kNoToken};      // Offset of the open string/number token, if any
+        std::string _pending;               // Saved start of a token that spans chunks
+        size_t _pendingStart {0};           // Offset of _pending in the whole document
+        bool _feeding {false};              // True between the first feed() and finish()
+
+        static constexpr size_t kNoToken = SIZE_MAX;
+    };
+
+
+    /** Converts newline-delimited JSON (a.k.a. "JSON Lines" or NDJSON) into one Fleece document
+        per line. A single Encoder and JSONConverter are reused for all the records, so the
+        per-record cost is just parsing and encoding, not setting up a new Encoder, string table
+        and parser every time as JSONConverter::convertJSON does. Blank lines are skipped. */
+    class JSONLinesConverter {
+    public:
+        using RecordCallback = function_ref<void(alloc_slice)>;
+
+        explicit JSONLinesConverter(SharedKeys *sk =nullptr,
+                                    JSONConverter::Parser =JSONConverter::kJsonslParser);
+
+        /** The Encoder used for each record, in case you want to customize it. */
+        Encoder& encoder()                      {return _encoder;}
+
+        /** Converts each line of `input` to Fleece and passes the data to the callback.
+            Stops at the first invalid line and returns false; \ref errorLine and the
+            \ref converter's error properties then describe the problem. */
+        bool convert(slice input, RecordCallback callback);
+
+        /** Converts each line of `input` to Fleece and returns the results.
+            Throws FleeceException on invalid JSON. */
+        std::vector<alloc_slice> convert(slice input);
+
+        /** The JSONConverter, whose error properties describe the last parse error. (Its
+            errorPos is relative to the start of the line.) */
+        JSONConverter& converter()              {return _converter;}
+
+        /** The 1-based line number at which a parse error occurred. */
+        size_t errorLine() const                {return _errorLine;}
+
+    private:
+        Encoder _encoder;
+        JSONConverter _converter;
+        size_t _errorLine {0};
     };
 
 } }
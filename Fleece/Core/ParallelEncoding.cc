@@ -0,0 +1,95 @@
+//
+// ParallelEncoding.cc
+//
+// Copyright (c) 2021 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "ParallelEncoding.hh"
+#include "Encoder.hh"
+#include <exception>
+#include <system_error>
+#include <thread>
+
+namespace fleece { namespace impl { namespace internal {
+    using namespace std;
+
+
+    namespace {
+        // Joins its threads when it exits scope, even if an exception is thrown.
+        struct ThreadGroup : public vector<thread> {
+            ~ThreadGroup() {
+                for (auto &t : *this) {
+                    if (t.joinable())
+                        t.join();
+                }
+            }
+        };
+    }
+
+
+    vector<EncodedFragment> encodeFragments(unsigned count, FragmentEncoder encode) {
+        vector<EncodedFragment> fragments(count);
+        vector<exception_ptr> exceptions(count);
+        auto encodeFragment = [&](unsigned i) {
+            try {
+                encode(i, fragments[i]);
+            } catch (...) {
+                exceptions[i] = current_exception();
+            }
+        };
+
+        {
+            ThreadGroup threads;
+            threads.reserve(count - 1);
+            unsigned i = 1;
+            for (; i < count; ++i) {
+                try {
+                    threads.emplace_back(encodeFragment, i);
+                } catch (const system_error&) {
+                    break;          // Out of threads; encode the rest of the fragments here
+                }
+            }
+            for (; i < count; ++i)
+                encodeFragment(i);
+            encodeFragment(0);
+        }
+
+        for (auto &x : exceptions) {
+            if (x)
+                rethrow_exception(x);
+        }
+        return fragments;
+    }
+
+
+    void writeFragmentsAsArray(vector<EncodedFragment> &fragments, Encoder &enc) {
+        vector<size_t> fragmentPos;
+        fragmentPos.reserve(fragments.size());
+        size_t count = 0;
+        for (auto &frag : fragments) {
+            fragmentPos.push_back(enc.nextWritePos());
+            enc.writeRaw(frag.data);
+            frag.data = nullslice;
+            count += frag.positions.size();
+        }
+        enc.beginArray(count);
+        for (size_t f = 0; f < fragments.size(); ++f) {
+            for (size_t pos : fragments[f].positions)
+                enc.writePointerTo(fragmentPos[f] + pos);
+        }
+        enc.endArray();
+    }
+
+} } }
@@ -0,0 +1,56 @@
+//
+// ParallelEncoding.hh
+//
+// Copyright (c) 2021 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "fleece/slice.hh"
+#include "function_ref.hh"
+#include <vector>
+
+namespace fleece { namespace impl {
+    class Encoder;
+} }
+
+namespace fleece { namespace impl { namespace internal {
+
+    // Shared by Encoder::writeArrayInParallel and JSONConverter::convertJSONParallel, which
+    // encode the items of a large array as separate fragments on several threads, then join
+    // the fragments together.
+    //
+    // Any SharedKeys used by the fragments' Encoders should have all the keys added to it
+    // before the threads start; otherwise the keys' numbers depend on the threads' timing.
+
+    /** A contiguous range of array items encoded by one thread. */
+    struct EncodedFragment {
+        alloc_slice data;                   // The Fleece data of the items
+        std::vector<size_t> positions;      // The offset of each item's Value in `data`
+    };
+
+    /** A function that encodes fragment number `i` into `fragment`. */
+    using FragmentEncoder = function_ref<void(unsigned i, EncodedFragment &fragment)>;
+
+    /** Calls `encode` for each of `count` fragments, concurrently: fragment 0 on the calling
+        thread and the others on new threads. If a thread can't be started, its fragment is
+        encoded on the calling thread instead. Returns after all the fragments are done;
+        if any of them threw an exception, rethrows the first one. */
+    std::vector<EncodedFragment> encodeFragments(unsigned count, FragmentEncoder encode);
+
+    /** Appends the fragments' data to the Encoder's output, then writes an array of pointers to
+        all their items, in order. (Frees the fragments' data as it goes.) */
+    void writeFragmentsAsArray(std::vector<EncodedFragment> &fragments, Encoder&);
+
+} } }
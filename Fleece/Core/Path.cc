@@ -20,7 +20,9 @@
 #include "SharedKeys.hh"
 #include "FleeceException.hh"
 #include "PlatformCompat.hh"
+#include <algorithm>
 #include <iostream>
+#include <new>
 #include <sstream>
 
 using namespace std;
@@ -324,4 +326,138 @@ namespace fleece { namespace impl {
         return a->get((uint32_t)index);
     }
 
+
+#pragma mark - PATHSET:
+
+
+    // A fixed-size array of Dict::keys, to pass to Dict::getMany. (Dict::key can't be copied or
+    // moved, so it can't go in a vector.)
+    class KeyArray {
+    public:
+        KeyArray() =default;
+        KeyArray(const KeyArray&) =delete;
+        ~KeyArray()                                 {clear();}
+
+        size_t size() const                         {return _size;}
+        bool empty() const                          {return _size == 0;}
+        Dict::key& operator[] (size_t i) const      {return _keys[i];}
+
+        // Replaces the keys with new ones made from `names`, which must outlive them.
+        void reset(const std::vector<alloc_slice> &names) {
+            clear();
+            _keys = (Dict::key*)::operator new(names.size() * sizeof(Dict::key));
+            for (auto &name : names) {
+                new (&_keys[_size]) Dict::key(name);
+                ++_size;
+            }
+        }
+
+    private:
+        void clear() noexcept {
+            for (size_t i = 0; i < _size; ++i)
+                _keys[i].~key();
+            ::operator delete(_keys);
+            _keys = nullptr;
+            _size = 0;
+        }
+
+        Dict::key* _keys {nullptr};
+        size_t _size {0};
+    };
+
+
+    // A node of a PathSet's tree; its children are reached from it by a property or an index.
+    struct PathSet::Node {
+        smallVector<size_t, 1> outputs;             // Indexes of the Paths that end here
+
+        std::vector<alloc_slice> propertyNames;     // Properties of the child nodes...
+        KeyArray keys;                              // ...as Dict::keys, to pass to getMany
+        std::vector<std::unique_ptr<Node>> propertyChildren;
+
+        std::vector<std::pair<int32_t, std::unique_ptr<Node>>> indexChildren;
+
+        static constexpr size_t kBatchSize = 16;
+
+        Node* childForProperty(slice name) {
+            for (size_t i = 0; i < propertyNames.size(); ++i) {
+                if (propertyNames[i] == name)
+                    return propertyChildren[i].get();
+            }
+            propertyNames.emplace_back(name);
+            keys.reset(propertyNames);
+            propertyChildren.emplace_back(new Node);
+            return propertyChildren.back().get();
+        }
+
+        Node* childForIndex(int32_t index) {
+            for (auto &child : indexChildren) {
+                if (child.first == index)
+                    return child.second.get();
+            }
+            indexChildren.emplace_back(index, new Node);
+            return indexChildren.back().second.get();
+        }
+
+        size_t eval(const Value *item, const Value* values[]) const noexcept {
+            size_t found = 0;
+            for (size_t output : outputs) {
+                values[output] = item;
+                ++found;
+            }
+            auto dict = keys.empty() ? nullptr : item->asDict();
+            if (dict && keys.size() == 1) {
+                auto value = dict->get(keys[0]);
+                if (value)
+                    found += propertyChildren[0]->eval(value, values);
+            } else if (dict) {
+                // Look up the properties in batches, to keep the Values on the stack:
+                const Value* childValues[kBatchSize];
+                for (size_t start = 0; start < keys.size(); start += kBatchSize) {
+                    size_t n = std::min(keys.size() - start, kBatchSize);
+                    if (dict->getMany(&keys[start], n, childValues) == 0)
+                        continue;
+                    for (size_t i = 0; i < n; ++i) {
+                        if (childValues[i])
+                            found += propertyChildren[start + i]->eval(childValues[i], values);
+                    }
+                }
+            }
+            for (auto &child : indexChildren) {
+                auto value = Path::Element::eval('[', nullslice, child.first, item);
+                if (value)
+                    found += child.second->eval(value, values);
+            }
+            return found;
+        }
+    };
+
+
+    PathSet::PathSet()
+    :_root(new Node)
+    { }
+
+    PathSet::~PathSet() =default;
+
+
+    size_t PathSet::add(const Path &path) {
+        Node *node = _root.get();
+        for (auto &element : path.path()) {
+            if (element.isKey())
+                node = node->childForProperty(element.keyStr());
+            else
+                node = node->childForIndex(element.index());
+        }
+        node->outputs.push_back(_size);
+        return _size++;
+    }
+
+
+    size_t PathSet::eval(const Value *root, const Value* values[]) const noexcept {
+        for (size_t i = 0; i < _size; ++i)
+            values[i] = nullptr;
+        if (_usuallyFalse(!root))
+            return 0;
+        return _root->eval(root, values);
+    }
+
 } }
@@ -123,4 +123,40 @@ namespace fleece { namespace impl {
         smallVector<Element, 4> _path;
     };
 
+
+    /** A set of Paths that are evaluated together, producing an array of Values -- a projection
+        of a document. It's faster than evaluating the Paths one at a time: they're stored as a
+        tree, so a prefix shared by several Paths (like "address" in "address.city" and
+        "address.zip") is only evaluated once, and all the properties needed from a Dict are
+        looked up together with Dict::getMany.
+        Like Path, a PathSet caches state in its keys while evaluating, so it shouldn't be used
+        on multiple threads at once. And like a Dict::key, it may only be used with documents
+        that share the same SharedKeys (or that all have none.) */
+    class PathSet {
+    public:
+        PathSet();
+        ~PathSet();
+
+        /** Adds a Path, returning its index in the array filled in by `eval`.
+            (Adding the same Path twice is allowed; it gets two indexes.) */
+        size_t add(const Path&);
+
+        /** Adds a Path given as a string. (Throws FleeceException with code PathSyntaxError.) */
+        size_t add(slice specifier)                 {return add(Path(specifier));}
+
+        /** The number of Paths added. */
+        size_t size() const                         {return _size;}
+
+        /** Evaluates every Path, storing each one's result (or nullptr) in the item of `values`
+            at its index. `values` must have room for `size()` items.
+            Returns the number of Paths that were found. */
+        size_t eval(const Value *root, const Value* values[]) const noexcept;
+
+    private:
+        struct Node;
+
+        std::unique_ptr<Node> _root;
+        size_t _size {0};
+    };
+
 } }
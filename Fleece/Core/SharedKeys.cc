@@ -17,8 +17,11 @@
 //
 
 #include "SharedKeys.hh"
+#include "DeepIterator.hh"
 #include "FleeceImpl.hh"
 #include "FleeceException.hh"
+#include "JSONEncoder.hh"
+#include <algorithm>
 
 
 #define LOCK(MUTEX)     lock_guard<mutex> _lock(MUTEX)
@@ -28,6 +31,63 @@ namespace fleece { namespace impl {
     using namespace std;
 
 
+    /*  The hash table that maps strings to keys is read without locking, so it's designed to
+        never move an entry once it's been published:
+        - It uses linear probing, and each slot is a single atomic word holding the key's hash
+          and number (plus 1, so that 0 means empty.) The string itself is found in `_byKey`.
+        - It's kept at most half full, so probing is short and always finds an empty slot.
+        - When it needs to grow, a new table is built and published in its place. The old one
+          stays allocated until the SharedKeys is destructed, since readers may still be using
+          it; since each table is twice the size of the last, that costs at most 2x memory.
+        Since entries never move, a table is a deterministic function of the order in which keys
+        were added. That means revertToCount() can just empty the slots of the reverted keys,
+        which leaves the table exactly as it was when there were that many keys.
+        Readers may also still be using the strings of reverted keys, so those aren't freed
+        right away either. A reverted key's string (and JSON form) stays in `_keyStrings` until
+        its number is given to a new key: if that key has the same string, which is usual when a
+        transaction is retried, the string is reused; otherwise the old string moves to
+        `_oldKeyStrings`, replacing and freeing the one before it. So there are never more than
+        two strings per key number, however many times keys are reverted. A string is freed only
+        after its number has been reverted and given to a different string twice, so a lookup
+        would have to stall through both of those to still be using it. */
+    struct SharedKeys::KeyTable {
+        static constexpr size_t kMinSize = 16;
+
+        explicit KeyTable(size_t size)
+        :mask(size - 1)
+        ,slots(new atomic<uint64_t>[size]())
+        { }
+
+        size_t size() const                 {return mask + 1;}
+
+        static uint64_t makeSlot(StringTable::hash_t hash, unsigned key) {
+            return (uint64_t(hash) << 32) | (key + 1);
+        }
+
+        // Stores a slot value in the first empty slot for its hash.
+        void insert(uint64_t slot) {
+            size_t i = size_t(slot >> 32) & mask;
+            while (slots[i].load(memory_order_relaxed) != 0)
+                i = (i + 1) & mask;
+            slots[i].store(slot, memory_order_release);
+        }
+
+        size_t const mask;
+        unique_ptr<atomic<uint64_t>[]> const slots;
+    };
+
+
+    SharedKeys::SharedKeys() = default;
+
+    void SharedKeys::setMaxCount(size_t m) {
+        throwIf(m > kMaxExtendedCount, InvalidData, "SharedKeys max count is too large");
+        _maxCount = m;
+    }
+
+    SharedKeys::SharedKeys(slice stateData) {
+        loadFrom(stateData);
+    }
+
     SharedKeys::~SharedKeys() {
     #ifdef __APPLE__
         for (auto &str : _platformStringsByKey) {
@@ -39,7 +99,7 @@ namespace fleece { namespace impl {
 
     key_t::key_t(const Value *v) noexcept {
         if (v->isInteger())
-            _int = (int16_t)v->asInt();
+            _int = (int32_t)v->asInt();
         else
             _string = v->asString();
     }
@@ -56,12 +116,6 @@ namespace fleece { namespace impl {
     }
 
 
-    size_t SharedKeys::count() const {
-        LOCK(_mutex);
-        return _count;
-    }
-
-
     bool SharedKeys::loadFrom(slice stateData) {
         const Value *v = Value::fromData(stateData);
         if (!v)
@@ -73,10 +127,10 @@ namespace fleece { namespace impl {
         Array::iterator i(strs);
 
         LOCK(_mutex);
-        if (i.count() <= _count)
+        if (i.count() <= count() || i.count() > kMaxExtendedCount)
             return false;
 
-        i += (unsigned)_count;           // Start at the first _new_ string
+        i += (unsigned)count();          // Start at the first _new_ string
         for (; i; ++i) {
             slice str = i.value()->asString();
             if (!str)
@@ -89,42 +143,93 @@ namespace fleece { namespace impl {
 
     alloc_slice SharedKeys::stateData() const {
         LOCK(_mutex);
-        size_t count = _count;
+        size_t count = this->count();
         Encoder enc;
         enc.beginArray(count);
         for (size_t key = 0; key < count; ++key)
-            enc.writeString(_byKey[key]);
+            enc.writeString(keyString(key));
         enc.endArray();
         return enc.finish();
     }
 
 
-    bool SharedKeys::encode(slice str, int &key) const {
-        LOCK(_mutex);
-        return _encode(str, key);
+    namespace {
+        // An entry in the per-thread cache used by SharedKeys::encode().
+        struct LookupCacheEntry {
+            const SharedKeys* sharedKeys;
+            const void* buf;
+            uint32_t size;
+            uint32_t generation;
+            int key;
+        };
+
+        static constexpr size_t kLookupCacheSize = 64;     // Must be a power of 2
+
+        thread_local LookupCacheEntry tLookupCache[kLookupCacheSize];
+
+        static inline LookupCacheEntry& lookupCacheEntry(const SharedKeys *sk, slice str) {
+            auto h = (uintptr_t(str.buf) ^ (uintptr_t(sk) >> 4) ^ str.size) * 0x9E3779B1u;
+            return tLookupCache[(h >> 16) & (kLookupCacheSize - 1)];
+        }
     }
 
-    bool SharedKeys::_encode(slice str, int &key) const {
-        // Is this string already encoded?
-        auto entry = _table.find(str);
-        if (_usuallyTrue(entry != nullptr)) {
-            key = entry->second;
+
+    __hot bool SharedKeys::encode(slice str, int &key) const {
+        // The cache is keyed by the string's address, but the caller may have reused that memory
+        // for a different string since; so a hit is only trusted if the string still matches
+        // the key's. (The generation check catches keys that were removed by revertToCount.)
+        // The entry may even be left over from a freed SharedKeys that had the same address,
+        // so the key has to be checked against the count before looking up its string.
+        auto &entry = lookupCacheEntry(this, str);
+        uint32_t generation = _generation.load(memory_order_acquire);
+        if (entry.sharedKeys == this && entry.buf == str.buf && entry.size == str.size
+                && entry.generation == generation && unsigned(entry.key) < count()
+                && keyString(entry.key) == str) {
+            key = entry.key;
             return true;
         }
-        return false;
+        if (!_encode(str, key, StringTable::hashCode(str)))
+            return false;
+        entry = {this, str.buf, uint32_t(str.size), generation, key};
+        return true;
+    }
+
+    __hot bool SharedKeys::_encode(slice str, int &key, StringTable::hash_t hash) const {
+        // This doesn't lock; see the comment on KeyTable above.
+        const KeyTable *table = _table.load(memory_order_acquire);
+        if (_usuallyFalse(!table))
+            return false;
+        for (size_t i = size_t(hash) & table->mask; ; i = (i + 1) & table->mask) {
+            uint64_t slot = table->slots[i].load(memory_order_acquire);
+            if (slot == 0)
+                return false;
+            if (StringTable::hash_t(slot >> 32) == hash) {
+                unsigned k = unsigned(slot) - 1;
+                if (_usuallyTrue(k < count() && keyString(k) == str)) {
+                    key = int(k);
+                    return true;
+                }
+            }
+        }
     }
 
 
     bool SharedKeys::encodeAndAdd(slice str, int &key) {
+        return encodeAndAdd(str, key, StringTable::hashCode(str));
+    }
+
+    bool SharedKeys::encodeAndAdd(slice str, int &key, StringTable::hash_t hash) {
+        if (_usuallyTrue(_encode(str, key, hash)))
+            return true;
         LOCK(_mutex);
-        return _encodeAndAdd(str, key);
+        return _encodeAndAdd(str, key, hash);
     }
 
-    bool SharedKeys::_encodeAndAdd(slice str, int &key) {
-        if (_encode(str, key))
+    bool SharedKeys::_encodeAndAdd(slice str, int &key, StringTable::hash_t hash) {
+        if (_encode(str, key, hash))
             return true;
         // Should this string be encoded?
-        if (_count >= kMaxCount || str.size > _maxKeyLength || !isEligibleToEncode(str))
+        if (count() >= _maxCount || str.size > _maxKeyLength || !isEligibleToEncode(str))
             return false;
         // OK, add to table:
         key = _add(str);
@@ -132,15 +237,65 @@ namespace fleece { namespace impl {
     }
 
 
+    // Must be called with the mutex locked.
     int SharedKeys::_add(slice str) {
-        alloc_slice allocedStr(str);
-        auto id = _count++;
-        _byKey[id] = allocedStr;
-        _table.insertOnly(allocedStr, uint32_t(id));
+        auto id = count();
+        throwIf(id >= kMaxExtendedCount, SharedKeysStateError, "too many shared keys");
+        auto &chunk = _byKey[id / kKeysPerChunk];
+        if (!chunk)
+            chunk.reset(new atomic<const alloc_slice*>[kKeysPerChunk]());
+        keySlot(unsigned(id)).store(storeKeyString(unsigned(id), str), memory_order_release);
+        addToTable(unsigned(id));
+        _count.store(unsigned(id + 1), memory_order_release);
         return int(id);
     }
 
 
+    // Returns the string to use for key number `key`, which is being given to `str`. If that
+    // number was used before by a reverted key, its string is reused if possible, else kept as
+    // the old string (see the comment on KeyTable.) Must be called with the mutex locked.
+    const alloc_slice* SharedKeys::storeKeyString(unsigned key, slice str) {
+        if (key >= _keyStrings.size()) {
+            _keyStrings.emplace_back(new alloc_slice(str));
+            return _keyStrings.back().get();
+        }
+        if (*_keyStrings[key] == str)
+            return _keyStrings[key].get();
+        if (key >= _oldKeyStrings.size()) {
+            _oldKeyStrings.resize(key + 1);
+            _oldJSONByKey.resize(key + 1);
+        }
+        if (key >= _jsonByKey.size())
+            _jsonByKey.resize(key + 1);
+        if (_oldKeyStrings[key] && *_oldKeyStrings[key] == str) {
+            swap(_keyStrings[key], _oldKeyStrings[key]);
+            swap(_jsonByKey[key], _oldJSONByKey[key]);
+        } else {
+            _oldKeyStrings[key] = move(_keyStrings[key]);
+            _keyStrings[key].reset(new alloc_slice(str));
+            _oldJSONByKey[key] = move(_jsonByKey[key]);
+            _jsonByKey[key] = nullslice;
+        }
+        return _keyStrings[key].get();
+    }
+
+
+    // Adds `keyString(key)` to the hash table, first replacing the table if it's half full.
+    // Must be called with the mutex locked.
+    void SharedKeys::addToTable(unsigned key) {
+        KeyTable *table = _table.load(memory_order_relaxed);
+        if (!table || 2 * (key + 1) > table->size()) {
+            auto newTable = make_unique<KeyTable>(table ? 2 * table->size() : KeyTable::kMinSize);
+            for (unsigned k = 0; k < key; ++k)
+                newTable->insert(KeyTable::makeSlot(StringTable::hashCode(keyString(k)), k));
+            table = newTable.get();
+            _tables.push_back(move(newTable));
+        }
+        table->insert(KeyTable::makeSlot(StringTable::hashCode(keyString(key)), key));
+        _table.store(table, memory_order_release);
+    }
+
+
     __hot bool SharedKeys::isEligibleToEncode(slice str) const {
         for (size_t i = 0; i < str.size; ++i)
             if (_usuallyFalse(!isalnum(str[i]) && str[i] != '_' && str[i] != '-'))
@@ -149,19 +304,10 @@ namespace fleece { namespace impl {
     }
 
 
-    bool SharedKeys::isUnknownKey(int key) const {
-        LOCK(_mutex);
-        return _isUnknownKey(key);
-    }
-
-
     /** Decodes an integer back to a string. */
     slice SharedKeys::decode(int key) const {
-        {
-            LOCK(_mutex);
-            if (_usuallyTrue(!_isUnknownKey(key)))
-                return _byKey[key];
-        }
+        if (_usuallyTrue(!_isUnknownKey(key)))
+            return keyString(key);
         return decodeUnknown(key);
     }
 
@@ -172,16 +318,43 @@ namespace fleece { namespace impl {
         const_cast<SharedKeys*>(this)->refresh();
 
         // Retry after refreshing:
-        LOCK(_mutex);
         if (_isUnknownKey(key))
             return nullslice;
-        return _byKey[key];
+        return keyString(key);
+    }
+
+
+    slice SharedKeys::decodeAsJSON(int key) const {
+        throwIf(key < 0, InvalidData, "key must be non-negative");
+        {
+            LOCK(_mutex);
+            if (!_isUnknownKey(key) && (unsigned)key < _jsonByKey.size() && _jsonByKey[key])
+                return _jsonByKey[key];
+        }
+        slice str = decode(key);
+        if (!str)
+            return nullslice;
+        JSONEncoder enc(str.size + 2);
+        enc.writeString(str);
+        alloc_slice json = enc.finish();
+
+        LOCK(_mutex);
+        if (_isUnknownKey(key))
+            return nullslice;           // (reverted while I was unlocked)
+        if ((unsigned)key >= _jsonByKey.size())
+            _jsonByKey.resize(key + 1);
+        if (!_jsonByKey[key])
+            _jsonByKey[key] = json;
+        return _jsonByKey[key];
     }
 
 
     vector<alloc_slice> SharedKeys::byKey() const {
         LOCK(_mutex);
-        return vector<alloc_slice>(&_byKey[0], &_byKey[_count]);
+        vector<alloc_slice> strings(count());
+        for (unsigned key = 0; key < strings.size(); ++key)
+            strings[key] = *keySlot(key).load(memory_order_relaxed);
+        return strings;
     }
 
 
@@ -197,7 +370,7 @@ namespace fleece { namespace impl {
     void SharedKeys::setPlatformStringForKey(int key, SharedKeys::PlatformString platformKey) const {
         LOCK(_mutex);
         throwIf(key < 0, InvalidData, "key must be non-negative");
-        throwIf((unsigned)key >= _count, InvalidData, "key is not yet known");
+        throwIf((unsigned)key >= count(), InvalidData, "key is not yet known");
         if ((unsigned)key >= _platformStringsByKey.size())
             _platformStringsByKey.resize(key + 1);
 #ifdef __APPLE__
@@ -210,18 +383,26 @@ namespace fleece { namespace impl {
 
     void SharedKeys::revertToCount(size_t toCount) {
         LOCK(_mutex);
-        if (toCount >= _count) {
-            throwIf(toCount > _count, SharedKeysStateError, "can't revert to a bigger count");
+        size_t curCount = count();
+        if (toCount >= curCount) {
+            throwIf(toCount > curCount, SharedKeysStateError, "can't revert to a bigger count");
             return;
         }
-        for (auto key = toCount; key < _count; ++key)
-            _byKey[key] = nullslice;
-        _count = unsigned(toCount);
+        _count.store(unsigned(toCount), memory_order_release);
+        ++_generation;
+
+        // Empty the hash-table slots of the removed keys (see the comment on KeyTable):
+        KeyTable *table = _table.load(memory_order_relaxed);
+        for (size_t i = 0; i <= table->mask; ++i) {
+            uint64_t slot = table->slots[i].load(memory_order_relaxed);
+            if (slot != 0 && unsigned(slot) - 1 >= toCount)
+                table->slots[i].store(0, memory_order_release);
+        }
 
-        // StringTable doesn't support removing, so rebuild it:
-        _table.clear();
-        for (size_t key = 0; key < toCount; ++key)
-            _table.insert(_byKey[key], uint32_t(key));
+        // Clear the reverted keys' strings, but keep them (and their JSON forms) alive for
+        // readers that are using them (see the comment on KeyTable):
+        for (auto key = toCount; key < curCount; ++key)
+            keySlot(unsigned(key)).store(nullptr, memory_order_release);
     }
 
 
@@ -291,4 +472,55 @@ namespace fleece { namespace impl {
         return SharedKeys::_add(str);
     }
 
+
+
+#pragma mark - TRAINING:
+
+
+    void SharedKeysTrainer::addSample(const Value *sample) {
+        for (DeepIterator i(sample); i; ++i) {
+            slice key = i.keyString();
+            if (!key)
+                continue;
+            auto found = _keys.find(key);
+            if (found != _keys.end()) {
+                ++found->second.count;
+            } else {
+                Entry entry {alloc_slice(key), 1, _keys.size()};
+                slice mapKey = entry.key;
+                _keys.emplace(mapKey, move(entry));
+            }
+        }
+        ++_sampleCount;
+    }
+
+
+    vector<SharedKeysTrainer::KeyFrequency> SharedKeysTrainer::keysByFrequency() const {
+        vector<const Entry*> entries;
+        entries.reserve(_keys.size());
+        for (auto &item : _keys)
+            entries.push_back(&item.second);
+        sort(entries.begin(), entries.end(), [](const Entry *a, const Entry *b) {
+            return a->count > b->count || (a->count == b->count && a->firstSeen < b->firstSeen);
+        });
+        vector<KeyFrequency> result;
+        result.reserve(entries.size());
+        for (auto entry : entries)
+            result.push_back({entry->key, entry->count});
+        return result;
+    }
+
+
+    size_t SharedKeysTrainer::train(SharedKeys *sk) const {
+        size_t added = 0;
+        for (auto &kf : keysByFrequency()) {
+            if (sk->count() >= sk->maxCount())
+                break;
+            int key;
+            if (!sk->encode(kf.key, key) && sk->couldAdd(kf.key) && sk->encodeAndAdd(kf.key, key))
+                ++added;
+        }
+        return added;
+    }
+
 } }
@@ -20,7 +20,10 @@
 #include "RefCounted.hh"
 #include "StringTable.hh"
 #include <array>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <unordered_map>
 #include <vector>
 #include "betterassert.hh"
 
@@ -38,7 +41,7 @@ namespace fleece { namespace impl {
     public:
         key_t()                                     { }
         key_t(slice key)        :_string(key)       {assert_precondition(key);}
-        key_t(int key)          :_int((int16_t)key) {assert_precondition(key >= 0 && key <= INT16_MAX);}
+        key_t(int key)          :_int(key)          {assert_precondition(key >= 0);}
 
         key_t(const Value *v) noexcept;
 
@@ -51,7 +54,7 @@ namespace fleece { namespace impl {
 
     private:
         slice _string;
-        int16_t _int {-1};
+        int32_t _int {-1};
     };
 
 
@@ -65,36 +68,57 @@ namespace fleece { namespace impl {
         integer key, the Dict will look up a Scope responsible for its address, and get the
         SharedKeys instance from that Scope.
 
-        NOTE: This class is now thread-safe. */
+        NOTE: This class is now thread-safe. Lookups (`encode`, `decode`, `count`, `isUnknownKey`)
+        don't take a lock; only adding keys, and the less common accessors, are serialized. */
     class SharedKeys : public RefCounted {
     public:
-        SharedKeys() { }
-        explicit SharedKeys(slice stateData)            {loadFrom(stateData);}
+        SharedKeys();
+        explicit SharedKeys(slice stateData);
 
         alloc_slice stateData() const;
 
         /** Sets the maximum length of string that can be mapped. (Defaults to 16 bytes.) */
         void setMaxKeyLength(size_t m)          {_maxKeyLength = m;}
 
+        /** Sets the maximum number of keys that encodeAndAdd() will add; it can't be more than
+            kMaxExtendedCount. (Defaults to kMaxCount.)
+            Keys up to 2047 are encoded in Dicts as 2-byte short ints. Keys past that are encoded
+            as regular ints, which take a few more bytes; _older versions of Fleece can't read
+            Dicts with such keys,_ which is why this has to be enabled explicitly. */
+        void setMaxCount(size_t m);
+        size_t maxCount() const FLPURE          {return _maxCount;}
+
         /** The number of stored keys. */
-        size_t count() const FLPURE;
+        size_t count() const FLPURE             {return _count.load(std::memory_order_acquire);}
 
-        /** Maps a string to an integer, or returns false if there is no mapping. */
+        /** Maps a string to an integer, or returns false if there is no mapping.
+            Successful lookups are remembered in a small per-thread cache, keyed by the string's
+            address and length, so looking up the same key string again (as `Dict::get` callers
+            tend to) skips hashing it. */
         bool encode(slice string, int &key) const;
 
         /** Maps a string to an integer. Will automatically add a new mapping if the string
             qualifies. */
         bool encodeAndAdd(slice string, int &key);
 
+        /** Same as encodeAndAdd(slice,int&), but takes the string's hash, which must be equal to
+            `StringTable::hashCode(string)`, so it doesn't need to be computed again. */
+        bool encodeAndAdd(slice string, int &key, StringTable::hash_t);
+
         /** Returns true if the string could be added, i.e. there's room, it's not too long,
             and it has only valid characters. */
         inline bool couldAdd(slice str) const FLPURE {
-            return count() < kMaxCount && str.size <= _maxKeyLength && isEligibleToEncode(str);
+            return count() < _maxCount && str.size <= _maxKeyLength && isEligibleToEncode(str);
         }
 
         /** Decodes an integer back to a string. */
         slice decode(int key) const;
 
+        /** Decodes an integer to its string, quoted and escaped as a JSON string literal.
+            The JSON form is generated on first use and cached. Returns nullslice if the key
+            is unknown. */
+        slice decodeAsJSON(int key) const;
+
         /** A vector whose indices are encoded keys and values are the strings. */
         std::vector<alloc_slice> byKey() const;
 
@@ -102,11 +126,16 @@ namespace fleece { namespace impl {
             or equal to the new count. (I.e. it truncates the byKey vector.) */
         void revertToCount(size_t count);
 
-        bool isUnknownKey(int key) const FLPURE;
+        bool isUnknownKey(int key) const FLPURE         {return _isUnknownKey(key);}
+
+        /** Changes whenever keys are removed by revertToCount, so that a cache of the keys'
+            strings can tell when it has to be cleared. */
+        uint32_t generation() const FLPURE  {return _generation.load(std::memory_order_acquire);}
 
         virtual bool refresh()                          {return false;}
 
-        static const size_t kMaxCount = 2048;               // Max number of keys to store
+        static const size_t kMaxCount = 2048;               // Default max number of keys to store
+        static const size_t kMaxExtendedCount = 65536;      // Absolute max, via setMaxCount()
         static const size_t kDefaultMaxKeyLength = 16;      // Max length of string to store
 
 #ifdef __APPLE__
@@ -130,19 +159,78 @@ namespace fleece { namespace impl {
 
     private:
         friend class PersistentSharedKeys;
+        struct KeyTable;
 
-        bool _encode(slice string, int &key) const;
-        bool _encodeAndAdd(slice string, int &key);
+        bool _encode(slice string, int &key, StringTable::hash_t) const;
+        bool _encodeAndAdd(slice string, int &key, StringTable::hash_t);
         virtual int _add(slice string);
-        bool _isUnknownKey(int key) const FLPURE        {return (size_t)key >= _count;}
+        void addToTable(unsigned key);
+        const alloc_slice* storeKeyString(unsigned key, slice string);
+        bool _isUnknownKey(int key) const FLPURE        {return (size_t)key >= count();}
+        std::atomic<const alloc_slice*>& keySlot(unsigned key) const {
+            return _byKey[key / kKeysPerChunk][key % kKeysPerChunk];
+        }
+        slice keyString(unsigned key) const {
+            const alloc_slice *str = keySlot(key).load(std::memory_order_acquire);
+            return str ? slice(*str) : slice();
+        }
         slice decodeUnknown(int key) const;
 
+        // `_byKey` is allocated in chunks as it grows, so existing entries never move:
+        static constexpr size_t kKeysPerChunk = 256;
+
         size_t _maxKeyLength {kDefaultMaxKeyLength};    // Max length of string I will add
-        mutable std::mutex _mutex;
-        unsigned _count {0};
+        size_t _maxCount {kMaxCount};                   // Max number of keys I will add
+        mutable std::mutex _mutex;                      // Serializes writers
+        std::atomic<unsigned> _count {0};
+        std::atomic<uint32_t> _generation {0};          // Incremented when keys are removed
         mutable std::vector<PlatformString> _platformStringsByKey; // Reverse mapping, int->platform key
-        StringTable _table;                             // Hash table mapping slice->int
-        std::array<alloc_slice, kMaxCount> _byKey;      // Reverse mapping, int->slice
+        mutable std::vector<alloc_slice> _jsonByKey;    // Reverse mapping, int->JSON string
+        std::vector<alloc_slice> _oldJSONByKey;         // JSON of the previous string of a key
+        std::atomic<KeyTable*> _table {nullptr};        // Hash table mapping slice->int
+        std::vector<std::unique_ptr<KeyTable>> _tables; // Owns _table and the ones it replaced
+        std::vector<std::unique_ptr<alloc_slice>> _keyStrings;    // Latest string of each key
+        std::vector<std::unique_ptr<alloc_slice>> _oldKeyStrings; // Previous string of a key
+        std::unique_ptr<std::atomic<const alloc_slice*>[]> _byKey[kMaxExtendedCount / kKeysPerChunk]; // Reverse mapping, int->string in _keyStrings
+    };
+
+
+
+    /** Chooses the keys of a SharedKeys by how often they occur in a sample of documents,
+        instead of first-come-first-served. Since the most frequent keys are added first, they get
+        the smallest numbers, which are the ones that fit in narrow (2-byte) Dict keys; and rare
+        keys can't use up the available numbers before common ones are seen. */
+    class SharedKeysTrainer {
+    public:
+        /** Counts the Dict keys in `sample`, including those of nested Dicts. */
+        void addSample(const Value *sample);
+
+        /** The number of samples added. */
+        size_t sampleCount() const                  {return _sampleCount;}
+
+        struct KeyFrequency {
+            alloc_slice key;
+            size_t count;
+        };
+
+        /** All the keys seen, most frequent first. Keys with the same count are in the order
+            they were first seen. */
+        std::vector<KeyFrequency> keysByFrequency() const;
+
+        /** Adds the keys seen to `sk` in descending order of frequency, skipping ones it
+            wouldn't add (see SharedKeys::couldAdd) and stopping when it's full. Keys already in
+            `sk` keep their numbers. Returns the number of keys added. */
+        size_t train(SharedKeys *sk) const;
+
+    private:
+        struct Entry {
+            alloc_slice key;
+            size_t count;
+            size_t firstSeen;
+        };
+
+        std::unordered_map<slice, Entry, sliceHash> _keys;  // Map keys point into Entry::key
+        size_t _sampleCount {0};
     };
 
 
@@ -18,6 +18,7 @@
 
 #include "FleeceImpl.hh"
 #include "Pointer.hh"
+#include "NumConversion.hh"
 #include <ostream>
 #include <iomanip>
 #include <map>
@@ -32,9 +33,16 @@ namespace fleece { namespace impl {
         if (tag() >= kPointerTagFirst)
             out << "&";
         switch (tag()) {
-            case kSpecialTag:
             case kShortIntTag:
-            case kIntTag:
+            case kIntTag: {
+                char str[kMaxFormattedIntegerSize];
+                if (isUnsigned())
+                    out.write(str, WriteInteger(asUnsigned(), str));
+                else
+                    out.write(str, WriteInteger(asInt(), str));
+                break;
+            }
+            case kSpecialTag:
             case kFloatTag:
             case kStringTag: {
                 auto json = toJSON();
@@ -174,12 +174,12 @@ namespace fleece { namespace impl {
         switch (tag()) {
             case kShortIntTag:
             case kIntTag: {
-                int64_t i = asInt();
+                size_t size;
                 if (isUnsigned())
-                    sprintf(str, "%llu", (unsigned long long)i);
+                    size = WriteInteger(asUnsigned(), str);
                 else
-                    sprintf(str, "%lld", (long long)i);
-                break;
+                    size = WriteInteger(asInt(), str);
+                return alloc_slice(str, size);
             }
             case kSpecialTag: {
                 switch (tinyValue()) {
@@ -255,7 +255,7 @@ namespace fleece { namespace impl {
 
     template <int VER>
     alloc_slice Value::toJSON(bool canonical) const {
-        JSONEncoder encoder;
+        JSONEncoder encoder(JSONEncoder::estimateOutputSize(this));
         if (VER >= 5)
             encoder.setJSON5(true);
         encoder.setCanonical(canonical);
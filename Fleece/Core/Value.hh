@@ -263,6 +263,7 @@ namespace fleece { namespace impl {
         friend class Array;
         friend class Dict;
         friend class Encoder;
+        friend class JSONEncoder;
         friend class ValueTests;
         friend class EncoderTests;
         template <bool WIDE> friend struct dictImpl;
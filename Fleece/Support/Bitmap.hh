@@ -17,7 +17,11 @@
 //
 
 #pragma once
+#include <stdint.h>
 #include <type_traits>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #ifndef _MSC_VER
 extern "C" {
@@ -55,6 +59,28 @@ namespace fleece {
     }
 
 
+    /** Returns the number of 0 bits below the lowest 1 bit of `bits`, which must be nonzero. */
+    static inline unsigned countTrailingZeros(uint32_t bits) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, bits);
+        return index;
+#else
+        return __builtin_ctz(bits);
+#endif
+    }
+
+    static inline unsigned countTrailingZeros(uint64_t bits) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, bits);
+        return index;
+#else
+        return __builtin_ctzll(bits);
+#endif
+    }
+
+
     /** A compact fixed-size array of bits. It's backed by an integer type `Rep`,
         so the available capacities are 8, 16, 32, 64 bits. */
     template <class Rep>
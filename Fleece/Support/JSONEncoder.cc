@@ -18,50 +18,162 @@
 
 #include "JSONEncoder.hh"
 #include "FleeceImpl.hh"
+#include "Doc.hh"
+#include "Internal.hh"
 #include "SmallVector.hh"
 #include "ParseDate.hh"
+#include "Bitmap.hh"
+#include "PlatformCompat.hh"
 #include <algorithm>
 #include "betterassert.hh"
 
+#if FL_HAVE_SSE2
+    #include <emmintrin.h>
+#endif
+
 namespace fleece { namespace impl {
+    using namespace internal;
+
+    // Returns true if a byte has to be escaped in a JSON string.
+    static inline bool needsEscape(uint8_t ch) {
+        return ch == '"' || ch == '\\' || ch < 32 || ch == 127;
+    }
+
+
+    // Returns a pointer to the first byte in [p, end) that needs escaping, or `end` if none.
+    __hot static const uint8_t* findEscapable(const uint8_t *p, const uint8_t *end) {
+#if FL_HAVE_SSE2
+        const __m128i kQuote = _mm_set1_epi8('"'), kBackslash = _mm_set1_epi8('\\'),
+                      kDel = _mm_set1_epi8(127),   k0x1F = _mm_set1_epi8(0x1F);
+        for (; end - p >= 16; p += 16) {
+            __m128i in = _mm_loadu_si128((const __m128i*)p);
+            // A byte is a control character iff max(byte, 0x1F) == 0x1F (unsigned):
+            __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(in, kQuote),
+                                                     _mm_cmpeq_epi8(in, kBackslash)),
+                                        _mm_or_si128(_mm_cmpeq_epi8(in, kDel),
+                                                     _mm_cmpeq_epi8(_mm_max_epu8(in, k0x1F),
+                                                                    k0x1F)));
+            int mask = _mm_movemask_epi8(hits);
+            if (mask != 0)
+                return p + countTrailingZeros(uint32_t(mask));
+        }
+#endif
+        for (; p < end; ++p) {
+            if (needsEscape(*p))
+                break;
+        }
+        return p;
+    }
 
-    void JSONEncoder::writeString(slice str) {
+
+    // Escape sequences for control characters. Only the ones with short forms are special;
+    // the rest are written as `\u00XX`.
+    static const char kControlEscapes[32][7] = {
+        "\\u0000", "\\u0001", "\\u0002", "\\u0003", "\\u0004", "\\u0005", "\\u0006", "\\u0007",
+        "\\u0008", "\\t",     "\\n",     "\\u000b", "\\u000c", "\\r",     "\\u000e", "\\u000f",
+        "\\u0010", "\\u0011", "\\u0012", "\\u0013", "\\u0014", "\\u0015", "\\u0016", "\\u0017",
+        "\\u0018", "\\u0019", "\\u001a", "\\u001b", "\\u001c", "\\u001d", "\\u001e", "\\u001f",
+    };
+
+    static inline slice escapeSequence(uint8_t ch) {
+        if (ch < 32) {
+            const char *seq = kControlEscapes[ch];
+            return {seq, size_t(seq[1] == 'u' ? 6 : 2)};
+        } else if (ch == '"') {
+            return "\\\""_sl;
+        } else if (ch == '\\') {
+            return "\\\\"_sl;
+        } else {
+            return "\\u007f"_sl;
+        }
+    }
+
+
+    __hot void JSONEncoder::writeString(slice str) {
         comma();
-        _out << '"';
-        auto start = (const uint8_t*)str.buf;
+        auto p = (const uint8_t*)str.buf;
         auto end = (const uint8_t*)str.end();
-        for (auto p = start; p < end; p++) {
-            uint8_t ch = *p;
-            if (ch == '"' || ch == '\\' || ch < 32 || ch == 127) {
-                // Write characters from start up to p-1:
-                _out.write({start, p});
-                start = p + 1;
-                switch (ch) {
-                    case '"':
-                    case '\\':
-                        _out << '\\';
-                        --start; // ch will be written in next pass
-                        break;
-                    case '\r':
-                        _out.write("\\r"_sl);
-                        break;
-                    case '\n':
-                        _out.write("\\n"_sl);
-                        break;
-                    case '\t':
-                        _out.write("\\t"_sl);
-                        break;
-                    default: {
-                        char buf[7];
-                        _out.write(buf, sprintf(buf, "\\u%04x", (unsigned)ch));
-                        break;
-                    }
-                }
-            }
+        auto next = findEscapable(p, end);
+        if (_usuallyTrue(next == end)) {
+            // Nothing to escape, so write the whole string at once:
+            auto dst = _out.reserveSpace<char>(str.size + 2);
+            dst[0] = '"';
+            memcpy(dst + 1, str.buf, str.size);
+            dst[str.size + 1] = '"';
+            return;
         }
-        if (end > start)
-            _out.write({start, end});
         _out << '"';
+        while (true) {
+            if (next > p)
+                _out.write({p, next});
+            if (next == end)
+                break;
+            _out.write(escapeSequence(*next));
+            p = next + 1;
+            next = findEscapable(p, end);
+        }
+        _out << '"';
+    }
+
+
+    // Adds a rough (usually high) estimate of the size of a Value's JSON form to `size`.
+    // Stops walking nested collections once `size` reaches `limit`.
+    static void addEstimatedSize(const Value *v, size_t &size, size_t limit) {
+        switch (v->type()) {
+            case kNull:
+            case kBoolean:
+                size += 5;
+                break;
+            case kNumber:
+                size += 20;
+                break;
+            case kString: {
+                size_t len = v->asString().size;
+                size += len + len / 2 + 2;
+                break;
+            }
+            case kData:
+                size += (v->asData().size + 2) / 3 * 4 + 2;     // base64
+                break;
+            case kArray:
+                size += 2;
+                for (Array::iterator i(v->asArray()); i && size < limit; ++i) {
+                    addEstimatedSize(i.value(), size, limit);
+                    size += 1;
+                }
+                break;
+            case kDict:
+                size += 2;
+                for (Dict::iterator i(v->asDict()); i && size < limit; ++i) {
+                    slice key = i.key()->asString();
+                    size += (key ? key.size : 16) + 4;
+                    addEstimatedSize(i.value(), size, limit);
+                }
+                break;
+        }
+    }
+
+
+    /*static*/ size_t JSONEncoder::estimateOutputSize(const Value *v) {
+        // The estimate comes from the Value itself, not the data around it, since a small
+        // collection may be part of a much bigger document. It's capped, to limit the time spent
+        // walking big collections, and the size of the buffer preallocated for them.
+        static constexpr size_t kMaxEstimate = 256 * 1024;
+        size_t size = 0;
+        addEstimatedSize(v, size, kMaxEstimate);
+        return std::min(size, kMaxEstimate) + 64;
+    }
+
+
+    size_t JSONEncoder::copyOutput(void *dst, size_t capacity) const {
+        size_t length = _out.length();
+        if (length > capacity)
+            return 0;
+        _out.forEachChunk([&](slice chunk) {
+            memcpy(dst, chunk.buf, chunk.size);
+            dst = offsetby(dst, chunk.size);
+        });
+        return length;
     }
 
 
@@ -132,7 +244,138 @@ namespace fleece { namespace impl {
     }
 
 
+    // Writes an immutable Value by walking its encoded form directly, instead of going through
+    // the Array and Dict iterators. All the Values it reaches are immutable too.
+    __hot void JSONEncoder::writeImmutable(const Value *v) {
+        switch (v->tag()) {
+            case kShortIntTag:
+            case kIntTag:
+                if (v->isUnsigned())
+                    writeUInt(v->asUnsigned());
+                else
+                    writeInt(v->asInt());
+                break;
+            case kFloatTag:
+                if (v->isDouble())
+                    writeDouble(v->asDouble());
+                else
+                    writeFloat(v->asFloat());
+                break;
+            case kSpecialTag:
+                switch (v->tinyValue()) {
+                    case kSpecialValueFalse:        writeBool(false); break;
+                    case kSpecialValueTrue:         writeBool(true); break;
+                    case kSpecialValueUndefined:    comma(); _out << slice("undefined"); break;
+                    default:                        writeNull(); break;
+                }
+                break;
+            case kStringTag:
+                writeString(v->getStringBytes());
+                break;
+            case kBinaryTag:
+                writeData(v->getStringBytes());
+                break;
+            case kArrayTag: {
+                beginArray();
+                Array::impl items(v);
+                bool wide = (items._width == kWide);
+                auto slot = items._first;
+                for (uint32_t i = items._count; i > 0; --i) {
+                    writeImmutable(slot->isPointer() ? slot->deref(wide) : slot);
+                    slot = offsetby(slot, items._width);
+                }
+                endArray();
+                break;
+            }
+            case kDictTag:
+                writeImmutableDict(v);
+                break;
+            default:
+                FleeceException::_throw(UnknownValue, "illegal typecode in Value; corrupt data?");
+        }
+    }
+
+
+    __hot void JSONEncoder::writeImmutableDict(const Value *v) {
+        Array::impl items(v);
+        if (_usuallyFalse(items._count > 0 && Dict::isMagicParentKey(items._first))) {
+            // Inherited dicts have to be merged with their parent, so use the iterator:
+            writeDict((const Dict*)v);
+            return;
+        }
+        beginDictionary();
+        bool wide = (items._width == kWide);
+        auto slot = items._first;
+        for (uint32_t i = items._count; i > 0; --i) {
+            const Value *key = slot->isPointer() ? slot->deref(wide) : slot;
+            if (_usuallyTrue(key->tag() == kStringTag))
+                writeKey(key->getStringBytes());
+            else
+                writeSharedKey(key, v);
+            slot = offsetby(slot, items._width);
+            writeImmutable(slot->isPointer() ? slot->deref(wide) : slot);
+            slot = offsetby(slot, items._width);
+        }
+        endDictionary();
+    }
+
+
+    // Writes an integer Dict key, using a cached JSON form of its string.
+    void JSONEncoder::writeSharedKey(const Value *key, const Value *dict) {
+        if (_usuallyFalse(!_sharedKeysKnown)) {
+            SharedKeys *sk = Doc::sharedKeys(dict);
+            if (sk != _sharedKeys) {
+                _sharedKeys = sk;
+                _jsonKeys.clear();
+                if (sk)
+                    _jsonKeysGeneration = sk->generation();
+            }
+            _sharedKeysKnown = true;
+        }
+
+        slice json;
+        if (_sharedKeys && key->isInteger()) {
+            if (_usuallyFalse(_sharedKeys->generation() != _jsonKeysGeneration)) {
+                // Keys were reverted, so the cached strings may be wrong:
+                _jsonKeys.clear();
+                _jsonKeysGeneration = _sharedKeys->generation();
+            }
+            auto intKey = key->asInt();
+            if (_usuallyTrue(intKey >= 0 && intKey < int64_t(_jsonKeys.size()) && _jsonKeys[intKey]))
+                json = _jsonKeys[intKey];
+            else if (intKey >= 0 && intKey < int64_t(SharedKeys::kMaxExtendedCount)) {
+                json = _sharedKeys->decodeAsJSON(int(intKey));
+                if (json) {
+                    if (intKey >= int64_t(_jsonKeys.size()))
+                        _jsonKeys.resize(intKey + 1);
+                    _jsonKeys[intKey] = json;
+                }
+            }
+        }
+
+        if (_usuallyFalse(!json)) {
+            // Unknown key; write it as-is, the same as the Dict iterator path does:
+            comma();
+            _first = true;
+            writeImmutable(key);
+            _out << ':';
+        } else if (_usuallyFalse(_json5)) {
+            writeKey(_sharedKeys->decode(int(key->asInt())));
+            return;
+        } else {
+            comma();
+            _out << json << ':';
+        }
+        _first = true;
+    }
+
+
     void JSONEncoder::writeValue(const Value *v) {
+        if (_usuallyTrue(!v->isMutable() && !_canonical)) {
+            _sharedKeysKnown = false;
+            writeImmutable(v);
+            return;
+        }
         switch (v->type()) {
             case kNull:
                 if (v->isUndefined()) {
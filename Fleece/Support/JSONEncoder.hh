@@ -20,9 +20,11 @@
 
 #include "Writer.hh"
 #include "Value.hh"
+#include "SharedKeys.hh"
 #include "FleeceException.hh"
 #include "NumConversion.hh"
 #include <stdio.h>
+#include <vector>
 
 
 namespace fleece { namespace impl {
@@ -34,6 +36,17 @@ namespace fleece { namespace impl {
         :_out(reserveOutputSize)
         { }
 
+        /** Constructs an encoder that writes into a caller-provided buffer, which must remain
+            valid as long as the encoder exists. If the JSON fits, nothing is allocated and
+            `output()` returns a single range at the start of the buffer. */
+        explicit JSONEncoder(slice outputBuffer)
+        :_out(outputBuffer)
+        { }
+
+        /** Estimates the size of a Value's JSON form, for preallocating an output buffer.
+            This is usually an overestimate, but it isn't guaranteed to be. */
+        static size_t estimateOutputSize(const Value* NONNULL);
+
         /** In JSON5 mode, dictionary keys that are JavaScript identifiers will be unquoted. */
         void setJSON5(bool j5)                  {_json5 = j5;}
         void setCanonical(bool canonical)       {_canonical = canonical;}
@@ -44,6 +57,15 @@ namespace fleece { namespace impl {
         /** Returns the encoded data. */
         alloc_slice finish()                    {return _out.finish();}
 
+        /** Returns the data encoded so far as a list of byte ranges, in order, without copying.
+            The ranges can be passed to `writev` as an iovec array. They remain valid until the
+            encoder is reset or destroyed. */
+        std::vector<slice> output() const       {return _out.output();}
+
+        /** Copies the data encoded so far to `dst` and returns its length. If it doesn't fit in
+            `capacity` bytes, copies nothing and returns 0. */
+        size_t copyOutput(void *dst, size_t capacity) const;
+
         /** Resets the encoder so it can be used again. */
         void reset()                            {_out.reset(); _first = true;}
 
@@ -52,8 +74,8 @@ namespace fleece { namespace impl {
         void writeNull()                        {comma(); _out << slice("null");}
         void writeBool(bool b)                  {comma(); _out.write(b ? "true"_sl : "false"_sl);}
 
-        void writeInt(int64_t i)                {_writeInt("%lld", i);}
-        void writeUInt(uint64_t i)              {_writeInt("%llu", i);}
+        void writeInt(int64_t i)                {comma(); _writeInt(i < 0, i < 0 ? 0 - uint64_t(i) : i);}
+        void writeUInt(uint64_t i)              {comma(); _writeInt(false, i);}
         void writeFloat(float f)                {_writeFloat(f);}
         void writeDouble(double d)              {_writeFloat(d);}
 
@@ -111,6 +133,9 @@ namespace fleece { namespace impl {
 
     private:
         void writeDict(const Dict*);
+        void writeImmutable(const Value*);
+        void writeImmutableDict(const Value*);
+        void writeSharedKey(const Value *key, const Value *dict);
         
         void comma() {
             if (_first)
@@ -119,11 +144,13 @@ namespace fleece { namespace impl {
                 _out << ',';
         }
 
-        template <class T>
-        void _writeInt(const char *fmt, T t) {
-            comma();
-            char str[32];
-            _out.write(str, sprintf(str, fmt, t));
+        void _writeInt(bool negative, uint64_t magnitude) {
+            // Format the digits directly into the output buffer:
+            unsigned nDigits = CountDecimalDigits(magnitude);
+            char *dst = _out.reserveSpace<char>(negative + nDigits);
+            if (negative)
+                *dst++ = '-';
+            WriteDecimalDigits(magnitude, dst, nDigits);
         }
 
         template <class T>
@@ -134,6 +161,10 @@ namespace fleece { namespace impl {
         }
 
         Writer _out;
+        Retained<SharedKeys> _sharedKeys;       // SharedKeys of the immutable data being written
+        std::vector<slice> _jsonKeys;           // Cached JSON strings of _sharedKeys' keys
+        uint32_t _jsonKeysGeneration {0};       // _sharedKeys' generation when cached
+        bool _sharedKeysKnown {false};          // False if _sharedKeys needs to be looked up
         bool _json5 {false};
         bool _canonical {false};
         bool _first {true};
@@ -0,0 +1,187 @@
+//
+// JSONScanner.cc
+//
+// Copyright (c) 2021 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "JSONScanner.hh"
+#include "Bitmap.hh"
+#include "PlatformCompat.hh"
+#include <algorithm>
+#include <string.h>
+
+#if FL_HAVE_SSE2
+    #include <emmintrin.h>
+#endif
+
+
+namespace fleece {
+
+    // Bit masks describing one 64-byte block of input; bit i corresponds to byte i.
+    struct BlockMasks {
+        uint64_t quote;         // '"'
+        uint64_t backslash;     // '\'
+        uint64_t op;            // structural punctuation: { } [ ] : ,
+        uint64_t space;         // JSON whitespace: space, tab, CR, LF
+    };
+
+
+#if FL_HAVE_SSE2
+
+    static inline uint64_t movemask(__m128i v, unsigned chunk) {
+        return uint64_t(uint16_t(_mm_movemask_epi8(v))) << (16 * chunk);
+    }
+
+    __hot static inline BlockMasks classify(const uint8_t *src) {
+        const __m128i kQuote = _mm_set1_epi8('"'),   kBackslash = _mm_set1_epi8('\\'),
+                      kLBrace = _mm_set1_epi8('{'),  kRBrace = _mm_set1_epi8('}'),
+                      kColon = _mm_set1_epi8(':'),   kComma = _mm_set1_epi8(','),
+                      kSpace = _mm_set1_epi8(' '),   kTab = _mm_set1_epi8('\t'),
+                      kLF = _mm_set1_epi8('\n'),     kCR = _mm_set1_epi8('\r'),
+                      k0x20 = _mm_set1_epi8(0x20);
+        BlockMasks m = { };
+        for (unsigned i = 0; i < 4; ++i) {
+            __m128i in = _mm_loadu_si128((const __m128i*)(src + 16*i));
+            // ORing in 0x20 maps '[' to '{' and ']' to '}', without aliasing anything else:
+            __m128i folded = _mm_or_si128(in, k0x20);
+            __m128i op = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(folded, kLBrace),
+                                                   _mm_cmpeq_epi8(folded, kRBrace)),
+                                      _mm_or_si128(_mm_cmpeq_epi8(in, kColon),
+                                                   _mm_cmpeq_epi8(in, kComma)));
+            __m128i space = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(in, kSpace),
+                                                      _mm_cmpeq_epi8(in, kTab)),
+                                         _mm_or_si128(_mm_cmpeq_epi8(in, kLF),
+                                                      _mm_cmpeq_epi8(in, kCR)));
+            m.quote     |= movemask(_mm_cmpeq_epi8(in, kQuote), i);
+            m.backslash |= movemask(_mm_cmpeq_epi8(in, kBackslash), i);
+            m.op        |= movemask(op, i);
+            m.space     |= movemask(space, i);
+        }
+        return m;
+    }
+
+#else
+
+    enum : uint8_t {kQuoteClass = 1, kBackslashClass, kOpClass, kSpaceClass};
+
+    static const uint8_t* classTable() {
+        static uint8_t table[256];
+        static bool initialized = [] {
+            table[uint8_t('"')] = kQuoteClass;
+            table[uint8_t('\\')] = kBackslashClass;
+            for (char c : {'{', '}', '[', ']', ':', ','})
+                table[uint8_t(c)] = kOpClass;
+            for (char c : {' ', '\t', '\n', '\r'})
+                table[uint8_t(c)] = kSpaceClass;
+            return true;
+        }();
+        (void)initialized;
+        return table;
+    }
+
+    __hot static inline BlockMasks classify(const uint8_t *src) {
+        static const uint8_t *table = classTable();
+        BlockMasks m = { };
+        for (unsigned i = 0; i < 64; ++i) {
+            uint64_t bit = 1ull << i;
+            switch (table[src[i]]) {
+                case kQuoteClass:       m.quote |= bit; break;
+                case kBackslashClass:   m.backslash |= bit; break;
+                case kOpClass:          m.op |= bit; break;
+                case kSpaceClass:       m.space |= bit; break;
+            }
+        }
+        return m;
+    }
+
+#endif
+
+
+    // Returns a mask of the characters that are escaped by a preceding backslash.
+    // `carry` is 1 if the last byte of the previous block was an unescaped backslash.
+    static inline uint64_t findEscaped(uint64_t backslash, uint64_t &carry) {
+        uint64_t escaped = carry;
+        backslash &= ~carry;
+        carry = 0;
+        while (_usuallyFalse(backslash != 0)) {
+            unsigned i = countTrailingZeros(backslash);
+            if (i == 63) {
+                carry = 1;
+                break;
+            }
+            escaped |= 2ull << i;
+            backslash &= ~(3ull << i);      // an escaped backslash doesn't escape anything
+        }
+        return escaped;
+    }
+
+
+    // Sets each bit to the XOR of itself and all lower bits, so that the bits between an
+    // opening and closing quote (including the opening quote) become 1.
+    static inline uint64_t prefixXOR(uint64_t bits) {
+        bits ^= bits << 1;
+        bits ^= bits << 2;
+        bits ^= bits << 4;
+        bits ^= bits << 8;
+        bits ^= bits << 16;
+        bits ^= bits << 32;
+        return bits;
+    }
+
+
+    __hot void JSONScanner::scan(slice json) {
+        auto src = (const uint8_t*)json.buf;
+        size_t size = json.size;
+        _count = 0;
+        if (_positions.size() < 64)
+            _positions.resize(std::max(size_t(64), size / 4));
+
+        uint64_t escapeCarry = 0, inStringCarry = 0, tokenCarry = 0;
+        for (size_t pos = 0; pos < size; pos += 64) {
+            BlockMasks m;
+            if (_usuallyTrue(pos + 64 <= size)) {
+                m = classify(src + pos);
+            } else {
+                uint8_t padded[64];
+                memset(padded, ' ', sizeof(padded));
+                memcpy(padded, src + pos, size - pos);
+                m = classify(padded);
+            }
+
+            uint64_t quotes = m.quote & ~findEscaped(m.backslash, escapeCarry);
+            uint64_t inString = prefixXOR(quotes) ^ inStringCarry;
+            inStringCarry = uint64_t(int64_t(inString) >> 63);
+
+            // Any other byte outside a string belongs to a number or literal; index the first
+            // byte of each run of them:
+            uint64_t tokens = ~(m.op | m.space | quotes | inString);
+            uint64_t tokenStarts = tokens & ~((tokens << 1) | tokenCarry);
+            tokenCarry = tokens >> 63;
+
+            uint64_t structurals = (m.op & ~inString) | quotes | tokenStarts;
+
+            if (_usuallyFalse(_count + 64 > _positions.size()))
+                _positions.resize(2 * _positions.size() + 64);
+            uint32_t *out = &_positions[_count];
+            while (structurals) {
+                *out++ = uint32_t(pos + countTrailingZeros(structurals));
+                structurals &= structurals - 1;
+            }
+            _count = out - _positions.data();
+        }
+        _endsInString = (inStringCarry != 0);
+    }
+
+}
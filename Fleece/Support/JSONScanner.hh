@@ -0,0 +1,52 @@
+//
+// JSONScanner.hh
+//
+// Copyright (c) 2021 Couchbase, Inc All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#pragma once
+#include "fleece/slice.hh"
+#include <vector>
+
+namespace fleece {
+
+    /** First stage of a two-stage JSON parser. It makes a single pass over the input, 64 bytes
+        at a time (using SSE2 where available), and builds an index of the byte offsets of:
+        - every structural character `{ } [ ] : ,` that isn't inside a string;
+        - every unescaped `"` (both the opening and the closing quote of each string);
+        - the first byte of every other token outside a string (numbers and literals.)
+
+        The index makes no attempt to validate the JSON; that's up to the second stage, which
+        walks the offsets in order. Since both quotes of a string are indexed, the entry after an
+        opening quote is always its closing quote (unless the input ends inside the string.) */
+    class JSONScanner {
+    public:
+        /** Scans `json`, replacing the previous index. The input must be smaller than 4GB. */
+        void scan(slice json);
+
+        const uint32_t* begin() const           {return _positions.data();}
+        const uint32_t* end() const             {return _positions.data() + _count;}
+        size_t size() const                     {return _count;}
+
+        /** True if the input ended inside a string, i.e. with an unmatched `"`. */
+        bool endsInString() const               {return _endsInString;}
+
+    private:
+        std::vector<uint32_t> _positions;
+        size_t _count {0};
+        bool _endsInString {false};
+    };
+
+}
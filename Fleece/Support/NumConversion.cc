@@ -113,6 +113,61 @@ namespace fleece {
     }
 
 
+    // The two-digit decimal representations of 0 through 99, concatenated.
+    static const char kDigitPairs[201] =
+        "00010203040506070809" "10111213141516171819" "20212223242526272829"
+        "30313233343536373839" "40414243444546474849" "50515253545556575859"
+        "60616263646566676869" "70717273747576777879" "80818283848586878889"
+        "90919293949596979899";
+
+
+    unsigned CountDecimalDigits(uint64_t n) noexcept {
+        unsigned digits = 1;
+        while (true) {
+            if (n < 10)     return digits;
+            if (n < 100)    return digits + 1;
+            if (n < 1000)   return digits + 2;
+            if (n < 10000)  return digits + 3;
+            n /= 10000;
+            digits += 4;
+        }
+    }
+
+
+    __hot void WriteDecimalDigits(uint64_t n, char *dst, unsigned nDigits) noexcept {
+        // Write two digits at a time, starting from the end:
+        char *end = dst + nDigits;
+        while (n >= 100) {
+            auto pair = &kDigitPairs[2 * (n % 100)];
+            n /= 100;
+            end -= 2;
+            end[0] = pair[0];
+            end[1] = pair[1];
+        }
+        if (n >= 10) {
+            end[-2] = kDigitPairs[2 * n];
+            end[-1] = kDigitPairs[2 * n + 1];
+        } else {
+            end[-1] = char('0' + n);
+        }
+    }
+
+
+    size_t WriteInteger(uint64_t n, char *dst) noexcept {
+        unsigned nDigits = CountDecimalDigits(n);
+        WriteDecimalDigits(n, dst, nDigits);
+        return nDigits;
+    }
+
+
+    size_t WriteInteger(int64_t n, char *dst) noexcept {
+        if (n >= 0)
+            return WriteInteger(uint64_t(n), dst);
+        *dst = '-';
+        return 1 + WriteInteger(uint64_t(0) - uint64_t(n), dst + 1);  // (no overflow on INT64_MIN)
+    }
+
+
     size_t WriteFloat(float n, char *dst, size_t capacity) {
         return swift_format_float(n, dst, capacity);
     }
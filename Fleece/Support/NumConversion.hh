@@ -46,6 +46,25 @@ namespace fleece {
     double ParseDouble(const char *str NONNULL) noexcept;
 
 
+    /// The maximum number of bytes written by `WriteInteger`, e.g. for "-9223372036854775808".
+    constexpr size_t kMaxFormattedIntegerSize = 20;
+
+    /// Returns the number of decimal digits in `n`.
+    unsigned CountDecimalDigits(uint64_t n) noexcept;
+
+    /// Writes the decimal digits of `n` to `dst`, which must have room for exactly `nDigits`,
+    /// the value returned by `CountDecimalDigits(n)`. Does not write a NUL terminator.
+    void WriteDecimalDigits(uint64_t n, char *dst NONNULL, unsigned nDigits) noexcept;
+
+    /// Format an unsigned integer in decimal. `dst` must have room for `kMaxFormattedIntegerSize`
+    /// bytes. Returns the number of bytes written; does not write a NUL terminator.
+    size_t WriteInteger(uint64_t n, char *dst NONNULL) noexcept;
+
+    /// Format a signed integer in decimal. `dst` must have room for `kMaxFormattedIntegerSize`
+    /// bytes. Returns the number of bytes written; does not write a NUL terminator.
+    size_t WriteInteger(int64_t n, char *dst NONNULL) noexcept;
+
+
     /// Format a 64-bit-floating point number to a string.
     size_t WriteFloat(double n, char *dst, size_t capacity);
 
@@ -150,6 +150,12 @@
 #   endif
 #endif /* __cold */
 
+// FL_HAVE_SSE2 is defined if SSE2 intrinsics (<emmintrin.h>) can be used. SSE2 is part of the
+// x86-64 baseline, so this requires no special compiler flags.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define FL_HAVE_SSE2 1
+#endif
+
 // Platform independent string substitutions
 #if defined(__linux__)
 #define PRIms "ld"
@@ -35,6 +35,15 @@ namespace fleece {
         if (r) r->_release();
     }
 
+    bool tryRetain(const RefCounted *r) noexcept {
+        int32_t oldRef = r->_refCount.load();
+        do {
+            if (oldRef <= 0)    // (The DEBUG kCarefulInitialRefCount is negative, too)
+                return false;
+        } while (!r->_refCount.compare_exchange_weak(oldRef, oldRef + 1));
+        return true;
+    }
+
     __hot void copyRef(void* dstPtr, RefCounted *src) noexcept {
         auto old = *(RefCounted**)dstPtr;
         *(RefCounted**)dstPtr = retain(src);
@@ -42,6 +42,7 @@ namespace fleece {
         template <typename T>
         friend T* retain(T*) noexcept;
         friend void release(const RefCounted*) noexcept;
+        friend bool tryRetain(const RefCounted*) noexcept;
 
 #if DEBUG
         void _retain() const noexcept           {_careful_retain();}
@@ -75,6 +76,12 @@ namespace fleece {
     /** Releases a RefCounted object. Does nothing given a null pointer. */
     NOINLINE void release(const RefCounted *r) noexcept;
 
+    /** Retains a RefCounted object unless its ref-count is zero, meaning it hasn't been retained
+        yet or is being destructed. Returns true if it retained it.
+        This is for getting a reference from a pointer that isn't one, like a registry entry; the
+        caller has to make sure the object's memory hasn't been freed yet. */
+    bool tryRetain(const RefCounted *r NONNULL) noexcept;
+
     // Used internally by Retained
     void copyRef(void* dstPtr, RefCounted *src) noexcept;
 
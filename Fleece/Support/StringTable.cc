@@ -18,11 +18,16 @@
 
 #include "StringTable.hh"
 #include "PlatformCompat.hh"
+#include "Bitmap.hh"
 #include <algorithm>
 #include <stdlib.h>
 #include <vector>
 #include "betterassert.hh"
 
+#if FL_HAVE_SSE2
+    #include <emmintrin.h>
+#endif
+
 namespace fleece {
 
     // Minimum size [not capacity] of table to create initially
@@ -91,8 +96,31 @@ namespace fleece {
     __hot const StringTable::entry_t* StringTable::find(key_t key, hash_t hash) const noexcept {
         assert_precondition(key.buf != nullptr);
         assert_precondition(hash != hash_t::Empty);
-        size_t end = wrap(size_t(hash) + _maxDistance + 1);
-        for (size_t i = indexOfHash(hash); i != end; i = wrap(i + 1)) {
+        size_t i = indexOfHash(hash);
+        ssize_t remaining = _maxDistance + 1;      // No entry is farther than this from its home
+#if FL_HAVE_SSE2
+        // Compare 4 hashes at a time, as long as they don't wrap around the end of the table:
+        const __m128i needle = _mm_set1_epi32(int32_t(hash)), empty = _mm_setzero_si128();
+        while (remaining > 0 && i + 4 <= _size) {
+            __m128i hashes = _mm_loadu_si128((const __m128i*)&_hashes[i]);
+            unsigned matches = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(hashes, needle)));
+            unsigned empties = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(hashes, empty)));
+            // Only the slots before the first empty one, and within range, can hold the key:
+            unsigned live = empties ? (empties & (0u - empties)) - 1 : 0xF;
+            if (remaining < 4)
+                live &= (1u << remaining) - 1;
+            for (matches &= live; matches; matches &= matches - 1) {
+                size_t j = i + countTrailingZeros(uint32_t(matches));
+                if (_usuallyTrue(_entries[j].first == key))
+                    return &_entries[j];
+            }
+            if (live != 0xF)
+                return nullptr;
+            i = wrap(i + 4);
+            remaining -= 4;
+        }
+#endif
+        for (; remaining > 0; --remaining, i = wrap(i + 1)) {
             if (_hashes[i] == hash_t::Empty)
                 break;
             else if (_hashes[i] == hash && _entries[i].first == key)
@@ -230,6 +258,24 @@ namespace fleece {
     }
 
 
+    size_t StringTable::removeIf(function_ref<bool(entry_t&)> shouldRemove) {
+        std::vector<std::pair<hash_t, entry_t>> kept;
+        kept.reserve(_count);
+        for (size_t i = 0; i < _size; ++i) {
+            if (_hashes[i] != hash_t::Empty && !shouldRemove(_entries[i]))
+                kept.emplace_back(_hashes[i], _entries[i]);
+        }
+        size_t removed = _count - kept.size();
+        if (removed > 0) {
+            clear();
+            _count = kept.size();
+            for (auto &item : kept)
+                _insertOnly(item.first, item.second);
+        }
+        return removed;
+    }
+
+
     void StringTable::dump() const noexcept {
         ssize_t totalDistance = 0;
         std::vector<size_t> distanceCounts(_maxDistance+1);
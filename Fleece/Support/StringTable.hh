@@ -20,7 +20,9 @@
 
 #include "PlatformCompat.hh"
 #include "fleece/slice.hh"
+#include "function_ref.hh"
 #include <algorithm>
+#include <string.h>
 
 namespace fleece {
 
@@ -39,8 +41,35 @@ namespace fleece {
 
         enum class hash_t : uint32_t { Empty = 0 };
 
+        /// The hash function used by the table. It's not the same as `slice::hash()`: since the
+        /// hashes are never persisted, it's free to use a faster algorithm that reads 8 bytes
+        /// at a time. (Most keys are short, so it's optimized for strings under 16 bytes.)
         static inline hash_t hashCode(key_t key) FLPURE {
-            return hash_t( std::max(key.hash(), 1u) ); // hashCode must never be zero
+            auto p = (const uint8_t*)key.buf;
+            size_t n = key.size;
+            uint64_t h = 0x9E3779B97F4A7C15ull ^ (n * kHashMul1);
+            if (_usuallyTrue(n <= 16)) {
+                uint64_t a, b;
+                if (n >= 8) {
+                    a = load64(p);
+                    b = load64(p + n - 8);
+                } else if (n >= 4) {
+                    a = load32(p);
+                    b = load32(p + n - 4);
+                } else if (n > 0) {
+                    a = (uint64_t(p[0]) << 16) | (uint64_t(p[n >> 1]) << 8) | p[n - 1];
+                    b = 0;
+                } else {
+                    a = b = 0;
+                }
+                h = mix(h ^ a, b ^ kHashMul2);
+            } else {
+                for (; n > 16; n -= 16, p += 16)
+                    h = mix(h ^ load64(p), load64(p + 8) ^ kHashMul2);
+                h = mix(h ^ load64(p + n - 16), load64(p + n - 8) ^ kHashMul2);
+            }
+            auto result = uint32_t(h ^ (h >> 32));
+            return hash_t( std::max(result, 1u) ); // hashCode must never be zero
         }
 
         size_t count() const FLPURE                            {return _count;}
@@ -64,9 +93,29 @@ namespace fleece {
         void insertOnly(key_t key, value_t value)       {insertOnly(key, value, hashCode(key));}
         void insertOnly(key_t key, value_t value, hash_t);
 
+        /// Removes every entry for which the callback returns true. The callback may change the
+        /// values of the entries it keeps. Returns the number of entries removed.
+        size_t removeIf(function_ref<bool(entry_t&)> shouldRemove);
+
         void dump() const noexcept;
 
     protected:
+        static constexpr uint64_t kHashMul1 = 0xA0761D6478BD642Full, kHashMul2 = 0xE7037ED1A0B428DBull;
+
+        static inline uint64_t load64(const uint8_t *p)  {uint64_t v; memcpy(&v, p, 8); return v;}
+        static inline uint64_t load32(const uint8_t *p)  {uint32_t v; memcpy(&v, p, 4); return v;}
+
+        // Combines two 64-bit words into a well-mixed 64-bit hash.
+        static inline uint64_t mix(uint64_t a, uint64_t b) {
+            a ^= a >> 29;
+            a *= kHashMul1;
+            b ^= b >> 31;
+            b *= kHashMul2;
+            uint64_t h = a ^ (b + (a >> 32));
+            h ^= h >> 32;
+            return h * kHashMul1;
+        }
+
         StringTable(size_t capacity,
                     size_t initialSize, hash_t *initialHashes, entry_t *initialEntries);
         inline size_t wrap(size_t i) const              {return i & _sizeMask;}
@@ -27,19 +27,86 @@
 
 namespace fleece {
 
+    // A WriterSink that buffers output and writes it to a FILE when committed.
+    class FILESink : public WriterSink {
+    public:
+        static constexpr size_t kBufferSize = 4096;
+
+        explicit FILESink(FILE *file)
+        :_file(file)
+        { }
+
+        ~FILESink() {
+            _buffer.free();
+        }
+
+        slice acquire(size_t minSize) override {
+            if (minSize > _buffer.size) {
+                _buffer.free();
+                size_t size = std::max(minSize, kBufferSize);
+                _buffer = slice(slice::newBytes(size), size);
+            }
+            _pos = 0;
+            return _buffer;
+        }
+
+        void commit(size_t size) override {
+            if (fwrite(offsetby(_buffer.buf, _pos), 1, size, _file) < size)
+                FleeceException::_throwErrno("Writer can't write to file");
+            _pos += size;
+        }
+
+    private:
+        FILE* const _file;
+        slice _buffer;
+        size_t _pos {0};
+    };
+
+
+    slice RegionSink::acquire(size_t minSize) {
+        throwIf(minSize > _region.size - _committed, MemoryError, "output region is full");
+        return slice(offsetby(_region.buf, _committed), _region.size - _committed);
+    }
+
+
+    void RegionSink::commit(size_t size) {
+        assert_precondition(size <= _region.size - _committed);
+        _committed += size;
+    }
+
+
     Writer::Writer(size_t initialCapacity)
     :_chunkSize(initialCapacity)
-    ,_outputFile(nullptr)
     {
         addChunk(initialCapacity);
     }
 
 
     Writer::Writer(FILE *outputFile)
-    :Writer(kDefaultInitialCapacity)
+    :Writer(new FILESink(outputFile))
     {
         assert_precondition(outputFile);
-        _outputFile = outputFile;
+        _ownedSink.reset(_sink);
+    }
+
+
+    Writer::Writer(WriterSink *sink)
+    :_chunkSize(0)
+    ,_sink(sink)
+    {
+        // The first write will acquire memory from the sink.
+        assert_precondition(sink);
+        _chunks.emplace_back(nullslice);
+    }
+
+
+    Writer::Writer(slice buffer)
+    :_chunkSize(std::max(buffer.size, size_t(kDefaultInitialCapacity)))
+    ,_externalBuf(buffer.buf)
+    {
+        assert_precondition(buffer.buf && buffer.size > 0);
+        _available = _chunks.emplace_back(buffer);
+        _length = _available.size;
     }
 
 
@@ -48,19 +115,23 @@ namespace fleece {
     ,_chunks(std::move(w._chunks))
     ,_chunkSize(w._chunkSize)
     ,_length(w._length)
-    ,_outputFile(w._outputFile)
+    ,_sink(w._sink)
+    ,_ownedSink(std::move(w._ownedSink))
+    ,_externalBuf(w._externalBuf)
     {
         migrateInitialBuf(w);
         memcpy(_initialBuf, w._initialBuf, sizeof(_initialBuf));
-        w._outputFile = nullptr;
+        w._sink = nullptr;
     }
 
 
     Writer::~Writer() {
-        if (_outputFile)
-            flush();
-        for (auto &chunk : _chunks)
-            freeChunk(chunk);
+        if (_sink) {
+            flush();                // (the sink owns the chunk)
+        } else {
+            for (auto &chunk : _chunks)
+                freeChunk(chunk);
+        }
     }
 
 
@@ -69,22 +140,36 @@ namespace fleece {
         _length = w._length;
         _chunks = std::move(w._chunks);
         migrateInitialBuf(w);
-        _outputFile = w._outputFile;
+        _sink = w._sink;
+        _ownedSink = std::move(w._ownedSink);
+        _externalBuf = w._externalBuf;
         memcpy(_initialBuf, w._initialBuf, sizeof(_initialBuf));
-        w._outputFile = nullptr;
+        w._sink = nullptr;
         return *this;
     }
 
 
     void Writer::_reset() {
-        if (_outputFile)
+        if (_sink)
             return;
 
         size_t nChunks = _chunks.size();
         if (nChunks > 1) {
-            for (size_t i = 0; i < nChunks-1; i++)
-                freeChunk(_chunks[i]);
-            _chunks.erase(_chunks.begin(), _chunks.end() - 1);
+            if (_retainCapacity) {
+                // Replace all the chunks with one that's big enough to hold all of them:
+                size_t capacity = _length;
+                for (auto &chunk : _chunks)
+                    freeChunk(chunk);
+                _chunks.clear();
+                _available = nullslice;
+                _length = 0;
+                addChunk(capacity);
+                _chunkSize = capacity;
+            } else {
+                for (size_t i = 0; i < nChunks-1; i++)
+                    freeChunk(_chunks[i]);
+                _chunks.erase(_chunks.begin(), _chunks.end() - 1);
+            }
         }
         _available = _chunks[0];
     }
@@ -98,7 +183,7 @@ namespace fleece {
 
 #if DEBUG
     void Writer::assertLengthCorrect() const {
-        if (!_outputFile) {
+        if (!_sink) {
             size_t len = 0;
             forEachChunk([&](slice chunk) {
                 len += chunk.size;
@@ -111,16 +196,12 @@ namespace fleece {
 
     const void* Writer::writeToNewChunk(slice s) {
         // If we got here, a call to write(s) would not fit in the current chunk
-        if (_outputFile) {
+        if (_sink) {
             flush();
-            if (s.size > _chunkSize) {
-                freeChunk(_chunks.back());
-                _chunks.clear();
-                addChunk(s.size);
-            }
             _length -= _available.size;
-            _available = _chunks[0];
+            _available = _chunks[0] = _sink->acquire(s.size);
             _length += _available.size;
+            assert_postcondition(_available.size >= s.size);
         } else {
             if (_usuallyTrue(_chunkSize <= 64*1024))
                 _chunkSize *= 2;
@@ -137,18 +218,14 @@ namespace fleece {
 
 
     void Writer::flush() {
-        if (!_outputFile)
+        if (!_sink)
             return;
-        auto chunk = _chunks.back();
-        size_t writtenLength = chunk.size - _available.size;
+        // Commit what's been written; the rest of the acquired range is still writable:
+        size_t writtenLength = _chunks[0].size - _available.size;
         if (writtenLength > 0) {
-            _length -= _available.size;
-            if (fwrite(chunk.buf, 1, writtenLength, _outputFile) < writtenLength)
-                FleeceException::_throwErrno("Writer can't write to file");
-            _available = chunk;
-            _length += _available.size;
+            _sink->commit(writtenLength);
+            _chunks[0] = _available;
         }
-        assertLengthCorrect();
     }
 
 
@@ -168,7 +245,7 @@ namespace fleece {
 
 
     void Writer::freeChunk(slice chunk) {
-        if (chunk.buf != &_initialBuf)
+        if (chunk.buf != &_initialBuf && chunk.buf != _externalBuf)
             chunk.free();
     }
 
@@ -206,7 +283,7 @@ namespace fleece {
 
     alloc_slice Writer::finish() {
         alloc_slice output;
-        if (_outputFile) {
+        if (_sink) {
             flush();
         } else {
             output = alloc_slice(length());
@@ -223,7 +300,7 @@ namespace fleece {
 
 
     bool Writer::writeOutputToFile(FILE *f) {
-        assert_precondition(!_outputFile);
+        assert_precondition(!_sink);
         bool result = true;
         forEachChunk([&](slice chunk) {
             if (result && fwrite(chunk.buf, chunk.size, 1, f) < chunk.size)
@@ -243,19 +320,11 @@ namespace fleece {
 
     void Writer::writeBase64(slice data) {
         size_t base64size = ((data.size + 2) / 3) * 4;
-        char *dst;
-        if (_outputFile)
-            dst = (char*)slice::newBytes(base64size);
-        else
-            dst = (char*)reserveSpace(base64size);
+        char *dst = (char*)reserveSpace(base64size);
         base64::encoder enc;
         enc.set_chars_per_line(0);
         size_t written = enc.encode(data.buf, data.size, dst);
         written += enc.encode_end(dst + written);
-        if (_outputFile) {
-            write(dst, written);
-            free(dst);
-        }
         assert_postcondition((size_t)written == base64size);
         (void)written;      // suppresses 'unused value' warning in release builds
     }
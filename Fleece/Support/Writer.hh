@@ -21,11 +21,52 @@
 #include "fleece/slice.hh"
 #include "SmallVector.hh"
 #include <stdio.h>
+#include <memory>
 #include <vector>
 #include "betterassert.hh"
 
 namespace fleece {
 
+    /** A destination that a Writer writes its output into directly, such as an mmap'd file
+        region, a ring buffer or a shared-memory segment. The sink hands out memory with
+        `acquire()`; the Writer writes into it in place, then calls `commit()` once the bytes
+        are final. Until they're committed, bytes may still be modified, which lets an Encoder
+        fill in data after reserving space for it.
+
+        The output is a sequence of committed ranges. Each `commit()` covers the bytes right
+        after the previously committed ones in the most recently acquired range. */
+    class WriterSink {
+    public:
+        virtual ~WriterSink() =default;
+
+        /** Returns writable memory for at least `minSize` bytes of output, which will follow
+            the bytes committed so far. Any uncommitted part of the previous range is abandoned.
+            Should throw if the space isn't available. */
+        virtual slice acquire(size_t minSize) =0;
+
+        /** Marks the next `size` bytes of the acquired range as final output. */
+        virtual void commit(size_t size) =0;
+    };
+
+
+    /** A WriterSink that writes into a fixed memory region, such as a mapped file. Writing more
+        than the region holds throws a MemoryError. */
+    class RegionSink : public WriterSink {
+    public:
+        explicit RegionSink(slice region)       :_region(region) { }
+
+        /** The output committed so far, at the start of the region. */
+        slice output() const                    {return _region.upTo(_committed);}
+
+        slice acquire(size_t minSize) override;
+        void commit(size_t size) override;
+
+    private:
+        slice _region;
+        size_t _committed {0};
+    };
+
+
     /** A simple write-only stream that buffers its output into a slice.
         (Used instead of C++ ostreams because those have too much overhead.) */
     class Writer {
@@ -34,6 +75,16 @@ namespace fleece {
 
         Writer(size_t initialCapacity =kDefaultInitialCapacity);
         Writer(FILE * NONNULL outputFile);
+
+        /** Constructs a Writer that writes directly into memory provided by `sink`, which must
+            remain valid as long as the Writer exists. `flush()` commits the output written so
+            far; the destructor and `finish()` flush too. */
+        explicit Writer(WriterSink * NONNULL sink);
+
+        /** Constructs a Writer that writes into a caller-provided buffer, which must remain
+            valid as long as the Writer exists. If the output outgrows the buffer, more space is
+            allocated from the heap. */
+        explicit Writer(slice buffer);
         ~Writer();
 
         Writer(Writer&&) noexcept;
@@ -41,16 +92,29 @@ namespace fleece {
 
         void reset();
 
+        /** If true, `reset()` and `finish()` keep enough memory to hold everything that was
+            written, so that writing the same amount again won't allocate. (By default they only
+            keep the most recent chunk.) */
+        void setRetainsCapacity(bool retain)    {_retainCapacity = retain;}
+
         size_t length() const                   {return _length - _available.size;}
+
+        /** The total size of the memory the Writer has for its output, written or not. */
+        size_t capacity() const {
+            size_t cap = 0;
+            for (auto &chunk : _chunks)
+                cap += chunk.size;
+            return cap;
+        }
         const void* curPos() const              {return _available.buf;}
-        FILE* outputFile() const                {return _outputFile;}
+        WriterSink* sink() const                {return _sink;}
 
         void flush();
 
         /** Invokes the callback for each range of bytes in the output. */
         template <class T>
         void forEachChunk(T callback) const {
-            assert_precondition(!_outputFile);
+            assert_precondition(!_sink);
             auto n = _chunks.size();
             for (auto chunk : _chunks) {
                 if (_usuallyFalse(--n == 0)) {
@@ -138,7 +202,10 @@ namespace fleece {
         smallVector<slice, 4> _chunks;  // Chunks in consecutive order. Last is written to.
         size_t _chunkSize;              // Size of next chunk to allocate
         size_t _length {0};             // Output length, offset by _available.size
-        FILE* _outputFile;              // File writing to, or NULL
+        WriterSink* _sink {nullptr};    // Sink writing to, or NULL
+        std::unique_ptr<WriterSink> _ownedSink; // Sink I created (when writing to a FILE)
+        const void* _externalBuf {nullptr};     // Caller-provided buffer, if any
+        bool _retainCapacity {false};   // Coalesce chunks on reset instead of freeing them
         uint8_t _initialBuf[kDefaultInitialCapacity];   // Inline buffer to avoid a malloc
     };
 
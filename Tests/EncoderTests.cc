@@ -19,13 +19,18 @@
 #include "FleeceTests.hh"
 #include "Pointer.hh"
 #include "JSONConverter.hh"
+#include "JSONEncoder.hh"
+#include "SharedKeys.hh"
 #include "KeyTree.hh"
+#include "MutableArray.hh"
+#include "MutableDict.hh"
 #include "Path.hh"
 #include "Internal.hh"
 #include "jsonsl.h"
 #include "mn_wordlist.h"
 #include "NumConversion.hh"
 #include <iostream>
+#include <set>
 #include <float.h>
 
 #ifndef _MSC_VER
@@ -47,6 +52,7 @@ public:
 
     Encoder enc;
     alloc_slice result;
+    JSONConverter::Parser parser {JSONConverter::kJsonslParser};
 
     void endEncoding() {
         enc.end();
@@ -54,6 +60,17 @@ public:
         enc.reset();
     }
 
+    // The sizes of the buffers an Encoder keeps between documents, to check that they don't grow.
+    static std::vector<size_t> encoderCapacities(const Encoder &e) {
+        std::vector<size_t> caps {e._out.capacity(), e._stringStorage.capacity(),
+                                  e._strings.tableSize(), e._stack.capacity()};
+        for (auto &items : e._stack) {
+            caps.push_back(items.capacity());
+            caps.push_back(items.keys.capacity());
+        }
+        return caps;
+    }
+
     template <bool WIDE>
     uint32_t pointerOffset(const Value *v) const noexcept {
         return v->_asPointer()->offset<WIDE>();
@@ -175,7 +192,7 @@ public:
                       int expectedErr = JSONSL_ERROR_SUCCESS)
     {
         json = std::string("[\"") + json + std::string("\"]");
-        JSONConverter j(enc);
+        JSONConverter j(enc, parser);
         j.encodeJSON(slice(json));
         REQUIRE(j.jsonError() == expectedErr);
         if (j.jsonError()) {
@@ -487,6 +504,88 @@ public:
     }
 #endif
 
+    TEST_CASE("Dictionary key sorting", "[Encoder]") {
+        // Mix of keys that become shared (integer) keys, keys sharing long prefixes, keys
+        // containing zero bytes, and keys that are prefixes of others:
+        static constexpr int kNumKeys = 300;
+        std::vector<std::string> keys;
+        for (int i = 0; i < kNumKeys; ++i) {
+            switch (i % 4) {
+                case 0:  keys.push_back("k" + std::to_string(i)); break;
+                case 1:  keys.push_back("not a shared key " + std::to_string(i)); break;
+                case 2:  keys.push_back(std::string("ab\0", 3) + std::to_string(i)); break;
+                default: keys.push_back(std::string(size_t(i % 11 + 1), 'z')); break;
+            }
+        }
+        auto sk = retained(new SharedKeys);
+        for (int i = kNumKeys - 4; i >= 0; i -= 4) {
+            int key;
+            REQUIRE(sk->encodeAndAdd(slice(keys[i]), key));    // Assign keys in reverse order
+        }
+
+        std::vector<int> order(kNumKeys);
+        for (int i = 0; i < kNumKeys; ++i)
+            order[i] = i;
+        srandom(42);
+        for (int i = kNumKeys - 1; i > 0; --i)
+            std::swap(order[i], order[random() % (i + 1)]);
+
+        Encoder enc;
+        enc.setSharedKeys(sk);
+        enc.beginDictionary();
+        std::set<std::string> written;
+        for (int i : order) {
+            if (written.insert(keys[i]).second) {
+                enc.writeKey(keys[i]);
+                enc.writeInt(i);
+            }
+        }
+        enc.endDictionary();
+        Retained<Doc> doc = new Doc(enc.finish(), Doc::kUntrusted, sk);
+        auto dict = doc->asDict();
+        REQUIRE(dict);
+        CHECK(dict->count() == written.size());
+
+        auto checkDict = [&](const Dict *d) {
+            // Integer keys come first, in order, then string keys in order:
+            const Value *prevKey = nullptr;
+            for (Dict::iterator i(d); i; ++i) {
+                const Value *key = i.key();
+                if (prevKey) {
+                    if (key->isInteger()) {
+                        REQUIRE(prevKey->isInteger());
+                        CHECK(prevKey->asInt() < key->asInt());
+                    } else if (!prevKey->isInteger()) {
+                        CHECK(prevKey->asString() < key->asString());
+                    }
+                }
+                prevKey = key;
+            }
+            for (int i = 0; i < kNumKeys; ++i) {
+                auto value = d->get(slice(keys[i]));
+                REQUIRE(value);
+                CHECK(keys[value->asInt()] == keys[i]);
+            }
+        };
+        checkDict(dict);
+
+        // Copying the Dict, with the same, different or no SharedKeys:
+        auto sk2 = retained(new SharedKeys);
+        for (int i = 0; i < kNumKeys; i += 4) {
+            int key;
+            REQUIRE(sk2->encodeAndAdd(slice(keys[i]), key));
+        }
+        for (SharedKeys *copySK : {sk.get(), sk2.get(), (SharedKeys*)nullptr}) {
+            Encoder enc2;
+            enc2.setSharedKeys(copySK);
+            enc2.writeValue(dict);
+            Retained<Doc> doc2 = new Doc(enc2.finish(), Doc::kUntrusted, copySK);
+            REQUIRE(doc2->asDict());
+            CHECK(doc2->asDict()->count() == written.size());
+            checkDict(doc2->asDict());
+        }
+    }
+
     TEST_CASE_METHOD(EncoderTests, "Deep Nesting", "[Encoder]") {
         for (int depth = 0; depth < 100; ++depth) {
             enc.beginArray();
@@ -513,6 +612,81 @@ public:
         REQUIRE(a->toJSON() == alloc_slice("[\"a\",\"hello\",\"a\",\"hello\"]"));
     }
 
+    TEST_CASE("Precomputed string hashes", "[Encoder]") {
+        auto sk = retained(new SharedKeys);
+        auto encode = [&](bool withHashes) {
+            Encoder enc;
+            enc.setSharedKeys(sk);
+            enc.beginDictionary();
+            for (slice key : {"name"_sl, "not a shared key"_sl, "id"_sl}) {
+                if (withHashes)
+                    enc.writeKey(key, StringTable::hashCode(key));
+                else
+                    enc.writeKey(key);
+                slice value = "a value";
+                if (withHashes)
+                    enc.writeString(value, StringTable::hashCode(value));
+                else
+                    enc.writeString(value);
+            }
+            enc.endDictionary();
+            return enc.finish();
+        };
+        alloc_slice expected = encode(false);
+        CHECK(encode(true) == expected);
+        CHECK(sk->count() == 2);
+    }
+
+    TEST_CASE("Unique string limits", "[Encoder]") {
+        Encoder enc;
+        std::string longStr(20, 'x');
+        SECTION("Size limit") {
+            enc.beginArray();
+            enc.writeString(longStr);
+            enc.writeString(longStr);
+            enc.endArray();
+            enc.finish();
+            CHECK(enc.stringStats().skipped == 2);
+            CHECK(enc.stringStats().hits == 0);
+
+            enc.resetStringStats();
+            enc.setUniqueStringLimits(32, Encoder::kDefaultMaxUniqueStrings);
+            enc.beginArray();
+            enc.writeString(longStr);
+            enc.writeString(longStr);
+            enc.endArray();
+            enc.finish();
+            CHECK(enc.stringStats().skipped == 0);
+            CHECK(enc.stringStats().misses == 1);
+            CHECK(enc.stringStats().hits == 1);
+        }
+        SECTION("Count limit") {
+            // Lots of unique strings, with a frequently repeated one among them:
+            static constexpr size_t kLimit = 100;
+            enc.setUniqueStringLimits(Encoder::kDefaultMaxUniqueStringSize, kLimit);
+            enc.beginArray();
+            for (int i = 0; i < 1000; ++i) {
+                enc.writeString(std::to_string(i) + "unique");
+                CHECK(enc.strings().count() <= kLimit);
+                if (i % 10 == 0)
+                    enc.writeString("popular"_sl);
+            }
+            enc.endArray();
+            alloc_slice data = enc.finish();
+            auto &stats = enc.stringStats();
+            CHECK(stats.evicted >= 1000 - kLimit);
+            CHECK(stats.hits == 99);        // "popular" is never evicted
+            CHECK(stats.misses == 1001);
+
+            auto array = Value::fromData(data)->asArray();
+            REQUIRE(array);
+            CHECK(array->count() == 1100);
+            CHECK(array->get(0)->asString() == "0unique"_sl);
+            CHECK(array->get(1)->asString() == "popular"_sl);
+            CHECK(array->get(1099)->asString() == "999unique"_sl);
+        }
+    }
+
 #if !FL_EMBEDDED
     TEST_CASE("Widening Edge Case", "[Encoder]") {
         // Tests an edge case in the Encoder's logic for widening an array/dict when a pointer
@@ -536,6 +710,8 @@ public:
 #pragma mark - JSON:
 
     TEST_CASE_METHOD(EncoderTests, "JSONStrings", "[Encoder]") {
+        SECTION("jsonsl") { }
+        SECTION("Structural") {parser = JSONConverter::kStructuralParser;}
         checkJSONStr("", "");
         checkJSONStr("x", "x");
         checkJSONStr("\\\"", "\"");
@@ -568,6 +744,125 @@ public:
         checkJSONStr("lmao\\uDE1C\\uD83D!", nullptr, JSONSL_ERROR_INVALID_CODEPOINT);
     }
 
+    TEST_CASE("JSON string escaping", "[Encoder]") {
+        auto toJSON = [](slice str) {
+            JSONEncoder enc;
+            enc.writeString(str);
+            return std::string(enc.finish());
+        };
+        CHECK(toJSON("") == "\"\"");
+        CHECK(toJSON("plain") == "\"plain\"");
+        CHECK(toJSON("\"quoted\" \\back\\") == "\"\\\"quoted\\\" \\\\back\\\\\"");
+        CHECK(toJSON("tab\tCR\rLF\n") == "\"tab\\tCR\\rLF\\n\"");
+        CHECK(toJSON("\x01\x1f\x7f\x80 \xe2\x82\xac"_sl) == "\"\\u0001\\u001f\\u007f\x80 \xe2\x82\xac\"");
+        CHECK(toJSON("!\0!"_sl) == "\"!\\u0000!\"");
+
+        // Put each special character at every offset of a string longer than a vector block:
+        const char* const kSpecials[][2] = {
+            {"\"", "\\\""}, {"\\", "\\\\"}, {"\n", "\\n"}, {"\x1b", "\\u001b"}, {"\x7f", "\\u007f"},
+            {"\x20", " "}, {"\xff", "\xff"}};
+        for (auto &special : kSpecials) {
+            for (size_t i = 0; i < 40; ++i) {
+                std::string str(40, 'x'), expected(40, 'x');
+                str.replace(i, 1, special[0]);
+                expected.replace(i, 1, special[1]);
+                CHECK(toJSON(slice(str)) == "\"" + expected + "\"");
+            }
+        }
+    }
+
+    TEST_CASE("JSON from immutable data", "[Encoder]") {
+        // Immutable Values are written by walking the encoded data; mutable copies go through
+        // the Array and Dict iterators. Both should produce the same JSON:
+        auto sk = retained(new SharedKeys);
+        Retained<Doc> doc = Doc::fromJSON(readTestFile(kBigJSONTestFileName), sk);
+        auto root = doc->root()->asArray();
+        REQUIRE(root);
+        auto copy = MutableArray::newArray(root, kDeepCopy);
+        CHECK(root->toJSON() == copy->toJSON());
+        alloc_slice json5 = root->toJSON<5>(), copyJSON5 = copy->toJSON<5>();
+        CHECK(json5 == copyJSON5);
+
+        // A Dict that inherits from a parent in the base data:
+        alloc_slice data;
+        {
+            Encoder enc;
+            enc.beginDictionary();
+            enc.writeKey("a");
+            enc.writeInt(1);
+            enc.writeKey("c");
+            enc.writeInt(2);
+            enc.endDictionary();
+            data = enc.finish();
+        }
+        Encoder enc2;
+        enc2.setBase(data);
+        enc2.beginDictionary(Value::fromData(data)->asDict());
+        enc2.writeKey("b");
+        enc2.writeString("\t\"");
+        enc2.writeKey("c");
+        enc2.writeInt(3);
+        enc2.endDictionary();
+        data.append(enc2.finish());
+        CHECK(Value::fromData(data)->toJSON() == "{\"a\":1,\"b\":\"\\t\\\"\",\"c\":3}"_sl);
+    }
+
+
+    TEST_CASE("JSON into caller buffer", "[Encoder]") {
+        Retained<Doc> doc = Doc::fromJSON(readTestFile(kBigJSONTestFileName));
+        auto people = doc->root()->asArray();
+        alloc_slice expected = people->get(0)->toJSON();
+        size_t estimate = JSONEncoder::estimateOutputSize(people->get(0));
+        CHECK(estimate >= expected.size);
+        // The estimate doesn't depend on where the value is in the document:
+        auto last = people->get(people->count() - 1);
+        CHECK(JSONEncoder::estimateOutputSize(last) < 4 * last->toJSON().size);
+
+        // Output that fits in the buffer is written directly into it:
+        std::vector<char> buffer(estimate);
+        {
+            JSONEncoder enc(slice(buffer.data(), buffer.size()));
+            enc.writeValue(people->get(0));
+            auto ranges = enc.output();
+            REQUIRE(ranges.size() == 1);
+            CHECK(ranges[0].buf == buffer.data());
+            CHECK(ranges[0] == expected);
+        }
+
+        // Output that doesn't fit spills into more ranges:
+        JSONEncoder enc(slice(buffer.data(), 100));
+        enc.writeValue(people);
+        auto ranges = enc.output();
+        CHECK(ranges.size() > 1);
+        CHECK(ranges[0].buf == buffer.data());
+        std::string joined;
+        for (slice range : ranges)
+            joined += std::string(range);
+        CHECK(slice(joined) == people->toJSON());
+
+        std::vector<char> copy(joined.size());
+        CHECK(enc.copyOutput(copy.data(), copy.size() - 1) == 0);
+        CHECK(enc.copyOutput(copy.data(), copy.size()) == joined.size());
+        CHECK(slice(copy.data(), copy.size()) == slice(joined));
+        CHECK(enc.finish() == slice(joined));
+    }
+
+
+    TEST_CASE("JSON after reverting SharedKeys", "[Encoder]") {
+        // A JSONEncoder's cached key strings must be dropped when the SharedKeys reverts:
+        auto sk = retained(new SharedKeys);
+        Retained<Doc> doc1 = Doc::fromJSON("{\"a\":1}"_sl, sk);
+        JSONEncoder enc;
+        enc.beginArray();
+        enc.writeValue(doc1->root());
+        sk->revertToCount(0);
+        Retained<Doc> doc2 = Doc::fromJSON("{\"z\":2}"_sl, sk);
+        enc.writeValue(doc2->root());
+        enc.endArray();
+        CHECK(enc.finish() == "[{\"a\":1},{\"z\":2}]"_sl);
+    }
+
+
     TEST_CASE_METHOD(EncoderTests, "JSON", "[Encoder]") {
         slice json("{\"\":\"hello\\nt\\\\here\","
                             "\"\\\"ironic\\\"\":[null,false,true,-100,0,100,123.456,6.02e+23,5e-06],"
@@ -602,6 +897,281 @@ public:
         CHECK(root->get(5)->asDouble() == -9999999999999999999.0);
     }
 
+    TEST_CASE_METHOD(EncoderTests, "JSON structural parser", "[Encoder]") {
+        // The structural parser must produce exactly the same Fleece as jsonsl:
+        static const char* const kValid[] = {
+            "[]", "{}", "  [ ] ", "0", "-1", "12345", "\"hi\"", "true", "false", "null",
+            "[1,2.5,-3e4,0.125e-2,4E+2,-0,\"\",\"x\"]",
+            "{\"a\":{\"b\":[[{}],[],{\"c\":null}]},\"d\":\"\\u00e9\\\"\\\\\"}",
+            "[\"a string that is long enough to cross a sixty-four-byte block boundary, \\\\\"]",
+            "[\"\\\\\\\\\",\"\\\"\\\"\"]",
+            "[9223372036854775807, -9223372036854775808, 18446744073709551615, "
+             "18446744073709551616, -9999999999999999999, 602214076000000000000000]",
+            "{\"foo\" : 1 ,\n\t\"bar\"\r\n: [ true , false ] }",
+        };
+        for (auto json : kValid) {
+            INFO("JSON: " << json);
+            Encoder enc1, enc2;
+            JSONConverter jsonsl(enc1), structural(enc2, JSONConverter::kStructuralParser);
+            std::string input = json;
+            if (input[input.size()-1] != ']' && input[input.size()-1] != '}')
+                input += " ";       // jsonsl needs a delimiter after a top-level scalar
+            REQUIRE(jsonsl.encodeJSON(slice(input)));
+            REQUIRE(structural.encodeJSON(slice(json)));
+            CHECK(enc1.finish() == enc2.finish());
+        }
+
+        // Invalid JSON:
+        static const struct {const char *json; int error;} kInvalid[] = {
+            {"[",                   JSONConverter::kErrTruncatedJSON},
+            {"{\"a\":",             JSONConverter::kErrTruncatedJSON},
+            {"[\"abc",              JSONConverter::kErrTruncatedJSON},
+            {"[1,]",                JSONSL_ERROR_TRAILING_COMMA},
+            {"{\"a\":1,}",          JSONSL_ERROR_TRAILING_COMMA},
+            {"[1 2]",               JSONSL_ERROR_MISSING_TOKEN},
+            {"[1}",                 JSONSL_ERROR_BRACKET_MISMATCH},
+            {"]",                   JSONSL_ERROR_BRACKET_MISMATCH},
+            {"{1:2}",               JSONSL_ERROR_HKEY_EXPECTED},
+            {"{\"a\" 1}",           JSONSL_ERROR_MISSING_TOKEN},
+            {"[1:2]",               JSONSL_ERROR_STRAY_TOKEN},
+            {"[,1]",                JSONSL_ERROR_STRAY_TOKEN},
+            {"[tru]",               JSONSL_ERROR_SPECIAL_EXPECTED},
+            {"[nulll]",             JSONSL_ERROR_SPECIAL_EXPECTED},
+            {"[1.]",                JSONSL_ERROR_INVALID_NUMBER},
+            {"[-]",                 JSONSL_ERROR_INVALID_NUMBER},
+            {"[1e]",                JSONSL_ERROR_INVALID_NUMBER},
+            {"[12a]",               JSONSL_ERROR_INVALID_NUMBER},
+            {"[] []",               JSONSL_ERROR_GARBAGE_TRAILING},
+            {"[\"\\uzoop\"]",       JSONSL_ERROR_PERCENT_BADHEX},
+        };
+        for (auto &t : kInvalid) {
+            INFO("JSON: " << t.json);
+            Encoder e;
+            JSONConverter structural(e, JSONConverter::kStructuralParser);
+            CHECK(!structural.encodeJSON(slice(t.json)));
+            CHECK(structural.jsonError() == t.error);
+        }
+
+        // Both parsers must enforce the same nesting limit:
+        for (int depth = 45; depth <= 52; ++depth) {
+            for (const char *leaf : {"", "1", "\"x\"", "{\"k\":0}"}) {
+                std::string json = std::string(depth, '[') + leaf + std::string(depth, ']');
+                INFO("depth " << depth << ", leaf " << leaf);
+                Encoder enc1, enc2;
+                JSONConverter jsonsl(enc1), structural(enc2, JSONConverter::kStructuralParser);
+                bool ok = jsonsl.encodeJSON(slice(json));
+                CHECK(structural.encodeJSON(slice(json)) == ok);
+                CHECK(structural.jsonError() == jsonsl.jsonError());
+                if (ok)
+                    CHECK(enc1.finish() == enc2.finish());
+                else
+                    CHECK(structural.jsonError() == JSONSL_ERROR_LEVELS_EXCEEDED);
+            }
+        }
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "ConvertPeople structural", "[Encoder]") {
+        auto input = readTestFile(kBigJSONTestFileName);
+        alloc_slice expected = JSONConverter::convertJSON(input);
+        alloc_slice actual = JSONConverter::convertJSON(input, nullptr,
+                                                        JSONConverter::kStructuralParser);
+        CHECK(actual == expected);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSON incremental", "[Encoder]") {
+        auto input = readTestFile(kBigJSONTestFileName);
+        alloc_slice expected = JSONConverter::convertJSON(input);
+        for (size_t chunkSize : {1, 7, 64, 4096, 100000}) {
+            INFO("chunk size " << chunkSize);
+            Encoder e;
+            JSONConverter jr(e);
+            for (size_t pos = 0; pos < input.size; pos += chunkSize) {
+                size_t n = std::min(chunkSize, input.size - pos);
+                REQUIRE(jr.feed(slice(&input[pos], n)));
+            }
+            REQUIRE(jr.finish());
+            CHECK(e.finish() == expected);
+        }
+
+        // Errors, including one inside a string that spans chunks:
+        {
+            Encoder e;
+            JSONConverter jr(e);
+            CHECK(jr.feed("[1, 2, {\"a\": tr"_sl));
+            CHECK(jr.feed("ue, \"b\": \"\\uzo"_sl));
+            CHECK(!jr.feed("op\"}]"_sl));
+            CHECK(jr.jsonError() == JSONSL_ERROR_PERCENT_BADHEX);
+            CHECK(jr.errorPos() >= 25);     // the escape sequence is at 25..29
+            CHECK(jr.errorPos() <= 29);
+            CHECK(!jr.feed("[]"_sl));
+            CHECK(!jr.finish());
+        }
+        {
+            Encoder e;
+            JSONConverter jr(e);
+            CHECK(jr.feed("[1, 2, {\"a\": 3"_sl));
+            CHECK(!jr.finish());
+            CHECK(jr.jsonError() == JSONConverter::kErrTruncatedJSON);
+            CHECK(jr.errorPos() == 14);
+        }
+
+        // Strings and numbers split across chunks:
+        JSONConverter jr(enc);
+        CHECK(jr.feed("[\"hel"_sl));
+        CHECK(jr.feed("lo\", 12"_sl));
+        CHECK(jr.feed("34.5]"_sl));
+        CHECK(jr.finish());
+        endEncoding();
+        auto a = checkArray(2);
+        CHECK(a->get(0)->asString() == "hello"_sl);
+        CHECK(a->get(1)->asDouble() == 1234.5);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSON Lines", "[Encoder]") {
+        // Turn the people array into newline-delimited JSON:
+        auto input = readTestFile(kBigJSONTestFileName);
+        alloc_slice people = JSONConverter::convertJSON(input);
+        auto peopleArray = Value::fromTrustedData(people)->asArray();
+        std::string lines;
+        for (uint32_t i = 0; i < peopleArray->count(); ++i) {
+            lines += std::string(peopleArray->get(i)->toJSON());
+            lines += (i % 10 == 9) ? "\r\n\n" : "\n";   // add some blank lines
+        }
+        lines += "[1, 2]\n\"str\"\n-17";
+
+        Retained<SharedKeys> sk = new SharedKeys;
+        JSONLinesConverter converter(sk);
+        std::vector<alloc_slice> records = converter.convert(slice(lines));
+        REQUIRE(records.size() == kBigJSONTestCount + 3);
+        for (size_t i = 0; i < kBigJSONTestCount; ++i) {
+            const Value *person = Value::fromData(records[i]);
+            REQUIRE(person);
+            Retained<Doc> doc = new Doc(records[i], Doc::kTrusted, sk);
+            CHECK(doc->root()->toJSON(true) == peopleArray->get(uint32_t(i))->toJSON(true));
+        }
+        CHECK(Value::fromData(records[kBigJSONTestCount])->toJSON() == "[1,2]"_sl);
+        CHECK(Value::fromData(records[kBigJSONTestCount+1])->asString() == "str"_sl);
+        CHECK(Value::fromData(records[kBigJSONTestCount+2])->asInt() == -17);
+
+        // Errors stop the conversion, and don't affect the next one:
+        size_t count = 0;
+        CHECK(!converter.convert("{\"a\":1}\n\n{\"b\":[2,3}\n{\"c\":4}\n"_sl,
+                                 [&](alloc_slice) {++count;}));
+        CHECK(count == 1);
+        CHECK(converter.errorLine() == 3);
+        CHECK(converter.converter().errorPos() == 9);
+        records = converter.convert("{\"d\":[5]}"_sl);
+        REQUIRE(records.size() == 1);
+        Retained<Doc> doc = new Doc(records[0], Doc::kTrusted, sk);
+        CHECK(doc->root()->toJSON() == "{\"d\":[5]}"_sl);
+        CHECK_THROWS_AS(converter.convert("[1]\n[2,]"_sl), FleeceException);
+    }
+
+    TEST_CASE_METHOD(EncoderTests, "JSON parallel", "[Encoder]") {
+        auto input = readTestFile(kBigJSONTestFileName);
+        alloc_slice serial = JSONConverter::convertJSON(input);
+        for (unsigned nThreads = 2; nThreads <= 8; nThreads *= 2) {
+            INFO("threads: " << nThreads);
+            alloc_slice parallel = JSONConverter::convertJSONParallel(input, nullptr, nThreads);
+            auto root = Value::fromData(parallel);      // (validates the data)
+            REQUIRE(root);
+            REQUIRE(root->asArray());
+            CHECK(root->asArray()->count() == kBigJSONTestCount);
+            CHECK(root->toJSON(true) == Value::fromTrustedData(serial)->toJSON(true));
+        }
+
+        // SharedKeys get the same keys, in the same order, as with serial conversion:
+        auto serialSK = retained(new SharedKeys);
+        JSONConverter::convertJSON(input, serialSK);
+        for (unsigned nThreads = 2; nThreads <= 8; nThreads *= 2) {
+            INFO("threads: " << nThreads);
+            auto sk = retained(new SharedKeys);
+            alloc_slice parallel = JSONConverter::convertJSONParallel(input, sk, nThreads);
+            CHECK(sk->byKey() == serialSK->byKey());
+            Retained<Doc> doc = new Doc(parallel, Doc::kUntrusted, sk);
+            CHECK(doc->root()->toJSON(true) == Value::fromTrustedData(serial)->toJSON(true));
+        }
+
+        // Errors inside an element, or at the top level:
+        std::string json(input);
+        auto brokenPos = json.find("\"latitude\"", json.size() / 2);
+        json[brokenPos + 11] = ',';
+        CHECK_THROWS_AS(JSONConverter::convertJSONParallel(slice(json), nullptr, 4),
+                        FleeceException);
+        json = std::string(input);
+        json.insert(json.rfind(']'), ",");
+        CHECK_THROWS_AS(JSONConverter::convertJSONParallel(slice(json), nullptr, 4),
+                        FleeceException);
+
+        // Non-array root falls back to serial conversion:
+        json = "{\"people\": " + std::string(input) + "}";
+        alloc_slice wrapped = JSONConverter::convertJSONParallel(slice(json), nullptr, 4);
+        CHECK(Value::fromData(wrapped)->asDict()->get("people"_sl)->asArray()->count()
+              == kBigJSONTestCount);
+    }
+
+    TEST_CASE("Encode array in parallel", "[Encoder]") {
+        auto sk = retained(new SharedKeys);
+        Retained<Doc> doc = Doc::fromJSON(readTestFile(kBigJSONTestFileName), sk);
+        // A mutable copy of the people, with some of them changed:
+        Retained<MutableArray> people = MutableArray::newArray(doc->asArray());
+        for (uint32_t i = 0; i < people->count(); i += 3) {
+            MutableDict *person = people->getMutableDict(i);
+            REQUIRE(person);
+            person->set("index"_sl, (int)i);
+            person->set("note"_sl, "edited"_sl);
+        }
+
+        Encoder serialEnc;
+        serialEnc.setSharedKeys(sk);
+        serialEnc.writeValue(people);
+        Retained<Doc> serial = new Doc(serialEnc.finish(), Doc::kUntrusted, sk);
+        REQUIRE(serial->root());
+
+        for (unsigned nThreads = 2; nThreads <= 8; nThreads *= 2) {
+            INFO("threads: " << nThreads);
+            Encoder enc;
+            enc.setSharedKeys(sk);
+            enc.setMaxThreads(nThreads);
+            enc.beginDictionary();
+            enc.writeKey("people"_sl);
+            enc.writeValue(people);
+            enc.endDictionary();
+            Retained<Doc> parallel = new Doc(enc.finish(), Doc::kUntrusted, sk);   // (validates)
+            REQUIRE(parallel->asDict());
+            const Value *root = parallel->asDict()->get("people"_sl);
+            REQUIRE(root);
+            CHECK(root->asArray()->count() == kBigJSONTestCount);
+            CHECK(root->toJSON(true) == serial->root()->toJSON(true));
+        }
+
+        // New keys are added to the SharedKeys in the same order whatever the number of threads:
+        std::vector<alloc_slice> expectedKeys;
+        for (unsigned nThreads = 1; nThreads <= 8; nThreads *= 2) {
+            INFO("threads: " << nThreads);
+            auto newSK = retained(new SharedKeys);
+            Encoder enc;
+            enc.setSharedKeys(newSK);
+            enc.setMaxThreads(nThreads);
+            enc.writeValue(people);
+            Retained<Doc> encoded = new Doc(enc.finish(), Doc::kUntrusted, newSK);
+            CHECK(encoded->root()->toJSON(true) == serial->root()->toJSON(true));
+            if (nThreads == 1)
+                expectedKeys = newSK->byKey();
+            else
+                CHECK(newSK->byKey() == expectedKeys);
+        }
+
+        // Small arrays are encoded serially, producing identical data:
+        Encoder smallEnc;
+        smallEnc.setSharedKeys(sk);
+        smallEnc.setMaxThreads(4);
+        smallEnc.writeValue(people->getMutableDict(0));
+        serialEnc.setSharedKeys(sk);
+        serialEnc.writeValue(people->getMutableDict(0));
+        CHECK(smallEnc.finish() == serialEnc.finish());
+    }
+
     TEST_CASE_METHOD(EncoderTests, "JSONBinary", "[Encoder]") {
         enc.beginArray();
         enc.writeData(slice("not-really-binary"));
@@ -703,6 +1273,69 @@ public:
     }
 #endif
 
+    // A WriterSink that reuses one small buffer, like a ring buffer, and appends committed
+    // bytes to a string.
+    class SmallBufferSink : public WriterSink {
+    public:
+        slice acquire(size_t minSize) override {
+            _buffer.resize(std::max(minSize, size_t(100)));
+            _pos = 0;
+            ++acquireCount;
+            return slice(_buffer.data(), _buffer.size());
+        }
+        void commit(size_t size) override {
+            output.append(&_buffer[_pos], size);
+            _pos += size;
+        }
+        std::string output;
+        unsigned acquireCount {0};
+    private:
+        std::vector<char> _buffer;
+        size_t _pos {0};
+    };
+
+    TEST_CASE("Encode To Sink", "[Encoder]") {
+        Retained<Doc> doc = Doc::fromJSON(readTestFile(kBigJSONTestFileName));
+        auto people = doc->root()->asArray();
+        auto encode = [&](Encoder &enc) {
+            enc.beginArray();
+            for (unsigned i = 0; i < 50; ++i)
+                enc.writeValue(people->get(i));
+            enc.endArray();
+            enc.end();
+        };
+        Encoder heapEnc;
+        encode(heapEnc);
+        alloc_slice expected = heapEnc.finish();
+
+        SECTION("Region") {
+            alloc_slice region(expected.size + 100);
+            RegionSink sink(region);
+            {
+                Encoder enc(&sink);
+                encode(enc);
+                CHECK(enc.finish() == nullslice);
+            }
+            CHECK(sink.output().buf == region.buf);
+            CHECK(sink.output() == expected);
+        }
+        SECTION("Small buffer") {
+            SmallBufferSink sink;
+            {
+                Encoder enc(&sink);
+                encode(enc);
+            }
+            CHECK(sink.acquireCount > 10);
+            CHECK(slice(sink.output) == expected);
+        }
+        SECTION("Region too small") {
+            alloc_slice region(expected.size / 2);
+            RegionSink sink(region);
+            Encoder enc(&sink);
+            CHECK_THROWS_AS(encode(enc), FleeceException);
+        }
+    }
+
 #if FL_HAVE_TEST_FILES
     TEST_CASE_METHOD(EncoderTests, "FindPersonByIndexSorted", "[Encoder]") {
         auto doc = readTestFile("1000people.fleece");
@@ -790,6 +1423,54 @@ public:
 #endif
     }
 
+    TEST_CASE("PathSet", "[Encoder]") {
+        static const char* const kPaths[] = {
+            "name", "age", "tags[0]", "tags[-1]", "friends[0].name", "friends[0].id",
+            "friends[-1].name", "friends[1].name", "name", "$", "nope", "friends[0].nope",
+            "friends[99].name", "name.first", "tags.foo", "age[0]"};
+        PathSet paths;
+        std::vector<Path> separatePaths;
+        for (size_t i = 0; i < sizeof(kPaths)/sizeof(kPaths[0]); ++i) {
+            CHECK(paths.add(slice(kPaths[i])) == i);
+            separatePaths.emplace_back(slice(kPaths[i]));
+        }
+        REQUIRE(paths.size() == separatePaths.size());
+        CHECK_THROWS_AS(paths.add("foo[x]"_sl), FleeceException);
+        CHECK(paths.size() == separatePaths.size());
+
+#if FL_HAVE_TEST_FILES
+        for (int shared = 0; shared <= 1; ++shared) {
+            auto sk = retained(new SharedKeys);
+            Retained<Doc> doc = Doc::fromJSON(readTestFile(kBigJSONTestFileName),
+                                              (shared ? sk.get() : nullptr));
+            auto people = doc->root()->asArray();
+            std::vector<const Value*> values(paths.size());
+            for (Array::iterator i(people); i; ++i) {
+                size_t found = 0;
+                for (size_t p = 0; p < paths.size(); ++p)
+                    found += (separatePaths[p].eval(i.value()) != nullptr);
+                CHECK(paths.eval(i.value(), values.data()) == found);
+                for (size_t p = 0; p < paths.size(); ++p) {
+                    INFO("path " << kPaths[p]);
+                    CHECK(values[p] == separatePaths[p].eval(i.value()));
+                }
+            }
+            CHECK(values[9] == people->get(people->count() - 1));
+            CHECK(values[0] != nullptr);
+            CHECK(values[10] == nullptr);
+        }
+#endif
+
+        // A PathSet with no Paths, and one evaluated on a non-collection:
+        PathSet empty;
+        CHECK(empty.eval(Value::kNullValue, nullptr) == 0);
+        const Value* value;
+        PathSet rootOnly;
+        rootOnly.add("$"_sl);
+        CHECK(rootOnly.eval(Value::kNullValue, &value) == 1);
+        CHECK(value == Value::kNullValue);
+    }
+
     TEST_CASE_METHOD(EncoderTests, "Resuse Encoder", "[Encoder]") {
         enc.beginDictionary();
         enc.writeKey("foo");
@@ -810,6 +1491,62 @@ public:
         auto data3 = enc.finish();
     }
 
+    TEST_CASE("PooledEncoder", "[Encoder]") {
+        Retained<Doc> doc = Doc::fromJSON(readTestFile(kBigJSONTestFileName));
+        auto people = doc->root()->asArray();
+        auto sk = retained(new SharedKeys);
+        static constexpr unsigned kNumDocs = 50;
+
+        Encoder *encoder;
+        {
+            PooledEncoder enc;
+            encoder = &*enc;
+            alloc_slice output;
+            std::vector<size_t> capacities;
+            auto encodeDocs = [&](bool checkCapacities) {
+                // Encode documents of varying sizes, some much bigger than the others:
+                for (unsigned i = 0; i < kNumDocs; ++i) {
+                    enc->setSharedKeys(sk);
+                    enc->beginArray();
+                    for (unsigned j = 0; j < ((i % 5 == 0) ? 250 : (i * 7) % 20); ++j)
+                        enc->writeValue(people->get(i + j));
+                    enc->endArray();
+                    if (checkCapacities)
+                        CHECK(EncoderTests::encoderCapacities(*enc) == capacities);
+                    output = enc->finish();
+                }
+            };
+            encodeDocs(false);
+            CHECK(Value::fromData(output) != nullptr);
+            // Once the encoder has grown to fit, it keeps all its memory between documents,
+            // so encoding them again doesn't need any more:
+            capacities = EncoderTests::encoderCapacities(*enc);
+            encodeDocs(true);
+            CHECK(enc->stringStats().hits > 0);
+            CHECK(enc->stringStats().misses > 0);
+            enc->uniqueStrings(false);
+            enc->suppressTrailer();
+            // Nested use gets a different encoder:
+            PooledEncoder enc2;
+            CHECK(&*enc2 != encoder);
+        }
+
+        // The encoder is reused, in its default configuration:
+        PooledEncoder enc;
+        CHECK(&*enc == encoder);
+        auto &stats = enc->stringStats();
+        CHECK(stats.hits == 0);
+        CHECK(stats.misses == 0);
+        CHECK(stats.skipped == 0);
+        CHECK(stats.evicted == 0);
+        enc->writeValue(people->get(0));
+        alloc_slice output = enc->finish();
+        auto person = Value::fromData(output);
+        REQUIRE(person);
+        CHECK(person->isEqual(people->get(0)));
+    }
+
+
     TEST_CASE_METHOD(EncoderTests, "Multi-Item", "[Encoder]") {
         enc.suppressTrailer();
         size_t pos[10];
@@ -997,6 +1734,41 @@ public:
     }
 
 
+    TEST_CASE("WriteInteger") {
+        char buf[kMaxFormattedIntegerSize + 1], expected[32];
+        auto checkUnsigned = [&](uint64_t n) {
+            sprintf(expected, "%llu", (unsigned long long)n);
+            INFO("Checking " << expected);
+            CHECK(CountDecimalDigits(n) == strlen(expected));
+            CHECK(std::string(buf, WriteInteger(n, buf)) == expected);
+        };
+        auto checkSigned = [&](int64_t n) {
+            sprintf(expected, "%lld", (long long)n);
+            INFO("Checking " << expected);
+            CHECK(std::string(buf, WriteInteger(n, buf)) == expected);
+        };
+
+        for (uint64_t n = 1; n < UINT64_MAX / 10; n *= 10) {
+            for (uint64_t i : {n - 1, n, n + 1, 2 * n, 5 * n + 3, 9 * n})
+                checkUnsigned(i);
+            for (int64_t i : {int64_t(n) - 1, int64_t(n), -int64_t(n), -int64_t(7 * n) - 1})
+                checkSigned(i);
+        }
+        checkUnsigned(UINT64_MAX);
+        checkSigned(INT64_MAX);
+        checkSigned(INT64_MIN);
+
+        JSONEncoder enc;
+        enc.beginArray();
+        enc.writeInt(INT64_MIN);
+        enc.writeInt(-1);
+        enc.writeInt(0);
+        enc.writeUInt(UINT64_MAX);
+        enc.endArray();
+        CHECK(enc.finish() == "[-9223372036854775808,-1,0,18446744073709551615]"_sl);
+    }
+
+
     TEST_CASE("ParseInteger unsigned") {
         constexpr const char* kTestCases[] = {
             "0", "1", "9", "  99 ", "+12345", "  +12345",
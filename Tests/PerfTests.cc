@@ -19,9 +19,18 @@
 #include "FleeceTests.hh"
 #include "FleeceImpl.hh"
 #include "JSONConverter.hh"
+#include "JSONEncoder.hh"
+#include "NumConversion.hh"
+#include "StringTable.hh"
 #include "Doc.hh"
+#include "DictSearch.hh"
+#include "MutableArray.hh"
+#include "MutableDict.hh"
+#include "Path.hh"
 #include "varint.hh"
+#include "fleece/Fleece.h"
 #include <chrono>
+#include <numeric>
 #include <stdlib.h>
 #include <thread>
 #ifndef _MSC_VER
@@ -75,22 +84,77 @@ TEST_CASE("GetUVarint performance", "[.Perf]") {
     bench.printReport(1.0/kNRounds);
 }
 
+TEST_CASE("Perf WriteInteger", "[.Perf]") {
+    static constexpr int kNRounds = 1000000;
+    // A mix of magnitudes, like the ints in a typical document:
+    std::vector<int64_t> numbers;
+    for (int64_t n = 1; n < INT64_MAX / 10; n *= 10) {
+        numbers.push_back(n + 7);
+        numbers.push_back(-3 * n);
+    }
+    char buf[32];
+    size_t total = 0;
+
+    fprintf(stderr, "sprintf:      ");
+    Benchmark bench;
+    for (int round = 0; round < 10; ++round) {
+        bench.start();
+        for (int i = 0; i < kNRounds; ++i)
+            total += sprintf(buf, "%lld", (long long)numbers[i % numbers.size()]);
+        bench.stop();
+    }
+    bench.printReport(1.0/kNRounds, "int");
+
+    fprintf(stderr, "WriteInteger: ");
+    Benchmark bench2;
+    for (int round = 0; round < 10; ++round) {
+        bench2.start();
+        for (int i = 0; i < kNRounds; ++i)
+            total += WriteInteger(numbers[i % numbers.size()], buf);
+        bench2.stop();
+    }
+    bench2.printReport(1.0/kNRounds, "int");
+
+    fprintf(stderr, "JSONEncoder:  ");
+    Benchmark bench3;
+    for (int round = 0; round < 10; ++round) {
+        JSONEncoder enc(kNRounds * 12);
+        enc.beginArray();
+        bench3.start();
+        for (int i = 0; i < kNRounds; ++i)
+            enc.writeInt(numbers[i % numbers.size()]);
+        bench3.stop();
+        enc.endArray();
+        total += enc.finish().size;
+    }
+    bench3.printReport(1.0/kNRounds, "int");
+    CHECK(total > 0);
+}
+
 TEST_CASE("Perf Convert1000People", "[.Perf]") {
     static const int kSamples = 500;
 
     std::vector<double> elapsedTimes;
     auto input = readTestFile(kBigJSONTestFileName);
 
+    JSONConverter::Parser parser = JSONConverter::kJsonslParser;
+    const char *parserName = "jsonsl";
+    SECTION("jsonsl") { }
+    SECTION("Structural") {
+        parser = JSONConverter::kStructuralParser;
+        parserName = "structural";
+    }
+
     Benchmark bench;
 
     alloc_slice lastResult;
-    fprintf(stderr, "Converting JSON to Fleece...\n");
+    fprintf(stderr, "Converting JSON to Fleece with %s parser...\n", parserName);
     for (int i = 0; i < kSamples; i++) {
         bench.start();
         {
             Encoder e(input.size);
             e.uniqueStrings(true);
-            JSONConverter jr(e);
+            JSONConverter jr(e, parser);
 
             jr.encodeJSON(input);
             e.end();
@@ -109,6 +173,233 @@ TEST_CASE("Perf Convert1000People", "[.Perf]") {
     writeToFile(lastResult, kTestFilesDir "1000people.fleece");
 }
 
+TEST_CASE("Perf ConvertParallel", "[.Perf]") {
+    static const int kSamples = 20, kCopies = 50;
+
+    // Make a big array by repeating the people array's contents:
+    auto people = readTestFile(kBigJSONTestFileName);
+    slice items(people);
+    items.setStart(items.findByte('[') + 1);
+    while (items[items.size - 1] != ']')
+        items.shorten(items.size - 1);
+    items.shorten(items.size - 1);
+    std::string json = "[";
+    for (int i = 0; i < kCopies; ++i) {
+        if (i > 0)
+            json += ",";
+        json += std::string(items);
+    }
+    json += "]";
+    fprintf(stderr, "Converting %zu bytes of JSON...\n", json.size());
+
+    for (unsigned nThreads = 1; nThreads <= std::thread::hardware_concurrency(); nThreads *= 2) {
+        fprintf(stderr, "%2u threads: ", nThreads);
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            alloc_slice result = JSONConverter::convertJSONParallel(slice(json), nullptr, nThreads);
+            bench.stop();
+            CHECK(result);
+        }
+        bench.printReport();
+    }
+}
+
+TEST_CASE("Perf EncodeParallel", "[.Perf]") {
+    static const int kSamples = 20, kCopies = 50;
+
+    // Build a big mutable array of mutable dicts, from copies of the people:
+    auto sk = retained(new SharedKeys);
+    Retained<Doc> doc = Doc::fromJSON(readTestFile(kBigJSONTestFileName), sk);
+    Retained<MutableArray> people = MutableArray::newArray();
+    for (int i = 0; i < kCopies; ++i) {
+        for (Array::iterator iter(doc->asArray()); iter; ++iter)
+            people->append(MutableDict::newDict(iter.value()->asDict(), kDeepCopy));
+    }
+    fprintf(stderr, "Encoding %u mutable dicts...\n", people->count());
+
+    for (unsigned nThreads = 1; nThreads <= std::thread::hardware_concurrency(); nThreads *= 2) {
+        fprintf(stderr, "%2u threads: ", nThreads);
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            Encoder enc;
+            enc.setSharedKeys(sk);
+            enc.setMaxThreads(nThreads);
+            enc.writeValue(people);
+            alloc_slice result = enc.finish();
+            bench.stop();
+            CHECK(result);
+        }
+        bench.printReport();
+    }
+}
+
+TEST_CASE("Perf SharedKeysLookup", "[.Perf]") {
+    static const int kSamples = 10, kIterations = 20000;
+    // Look up the keys of 1000people, as Dict::get(slice) does:
+    auto sk = retained(new SharedKeys);
+    Retained<Doc> doc = Doc::fromJSON(readTestFile(kBigJSONTestFileName), sk);
+    std::vector<std::string> keys;
+    for (Dict::iterator i(doc->asArray()->get(0)->asDict()); i; ++i)
+        keys.push_back(std::string(i.keyString()));
+
+    auto lookup = [&] {
+        for (int i = 0; i < kIterations; ++i) {
+            for (auto &key : keys) {
+                int encoded;
+                CHECK(sk->encode(slice(key), encoded));
+                CHECK(sk->decode(encoded).buf != nullptr);
+            }
+        }
+    };
+
+    unsigned maxThreads = std::max(4u, std::thread::hardware_concurrency());
+    for (unsigned nThreads = 1; nThreads <= maxThreads; nThreads *= 2) {
+        fprintf(stderr, "%2u threads: ", nThreads);
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            std::vector<std::thread> threads;
+            for (unsigned t = 1; t < nThreads; ++t)
+                threads.emplace_back(lookup);
+            lookup();
+            for (auto &t : threads)
+                t.join();
+            bench.stop();
+        }
+        // Report the time per lookup per thread; with perfect scaling this stays constant.
+        bench.printReport(1.0 / (kIterations * keys.size()), "lookup");
+    }
+}
+
+TEST_CASE("Perf SharedKeysExtended", "[.Perf]") {
+    static const int kNumKeys = 12000, kNumDicts = 1000, kKeysPerDict = 20, kSamples = 10;
+    std::vector<std::string> keys;
+    for (int i = 0; i < kNumKeys; ++i)
+        keys.push_back("field" + std::to_string(i));
+    // Sparse records, each with a few keys out of the whole set:
+    srandom(5678);
+    std::vector<std::vector<int>> records(kNumDicts);
+    for (auto &record : records)
+        for (int k = 0; k < kKeysPerDict; ++k)
+            record.push_back(int(random() % kNumKeys));
+
+    for (size_t maxCount : {SharedKeys::kMaxCount, size_t(kNumKeys)}) {
+        auto sk = retained(new SharedKeys);
+        sk->setMaxCount(maxCount);
+        int encoded;
+        for (auto &key : keys)
+            sk->encodeAndAdd(slice(key), encoded);
+        fprintf(stderr, "---- %zu shared keys ----\n", sk->count());
+
+        Benchmark encodeBench, decodeBench;
+        for (int i = 0; i < kSamples; ++i) {
+            encodeBench.start();
+            for (int k = 0; k < kNumKeys; ++k)
+                CHECK(sk->encode(slice(keys[k]), encoded) == (k < int(maxCount)));
+            encodeBench.stop();
+            decodeBench.start();
+            for (int k = 0; k < int(sk->count()); ++k)
+                CHECK(sk->decode(k).buf != nullptr);
+            decodeBench.stop();
+        }
+        fprintf(stderr, "SharedKeys::encode: "); encodeBench.printReport(1.0 / kNumKeys, "key");
+        fprintf(stderr, "SharedKeys::decode: "); decodeBench.printReport(1.0 / sk->count(), "key");
+
+        Benchmark writeBench, getBench;
+        alloc_slice data;
+        for (int i = 0; i < kSamples; ++i) {
+            writeBench.start();
+            Encoder enc;
+            enc.setSharedKeys(sk);
+            enc.beginArray();
+            for (auto &record : records) {
+                enc.beginDictionary();
+                for (int k : record) {
+                    enc.writeKey(slice(keys[k]));
+                    enc.writeInt(k);
+                }
+                enc.endDictionary();
+            }
+            enc.endArray();
+            data = enc.finish();
+            writeBench.stop();
+        }
+        auto doc = retained(new Doc(data, Doc::kTrusted, sk));
+        const Array *root = doc->asArray();
+        for (int i = 0; i < kSamples; ++i) {
+            getBench.start();
+            for (int r = 0; r < kNumDicts; ++r) {
+                const Dict *dict = root->get(r)->asDict();
+                for (int k : records[r])
+                    CHECK(dict->get(slice(keys[k])) != nullptr);
+            }
+            getBench.stop();
+        }
+        fprintf(stderr, "Encoding %d dicts (%zu bytes): ", kNumDicts, data.size);
+        writeBench.printReport(1.0 / kNumDicts, "dict");
+        fprintf(stderr, "Dict::get(slice):   ");
+        getBench.printReport(1.0 / (kNumDicts * kKeysPerDict), "get");
+    }
+}
+
+TEST_CASE("Perf ConvertJSONLines", "[.Perf]") {
+    static const int kSamples = 100;
+
+    // Make newline-delimited JSON with one person per line:
+    alloc_slice people = JSONConverter::convertJSON(readTestFile(kBigJSONTestFileName));
+    auto peopleArray = Value::fromTrustedData(people)->asArray();
+    std::string lines;
+    for (uint32_t i = 0; i < peopleArray->count(); ++i) {
+        lines += std::string(peopleArray->get(i)->toJSON());
+        lines += '\n';
+    }
+    slice input(lines);
+
+    JSONConverter::Parser parser = JSONConverter::kJsonslParser;
+    const char *parserName = "jsonsl";
+    SECTION("jsonsl") { }
+    SECTION("Structural") {
+        parser = JSONConverter::kStructuralParser;
+        parserName = "structural";
+    }
+
+    {
+        fprintf(stderr, "Converting JSON lines with JSONConverter::convertJSON, %s parser...\n",
+                parserName);
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            size_t count = 0;
+            for (slice in = input; in.size > 0; ) {
+                auto eol = in.findByte('\n');
+                alloc_slice fleece = JSONConverter::convertJSON(slice(in.buf, eol + 1),
+                                                                nullptr, parser);
+                in.setStart(eol + 1);
+                ++count;
+            }
+            CHECK(count == peopleArray->count());
+            bench.stop();
+        }
+        bench.printReport(1.0 / peopleArray->count(), "record");
+    }
+    {
+        fprintf(stderr, "Converting JSON lines with JSONLinesConverter, %s parser...\n",
+                parserName);
+        Benchmark bench;
+        JSONLinesConverter converter(nullptr, parser);
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            size_t count = 0;
+            CHECK(converter.convert(input, [&](alloc_slice fleece) {++count;}));
+            CHECK(count == peopleArray->count());
+            bench.stop();
+        }
+        bench.printReport(1.0 / peopleArray->count(), "record");
+    }
+}
+
 TEST_CASE("Perf LoadFleece", "[.Perf]") {
     static const int kIterations = 1000;
     auto doc = readTestFile("1000people.fleece");
@@ -141,6 +432,164 @@ TEST_CASE("Perf LoadFleece", "[.Perf]") {
     }
 }
 
+TEST_CASE("Perf FleeceToJSON", "[.Perf]") {
+    static const int kIterations = 100;
+    auto doc = readTestFile("1000people.fleece");
+    auto root = Value::fromTrustedData(doc);
+    REQUIRE(root != nullptr);
+
+    Benchmark bench;
+    size_t jsonSize = 0;
+    for (int i = 0; i < kIterations; i++) {
+        bench.start();
+        alloc_slice json = root->toJSON();
+        bench.stop();
+        jsonSize = json.size;
+    }
+    fprintf(stderr, "Converting Fleece to %zu bytes of JSON... ", jsonSize);
+    bench.printReport();
+
+    // Now convert typical-size documents, of 10 people each:
+    for (int shareKeys = 0; shareKeys <= 1; ++shareKeys) {
+        auto sk = retained(new SharedKeys);
+        std::vector<Retained<Doc>> docs;
+        for (Array::iterator iter(root->asArray()); iter.count() >= 10; iter += 10) {
+            Encoder enc;
+            if (shareKeys)
+                enc.setSharedKeys(sk);
+            enc.beginArray();
+            for (unsigned i = 0; i < 10; ++i)
+                enc.writeValue(iter[i]);
+            enc.endArray();
+            docs.push_back(new Doc(enc.finish(), Doc::kTrusted, (shareKeys ? sk.get() : nullptr)));
+        }
+
+        Benchmark docBench;
+        jsonSize = 0;
+        for (int i = 0; i < kIterations; i++) {
+            docBench.start();
+            for (auto &d : docs)
+                jsonSize += d->root()->toJSON().size;
+            docBench.stop();
+        }
+        fprintf(stderr, "Converting %zu docs of %zu bytes (with%s shared keys)... ",
+                docs.size(), jsonSize / kIterations / docs.size(), (shareKeys ? "" : "out"));
+        docBench.printReport(1.0 / docs.size(), "doc");
+    }
+}
+
+TEST_CASE("Perf EncodeWideDict", "[.Perf]") {
+    static constexpr int kNumKeys = 500, kIterations = 2000;
+    // Keys like a wide record's column names, written in random order:
+    std::vector<std::string> keys;
+    for (int i = 0; i < kNumKeys; ++i)
+        keys.push_back("column_" + std::to_string((i * 7919) % kNumKeys));
+    srandom(1234);
+    for (int i = kNumKeys - 1; i > 0; --i)
+        std::swap(keys[i], keys[random() % (i + 1)]);
+
+    auto encodeDict = [&](Encoder &enc) {
+        enc.beginDictionary(kNumKeys);
+        for (int i = 0; i < kNumKeys; ++i) {
+            enc.writeKey(slice(keys[i]));
+            enc.writeInt(i);
+        }
+        enc.endDictionary();
+    };
+
+    for (int shareKeys = 0; shareKeys <= 1; ++shareKeys) {
+        auto sk = retained(new SharedKeys);
+        sk->setMaxKeyLength(20);
+        Encoder enc;
+        if (shareKeys)
+            enc.setSharedKeys(sk);
+        Benchmark bench;
+        for (int round = 0; round < 10; ++round) {
+            bench.start();
+            for (int i = 0; i < kIterations; ++i) {
+                encodeDict(enc);
+                enc.finish();
+            }
+            bench.stop();
+        }
+        fprintf(stderr, "Encoding %d-key dict, unsorted, %s keys: ", kNumKeys,
+                (shareKeys ? "shared" : "string"));
+        bench.printReport(1.0 / kIterations, "dict");
+
+        // Copying an existing (sorted) Dict:
+        encodeDict(enc);
+        Retained<Doc> doc = new Doc(enc.finish(), Doc::kTrusted, (shareKeys ? sk.get() : nullptr));
+        const Dict *dict = doc->asDict();
+        Benchmark copyBench;
+        for (int round = 0; round < 10; ++round) {
+            copyBench.start();
+            for (int i = 0; i < kIterations; ++i) {
+                enc.writeValue(dict);
+                enc.finish();
+            }
+            copyBench.stop();
+        }
+        fprintf(stderr, "Copying %d-key Dict, %s keys:           ", kNumKeys,
+                (shareKeys ? "shared" : "string"));
+        copyBench.printReport(1.0 / kIterations, "dict");
+    }
+}
+
+TEST_CASE("Perf StringTable", "[.Perf]") {
+    static constexpr int kIterations = 100;
+    // The keys and string values of 1000people, in document order, as an Encoder sees them:
+    Retained<Doc> doc = Doc::fromJSON(readTestFile("1000people.json"));
+    std::vector<slice> strings;
+    for (Array::iterator person(doc->asArray()); person; ++person) {
+        for (Dict::iterator i(person->asDict()); i; ++i) {
+            strings.push_back(i.keyString());
+            slice str = i.value()->asString();
+            if (str)
+                strings.push_back(str);
+        }
+    }
+    fprintf(stderr, "%zu strings, average length %.1f\n", strings.size(),
+            std::accumulate(strings.begin(), strings.end(), 0.0,
+                            [](double t, slice s) {return t + s.size;}) / strings.size());
+
+    Benchmark fnvBench, hashBench, insertBench, findBench;
+    uint32_t total = 0;
+    for (int round = 0; round < 10; ++round) {
+        fnvBench.start();
+        for (int i = 0; i < kIterations; ++i)
+            for (slice str : strings)
+                total += str.hash();
+        fnvBench.stop();
+
+        hashBench.start();
+        for (int i = 0; i < kIterations; ++i)
+            for (slice str : strings)
+                total += uint32_t(StringTable::hashCode(str));
+        hashBench.stop();
+
+        StringTable table;
+        insertBench.start();
+        for (int i = 0; i < kIterations; ++i) {
+            table.clear();
+            for (slice str : strings)
+                table.insert(str, 0);
+        }
+        insertBench.stop();
+
+        findBench.start();
+        for (int i = 0; i < kIterations; ++i)
+            for (slice str : strings)
+                REQUIRE(table.find(str) != nullptr);
+        findBench.stop();
+    }
+    CHECK(total != 0);
+    double scale = 1.0 / (kIterations * strings.size());
+    fprintf(stderr, "slice::hash():           "); fnvBench.printReport(scale, "string");
+    fprintf(stderr, "StringTable::hashCode(): "); hashBench.printReport(scale, "string");
+    fprintf(stderr, "StringTable::insert():   "); insertBench.printReport(scale, "string");
+    fprintf(stderr, "StringTable::find():     "); findBench.printReport(scale, "string");
+}
+
 static void testFindPersonByIndex(int sort) {
     int kSamples = 500;
     int kIterations = 10000;
@@ -179,6 +628,7 @@ TEST_CASE("Perf FindPersonByIndexKeyed", "[.Perf]")       {testFindPersonByIndex
 
 TEST_CASE("Perf LoadPeople", "[.Perf]") {
     for (int shareKeys = 0; shareKeys <= 1; ++shareKeys) {
+      for (int mode = 0; mode <= 2; ++mode) {      // Dict::key, string, getMany
         int kSamples = 50;
         int kIterations = 1000;
         Benchmark bench;
@@ -207,7 +657,8 @@ TEST_CASE("Perf LoadPeople", "[.Perf]") {
         };
 
 
-        fprintf(stderr, "Looking up 1000 people (with%s shared keys)...\n", (shareKeys ? "" : "out"));
+        fprintf(stderr, "Looking up 1000 people (with%s shared keys, by %s)...\n",
+                (shareKeys ? "" : "out"), (mode == 1 ? "string" : (mode ? "getMany" : "Dict::key")));
         for (int i = 0; i < kSamples; i++) {
             bench.start();
 
@@ -217,9 +668,17 @@ TEST_CASE("Perf LoadPeople", "[.Perf]") {
                 for (Array::iterator iter(root); iter; ++iter) {
                     const Dict *person = iter->asDict();
                     size_t n = 0;
-                    for (int k = 0; k < 10; k++)
-                        if (person->get(keys[k]) != nullptr)
-                            n++;
+                    if (mode == 2) {
+                        const Value* values[10];
+                        n = person->getMany(keys, 10, values);
+                    } else {
+                        for (int k = 0; k < 10; k++) {
+                            auto value = mode ? person->get(keys[k].string())
+                                              : person->get(keys[k]);
+                            if (value != nullptr)
+                                n++;
+                        }
+                    }
                     REQUIRE(n == 10);
                 }
             }
@@ -227,6 +686,244 @@ TEST_CASE("Perf LoadPeople", "[.Perf]") {
             bench.stop();
         }
         bench.printReport(1.0/kIterations, "person");
+      }
+    }
+}
+
+
+TEST_CASE("Perf DictGet", "[.Perf]") {
+    static const int kSamples = 20, kIterations = 100;
+    // Compare looking up keys by string, with FLDict_Get, vs. with a cached FLDictKey:
+    auto sk = retained(new SharedKeys);
+    Encoder enc;
+    enc.setSharedKeys(sk);
+    enc.writeValue(Value::fromTrustedData(readTestFile("1000people.fleece")));
+    auto doc = retained(new Doc(enc.finish(), Doc::kTrusted, sk));
+    auto root = (FLArray)doc->root()->asArray();
+
+    static const char* const kKeys[] = {"about", "age", "balance", "guid", "isActive",
+                                        "latitude", "longitude", "name", "registered", "tags"};
+    FLSlice keyStrings[10];
+    FLDictKey dictKeys[10];
+    for (int k = 0; k < 10; k++) {
+        keyStrings[k] = FLStr(kKeys[k]);
+        dictKeys[k] = FLDictKey_Init(keyStrings[k]);
+    }
+    uint32_t count = FLArray_Count(root);
+
+    Benchmark getBench, keyBench, manyBench;
+    for (int i = 0; i < kSamples; i++) {
+        getBench.start();
+        for (int j = 0; j < kIterations; j++) {
+            for (uint32_t p = 0; p < count; p++) {
+                FLDict person = FLValue_AsDict(FLArray_Get(root, p));
+                for (int k = 0; k < 10; k++)
+                    CHECK(FLDict_Get(person, keyStrings[k]) != nullptr);
+            }
+        }
+        getBench.stop();
+
+        keyBench.start();
+        for (int j = 0; j < kIterations; j++) {
+            for (uint32_t p = 0; p < count; p++) {
+                FLDict person = FLValue_AsDict(FLArray_Get(root, p));
+                for (int k = 0; k < 10; k++)
+                    CHECK(FLDict_GetWithKey(person, &dictKeys[k]) != nullptr);
+            }
+        }
+        keyBench.stop();
+
+        manyBench.start();
+        for (int j = 0; j < kIterations; j++) {
+            for (uint32_t p = 0; p < count; p++) {
+                FLDict person = FLValue_AsDict(FLArray_Get(root, p));
+                FLValue values[10];
+                CHECK(FLDict_GetMany(person, dictKeys, 10, values) == 10);
+            }
+        }
+        manyBench.stop();
+    }
+    double scale = 1.0 / (kIterations * count * 10);
+    fprintf(stderr, "FLDict_Get:        "); getBench.printReport(scale, "get");
+    fprintf(stderr, "FLDict_GetWithKey: "); keyBench.printReport(scale, "get");
+    fprintf(stderr, "FLDict_GetMany:    "); manyBench.printReport(scale, "get");
+}
+
+
+TEST_CASE("Perf PathSet", "[.Perf]") {
+    static const int kSamples = 20, kIterations = 100;
+    // Compare evaluating a projection of a document with a PathSet, vs. with separate Paths:
+    static const char* const kPaths[] = {"name", "age", "guid", "isActive", "tags[0]",
+                                         "tags[-1]", "friends[0].id", "friends[0].name",
+                                         "friends[1].name", "friends[-1].name"};
+    static constexpr size_t kNumPaths = sizeof(kPaths) / sizeof(kPaths[0]);
+    for (int shareKeys = 0; shareKeys <= 1; ++shareKeys) {
+        auto sk = retained(new SharedKeys);
+        Encoder enc;
+        if (shareKeys)
+            enc.setSharedKeys(sk);
+        enc.writeValue(Value::fromTrustedData(readTestFile("1000people.fleece")));
+        auto doc = retained(new Doc(enc.finish(), Doc::kTrusted, sk));
+        auto people = doc->root()->asArray();
+
+        std::vector<Path> paths;
+        PathSet pathSet;
+        for (auto spec : kPaths) {
+            paths.emplace_back(slice(spec));
+            pathSet.add(slice(spec));
+        }
+
+        Benchmark pathBench, setBench;
+        const Value* values[kNumPaths];
+        for (int i = 0; i < kSamples; i++) {
+            pathBench.start();
+            for (int j = 0; j < kIterations; j++) {
+                for (Array::iterator iter(people); iter; ++iter) {
+                    size_t n = 0;
+                    for (size_t p = 0; p < kNumPaths; ++p) {
+                        values[p] = paths[p].eval(iter.value());
+                        n += (values[p] != nullptr);
+                    }
+                    if (_usuallyFalse(n != kNumPaths))
+                        abort();
+                }
+            }
+            pathBench.stop();
+
+            setBench.start();
+            for (int j = 0; j < kIterations; j++) {
+                for (Array::iterator iter(people); iter; ++iter) {
+                    if (_usuallyFalse(pathSet.eval(iter.value(), values) != kNumPaths))
+                        abort();
+                }
+            }
+            setBench.stop();
+        }
+        double scale = 1.0 / (kIterations * people->count());
+        fprintf(stderr, "Evaluating %zu paths on 1000 people (with%s shared keys):\n",
+                kNumPaths, (shareKeys ? "" : "out"));
+        fprintf(stderr, "    Path::eval:    "); pathBench.printReport(scale, "doc");
+        fprintf(stderr, "    PathSet::eval: "); setBench.printReport(scale, "doc");
+    }
+}
+
+
+TEST_CASE("Perf DocChurn", "[.Perf]") {
+    static const int kSamples = 10, kIterations = 20;
+    // Each thread repeatedly opens a small Doc, looks up a few keys, and releases it, while
+    // 1000 other Docs stay open:
+    auto sk = retained(new SharedKeys);
+    std::vector<alloc_slice> people;
+    std::vector<Retained<Doc>> openDocs;
+    alloc_slice input = readTestFile("1000people.fleece");
+    for (Array::iterator i(Value::fromTrustedData(input)->asArray()); i; ++i) {
+        Encoder enc;
+        enc.setSharedKeys(sk);
+        enc.writeValue(i.value());
+        people.push_back(enc.finish());
+        openDocs.push_back(new Doc(people.back(), Doc::kTrusted, sk));
+    }
+    static const slice kKeys[] = {"about"_sl, "age"_sl, "guid"_sl, "name"_sl, "tags"_sl};
+
+    auto churn = [&] {
+        for (int i = 0; i < kIterations; ++i) {
+            for (auto &person : people) {
+                Retained<Doc> doc = new Doc(person, Doc::kTrusted, sk);
+                for (slice key : kKeys)
+                    CHECK(doc->asDict()->get(key) != nullptr);
+            }
+        }
+    };
+
+    unsigned maxThreads = std::max(4u, std::thread::hardware_concurrency());
+    for (unsigned nThreads = 1; nThreads <= maxThreads; nThreads *= 2) {
+        fprintf(stderr, "%2u threads: ", nThreads);
+        Benchmark bench;
+        for (int i = 0; i < kSamples; i++) {
+            bench.start();
+            std::vector<std::thread> threads;
+            for (unsigned t = 1; t < nThreads; ++t)
+                threads.emplace_back(churn);
+            churn();
+            for (auto &t : threads)
+                t.join();
+            bench.stop();
+        }
+        // Report the time per Doc per thread; with perfect scaling this stays constant.
+        bench.printReport(1.0 / (kIterations * people.size()), "doc");
+    }
+}
+
+
+TEST_CASE("Perf DictIntSearch", "[.Perf]") {
+    static const int kSamples = 20, kLookups = 4096;
+    // Times looking up shared keys in Dicts of various sizes, with each search algorithm.
+    // Narrow Dicts have 2-byte keys and values; a value too far away for a 2-byte pointer
+    // makes the Dict wide.
+    auto sk = retained(new SharedKeys);
+    std::vector<std::string> keyStrings;
+    for (int i = 0; i < 2048; ++i) {
+        keyStrings.push_back("k" + std::to_string(i));
+        int key;
+        REQUIRE(sk->encodeAndAdd(slice(keyStrings.back()), key));
+    }
+    srandom(1234);
+
+    for (int wide = 0; wide <= 1; ++wide) {
+        fprintf(stderr, "%s Dicts:     linear     binary  Dict::get (ns/lookup)\n",
+                (wide ? "Wide  " : "Narrow"));
+        for (uint32_t size = 4; size <= 2048; size *= 2) {
+            Encoder enc;
+            enc.setSharedKeys(sk);
+            enc.beginDictionary();
+            for (uint32_t i = 0; i < size; ++i) {
+                enc.writeKey(slice(keyStrings[i]));
+                if (wide && i == 0)
+                    enc.writeString(std::string(100000, '*'));
+                else
+                    enc.writeInt(i);
+            }
+            enc.endDictionary();
+            Retained<Doc> doc = new Doc(enc.finish(), Doc::kTrusted, sk);
+            const Dict *dict = doc->asDict();
+            REQUIRE(dict->count() == size);
+            Dict::iterator iter(dict);
+            auto first = iter.key();                    // the first key/value pair
+            REQUIRE((size_t)((char*)(++iter).key() - (char*)first) == (wide ? 8 : 4));
+            std::vector<int> keys(kLookups);
+            for (auto &key : keys)
+                key = int(random() % size);
+
+            auto time = [&](auto search) {
+                Benchmark bench;
+                for (int i = 0; i < kSamples; ++i) {
+                    bench.start();
+                    for (int key : keys) {
+                        if (_usuallyFalse(!search(key)))
+                            abort();
+                    }
+                    bench.stop();
+                }
+                return bench.median() * 1e9 / kLookups;
+            };
+            using Narrow = internal::ShortKeySearch<false>;
+            using Wide = internal::ShortKeySearch<true>;
+            double linear = 0, binary;
+#if FL_HAVE_SSE2
+            if (size * (wide ? Wide::kPairSize : Narrow::kPairSize) <= Narrow::kMaxLinearSize) {
+                if (wide)
+                    linear = time([&](int key) {return Wide::linear(first, size, key);});
+                else
+                    linear = time([&](int key) {return Narrow::linear(first, size, key);});
+            }
+#endif
+            if (wide)
+                binary = time([&](int key) {return Wide::binary(first, size, key);});
+            else
+                binary = time([&](int key) {return Narrow::binary(first, size, key);});
+            double get = time([&](int key) {return dict->get(key);});
+            fprintf(stderr, "%12u keys: %8.2f   %8.2f   %8.2f\n", size, linear, binary, get);
+        }
     }
 }
 
@@ -20,8 +20,14 @@
 #include "FleeceImpl.hh"
 #include "Path.hh"
 #include "Doc.hh"
+#include "MutableDict.hh"
+#include "DictSearch.hh"
 #include <iostream>
+#include <algorithm>
 #include <limits.h>
+#include <random>
+#include <set>
+#include <thread>
 
 using namespace std;
 using namespace fleece::impl;
@@ -133,6 +139,186 @@ TEST_CASE("revertToCount", "[SharedKeys]") {
 }
 
 
+TEST_CASE("re-adding reverted keys", "[SharedKeys]") {
+    // A reverted key's string is kept for lock-free readers, and reused if its number goes to
+    // the same string again; alternating strings don't pile up either:
+    Retained<SharedKeys> sk = new SharedKeys();
+    int key;
+    REQUIRE(sk->encodeAndAdd("alpha"_sl, key));
+    const void *alpha = sk->decode(0).buf, *alphaJSON = sk->decodeAsJSON(0).buf;
+    sk->revertToCount(0);
+    CHECK(sk->decodeAsJSON(0) == nullslice);
+    REQUIRE(sk->encodeAndAdd("alpha"_sl, key));
+    CHECK(sk->decode(0).buf == alpha);
+    CHECK(sk->decodeAsJSON(0).buf == alphaJSON);
+
+    std::set<const void*> buffers, jsonBuffers;
+    for (int i = 0; i < 100; ++i) {
+        slice str = (i % 2) ? "alpha"_sl : "bravo"_sl;
+        sk->revertToCount(0);
+        REQUIRE(sk->encodeAndAdd(str, key));
+        CHECK(key == 0);
+        CHECK(sk->decode(0) == str);
+        CHECK(sk->decodeAsJSON(0) == alloc_slice("\"" + std::string(str) + "\""));
+        buffers.insert(sk->decode(0).buf);
+        jsonBuffers.insert(sk->decodeAsJSON(0).buf);
+    }
+    CHECK(buffers.size() == 2);
+    CHECK(jsonBuffers.size() == 2);
+}
+
+
+TEST_CASE("encode cache", "[SharedKeys]") {
+    // encode() caches lookups by the string's address; make sure that isn't fooled when the
+    // same buffer is reused for a different string, or when keys are reverted:
+    Retained<SharedKeys> sk = new SharedKeys();
+    int key;
+    REQUIRE(sk->encodeAndAdd("alpha"_sl, key));
+    REQUIRE(sk->encodeAndAdd("bravo"_sl, key));
+    char buf[6];
+    strcpy(buf, "alpha");
+    CHECK(sk->encode(slice(buf), key));
+    CHECK(key == 0);
+    CHECK(sk->encode(slice(buf), key));
+    CHECK(key == 0);
+    strcpy(buf, "bravo");
+    CHECK(sk->encode(slice(buf), key));
+    CHECK(key == 1);
+    strcpy(buf, "delta");
+    CHECK(!sk->encode(slice(buf), key));
+
+    // Another SharedKeys with different mappings, looked up through the same buffer:
+    Retained<SharedKeys> sk2 = new SharedKeys();
+    REQUIRE(sk2->encodeAndAdd("delta"_sl, key));
+    CHECK(sk2->encode(slice(buf), key));
+    CHECK(key == 0);
+
+    strcpy(buf, "bravo");
+    CHECK(sk->encode(slice(buf), key));
+    sk->revertToCount(1);
+    CHECK(!sk->encode(slice(buf), key));
+    REQUIRE(sk->encodeAndAdd("hotel"_sl, key));
+    CHECK(key == 1);
+    CHECK(!sk->encode(slice(buf), key));
+}
+
+
+TEST_CASE("encode cache with a reused address", "[SharedKeys]") {
+    // The cache identifies a SharedKeys by its address, so its entries can outlive it and match
+    // a new SharedKeys allocated at the same address:
+    char buf[5];
+    strcpy(buf, "name");
+    int key;
+    const SharedKeys *oldAddress;
+    {
+        Retained<SharedKeys> sk = new SharedKeys();
+        REQUIRE(sk->encodeAndAdd("name"_sl, key));
+        REQUIRE(sk->encode(slice(buf), key));
+        oldAddress = sk;
+    }
+    std::vector<Retained<SharedKeys>> others;
+    for (int i = 0; i < 100; ++i) {
+        Retained<SharedKeys> sk = new SharedKeys();
+        if (sk.get() != oldAddress) {
+            others.push_back(sk);           // keep it, so the next one gets another address
+            continue;
+        }
+        CHECK(!sk->encode(slice(buf), key));
+        REQUIRE(sk->encodeAndAdd("other"_sl, key));
+        CHECK(!sk->encode(slice(buf), key));
+        REQUIRE(sk->encodeAndAdd("name"_sl, key));
+        CHECK(sk->encode(slice(buf), key));
+        CHECK(key == 1);
+        return;
+    }
+    WARN("Couldn't allocate a SharedKeys at the same address again");
+}
+
+
+TEST_CASE("concurrent lookups", "[SharedKeys]") {
+    // Readers look up keys without locking, while a writer adds more keys (growing the table)
+    // and occasionally reverts some:
+    static constexpr int kInitialKeys = 100, kMaxKeys = 1500;
+    Retained<SharedKeys> sk = new SharedKeys();
+    auto keyName = [](int i) {return "key" + std::to_string(i);};
+    int key;
+    for (int i = 0; i < kInitialKeys; i++)
+        REQUIRE(sk->encodeAndAdd(slice(keyName(i)), key));
+
+    std::atomic<bool> done {false};
+    std::atomic<int> failures {0};
+    auto reader = [&] {
+        while (!done) {
+            for (int i = 0; i < kInitialKeys; i++) {
+                int k;
+                if (!sk->encode(slice(keyName(i)), k) || k != i || sk->decode(i) != slice(keyName(i)))
+                    ++failures;
+            }
+        }
+    };
+    std::thread r1(reader), r2(reader);
+    int lastRevert = 0;
+    for (int i = kInitialKeys; i < kMaxKeys; i++) {
+        REQUIRE(sk->encodeAndAdd(slice(keyName(i)), key));
+        CHECK(key == i);
+        if (i % 200 == 0 && i > lastRevert) {
+            lastRevert = i;
+            sk->revertToCount(i - 50);
+            i -= 51;
+        }
+    }
+    done = true;
+    r1.join();
+    r2.join();
+    CHECK(failures == 0);
+
+    CHECK(sk->count() == kMaxKeys);
+    for (int i = 0; i < kMaxKeys; i++) {
+        REQUIRE(sk->encode(slice(keyName(i)), key));
+        CHECK(key == i);
+    }
+    CHECK(!sk->encode("key1500"_sl, key));
+}
+
+
+TEST_CASE("concurrent lookups of reverted keys", "[SharedKeys]") {
+    // Readers look up and decode keys while a writer keeps adding and reverting them. A key may
+    // or may not be found, but if it is, it must have the right number and string:
+    static constexpr int kKeys = 600, kRounds = 200;
+    Retained<SharedKeys> sk = new SharedKeys();
+    auto keyName = [](int i) {return "key" + std::to_string(i);};
+
+    std::atomic<bool> done {false};
+    std::atomic<int> failures {0};
+    auto reader = [&] {
+        while (!done) {
+            for (int i = 0; i < kKeys; i++) {
+                std::string name = keyName(i);
+                int k;
+                if (sk->encode(slice(name), k) && k != i)
+                    ++failures;
+                slice decoded = sk->decode(i);
+                if (decoded && decoded != slice(name))
+                    ++failures;
+            }
+        }
+    };
+    std::thread r1(reader), r2(reader);
+    for (int round = 0; round < kRounds; round++) {
+        int key;
+        for (int i = int(sk->count()); i < kKeys; i++) {
+            REQUIRE(sk->encodeAndAdd(slice(keyName(i)), key));
+            CHECK(key == i);
+        }
+        sk->revertToCount(round % 100);
+    }
+    done = true;
+    r1.join();
+    r2.join();
+    CHECK(failures == 0);
+}
+
+
 TEST_CASE("many keys", "[SharedKeys]") {
     Retained<SharedKeys> sk = new SharedKeys();
     for (int i = 0; i < SharedKeys::kMaxCount; i++) {
@@ -157,6 +343,295 @@ TEST_CASE("many keys", "[SharedKeys]") {
 }
 
 
+TEST_CASE("extended key count", "[SharedKeys]") {
+    static constexpr int kNumKeys = 12000;
+    Retained<SharedKeys> sk = new SharedKeys();
+    sk->setMaxCount(kNumKeys);
+    CHECK(sk->maxCount() == kNumKeys);
+    auto keyName = [](int i) {return "field" + std::to_string(i);};
+    for (int i = 0; i < kNumKeys; i++) {
+        int key;
+        REQUIRE(sk->encodeAndAdd(slice(keyName(i)), key));
+        REQUIRE(key == i);
+    }
+    int key;
+    CHECK(!sk->encodeAndAdd("onetoomany"_sl, key));
+    for (int i = 0; i < kNumKeys; i++) {
+        REQUIRE(sk->encode(slice(keyName(i)), key));
+        CHECK(key == i);
+        CHECK(sk->decode(i) == slice(keyName(i)));
+    }
+
+    // Persisted state round-trips, even into a SharedKeys with the default max count:
+    Retained<SharedKeys> sk2 = new SharedKeys(sk->stateData());
+    CHECK(sk2->count() == kNumKeys);
+    CHECK(sk2->decode(kNumKeys - 1) == slice(keyName(kNumKeys - 1)));
+
+    // Encode a sparse Dict with keys from both tiers, plus non-shareable string keys:
+    std::vector<int> keys {0, 7, 2047, 2048, 3000, 11999};
+    Encoder enc;
+    enc.setSharedKeys(sk);
+    enc.beginDictionary();
+    for (auto i = keys.rbegin(); i != keys.rend(); ++i) {
+        enc.writeKey(slice(keyName(*i)));
+        enc.writeInt(*i);
+    }
+    enc.writeKey("not a shared key");
+    enc.writeInt(-1);
+    enc.writeKey("");
+    enc.writeInt(-2);
+    enc.endDictionary();
+    Retained<Doc> doc = enc.finishDoc();
+    const Dict *dict = doc->asDict();
+    REQUIRE(dict);
+    CHECK(dict->count() == keys.size() + 2);
+
+    for (int k : keys) {
+        INFO("key " << k);
+        const Value *v = dict->get(slice(keyName(k)));
+        REQUIRE(v);
+        CHECK(v->asInt() == k);
+        CHECK(dict->get(k) == v);
+        Dict::key dictKey(slice(keyName(k)));
+        CHECK(dict->get(dictKey) == v);
+    }
+    CHECK(dict->get("not a shared key"_sl)->asInt() == -1);
+    CHECK(dict->get(""_sl)->asInt() == -2);
+    CHECK(dict->get(slice(keyName(5))) == nullptr);
+    CHECK(dict->get(5000) == nullptr);
+    CHECK(dict->get(12001) == nullptr);
+
+    // Keys are sorted by number, then string:
+    std::vector<std::string> iterKeys;
+    for (Dict::iterator i(dict); i; ++i)
+        iterKeys.push_back(std::string(i.keyString()));
+    CHECK(iterKeys == (std::vector<std::string>{keyName(0), keyName(7), keyName(2047),
+                                                 keyName(2048), keyName(3000), keyName(11999),
+                                                 "", "not a shared key"}));
+    CHECK(dict->toJSONString() == "{\"field0\":0,\"field7\":7,\"field2047\":2047,"
+                                  "\"field2048\":2048,\"field3000\":3000,\"field11999\":11999,"
+                                  "\"\":-2,\"not a shared key\":-1}");
+
+    // A Dict whose keys are all past the short-int range is still known to use shared keys:
+    enc.beginDictionary();
+    enc.writeKey(slice(keyName(5000)));
+    enc.writeBool(true);
+    enc.endDictionary();
+    Retained<Doc> doc2 = enc.finishDoc();
+    CHECK(doc2->asDict()->get(slice(keyName(5000))) != nullptr);
+
+    // Copying the Dict, with and without the same SharedKeys:
+    enc.writeValue(dict);
+    Retained<Doc> copy = enc.finishDoc();
+    CHECK(copy->asDict()->toJSONString() == dict->toJSONString());
+    Encoder plainEnc;
+    plainEnc.writeValue(dict);
+    Retained<Doc> plainCopy = plainEnc.finishDoc();
+    CHECK(plainCopy->asDict()->count() == dict->count());
+    CHECK(plainCopy->asDict()->get(slice(keyName(3000)))->asInt() == 3000);
+
+    // Modifying a mutable copy:
+    Retained<MutableDict> mdict = MutableDict::newDict(dict);
+    CHECK(mdict->get(slice(keyName(2048)))->asInt() == 2048);
+    mdict->set(slice(keyName(4000)), 4000);
+    mdict->remove(slice(keyName(3000)));
+    enc.writeValue(mdict);
+    Retained<Doc> doc3 = enc.finishDoc();
+    const Dict *dict3 = doc3->asDict();
+    CHECK(dict3->get(slice(keyName(4000)))->asInt() == 4000);
+    CHECK(dict3->get(slice(keyName(3000))) == nullptr);
+    CHECK(dict3->get(slice(keyName(11999)))->asInt() == 11999);
+}
+
+
+TEST_CASE("int keys out of range", "[SharedKeys]") {
+    // Integer keys that don't fit the radix sort still get sorted:
+    Retained<SharedKeys> sk = new SharedKeys();
+    std::vector<int> keys;
+    for (int i = 0; i < 20; i++)
+        keys.push_back(i * 100);
+    keys.push_back(-2049);
+    keys.push_back(-100000);
+    keys.push_back(1 << 18);
+    keys.push_back(INT32_MAX);
+    Encoder enc;
+    enc.setSharedKeys(sk);
+    enc.beginDictionary();
+    for (auto i = keys.rbegin(); i != keys.rend(); ++i) {
+        if (*i >= 0) {
+            enc.writeKey(impl::key_t(*i));
+        } else {
+            Encoder intEnc;
+            intEnc.writeInt(*i);
+            alloc_slice intData = intEnc.finish();
+            enc.writeKey(impl::key_t(Value::fromData(intData)));  // (key_t(int) must be >= 0)
+        }
+        enc.writeInt(*i);
+    }
+    enc.endDictionary();
+    alloc_slice data = enc.finish();
+    const Dict *dict = Value::fromData(data)->asDict();
+    REQUIRE(dict);
+
+    std::sort(keys.begin(), keys.end());
+    std::vector<int> iterKeys;
+    for (Dict::iterator i(dict, sk); i; ++i) {
+        iterKeys.push_back(int(i.key()->asInt()));
+        CHECK(i.value()->asInt() == i.key()->asInt());
+    }
+    CHECK(iterKeys == keys);
+}
+
+
+TEST_CASE("int key lookup", "[SharedKeys]") {
+    // Dict::get(int) searches short-int keys specially; test it at every Dict size around the
+    // ones where it switches algorithms, with keys on both sides of each shared key.
+    Retained<SharedKeys> sk = new SharedKeys();
+    sk->setMaxCount(4096);
+    auto keyName = [](int i) {return "k" + std::to_string(i);};
+    for (int i = 0; i < 4096; i++) {
+        int key;
+        REQUIRE(sk->encodeAndAdd(slice(keyName(i)), key));
+    }
+
+    for (int wide = 0; wide <= 1; ++wide) {
+        for (int size = wide; size <= 40; ++size) {      // (an empty Dict isn't wide)
+            INFO((wide ? "wide" : "narrow") << " Dict of " << size << " keys");
+            // Use the odd keys, plus a long-int key and a string key after them:
+            Encoder enc;
+            enc.setSharedKeys(sk);
+            enc.beginDictionary();
+            for (int i = 0; i < size; ++i) {
+                enc.writeKey(slice(keyName(2*i + 1)));
+                if (wide && i == 0)
+                    enc.writeString(std::string(100000, '*'));
+                else
+                    enc.writeInt(2*i + 1);
+            }
+            enc.writeKey(slice(keyName(3000)));
+            enc.writeInt(3000);
+            enc.writeKey("nope");
+            enc.writeInt(-1);
+            enc.endDictionary();
+            Retained<Doc> doc = enc.finishDoc();
+            const Dict *dict = doc->asDict();
+            REQUIRE(dict->count() == uint32_t(size + 2));
+
+            for (int k = 0; k <= 2*size; ++k) {
+                const Value *value = dict->get(k);
+                if (k % 2) {
+                    REQUIRE(value);
+                    if (!(wide && k == 1))
+                        CHECK(value->asInt() == k);
+                } else {
+                    CHECK(value == nullptr);
+                }
+            }
+            CHECK(dict->get(2047) == nullptr);
+            CHECK(dict->get(2048) == nullptr);
+            CHECK(dict->get(3000)->asInt() == 3000);
+
+            // Check the individual algorithms too:
+            Dict::iterator iter(dict);
+            const Value *first = iter.key();
+            if (size >= 2)      // (iterator derefs keys, so compare two short-int keys)
+                REQUIRE((size_t)((char*)(++iter).key() - (char*)first) == (wide ? 8 : 4));
+            for (int k = 0; k <= 2*size; ++k) {
+                const Value *found;
+                if (wide) {
+                    found = internal::ShortKeySearch<true>::binary(first, size, k);
+#if FL_HAVE_SSE2
+                    if (size + 2 <= 8)
+                        CHECK(internal::ShortKeySearch<true>::linear(first, size + 2, k) == found);
+#endif
+                } else {
+                    found = internal::ShortKeySearch<false>::binary(first, size, k);
+#if FL_HAVE_SSE2
+                    if (size + 2 >= 4 && size + 2 <= 16)
+                        CHECK(internal::ShortKeySearch<false>::linear(first, size + 2, k) == found);
+#endif
+                }
+                CHECK((found != nullptr) == (k % 2 == 1));
+                if (found)
+                    CHECK(dict->get(k) == dict->get(slice(keyName(k))));
+            }
+        }
+    }
+}
+
+
+TEST_CASE("getMany", "[SharedKeys]") {
+    // A Dict with short-int, long-int and string keys, looked up with more keys than fit in one
+    // batch, in random order, including missing and duplicate keys:
+    Retained<SharedKeys> sk = new SharedKeys();
+    sk->setMaxCount(4096);
+    auto keyName = [](int i) {return "k" + std::to_string(i);};
+    for (int i = 0; i < 2500; i++) {
+        int key;
+        REQUIRE(sk->encodeAndAdd(slice(keyName(i)), key));
+    }
+    std::vector<std::string> present, lookups;
+    for (int i = 0; i < 2500; i += 50)
+        present.push_back(keyName(i));
+    for (int i = 0; i < 20; i++)
+        present.push_back("not shared " + std::to_string(i));
+    lookups = present;
+    for (int i = 25; i < 2500; i += 100)
+        lookups.push_back(keyName(i));
+    lookups.push_back("not shared");
+    lookups.push_back("zzz");
+    lookups.push_back(present[3]);
+    std::mt19937 rng(1234);
+    std::shuffle(lookups.begin(), lookups.end(), rng);
+
+    auto check = [&](const Dict *dict) {
+        // (Dict::key can't be copied or moved, so it can't be stored in a vector.)
+        std::unique_ptr<uint8_t[]> storage(new uint8_t[lookups.size() * sizeof(Dict::key)]);
+        auto keys = (Dict::key*)storage.get();
+        for (size_t i = 0; i < lookups.size(); ++i)
+            new (&keys[i]) Dict::key(slice(lookups[i]));
+        std::vector<const Value*> values(lookups.size());
+        for (int pass = 0; pass < 2; ++pass) {      // the second pass uses the keys' cached state
+            INFO("pass " << pass);
+            CHECK(dict->getMany(keys, lookups.size(), values.data()) == present.size() + 1);
+            for (size_t i = 0; i < lookups.size(); ++i) {
+                INFO("key " << lookups[i]);
+                CHECK(values[i] == dict->get(slice(lookups[i])));
+            }
+        }
+        CHECK(dict->getMany(keys, 0, values.data()) == 0);
+        for (size_t i = 0; i < lookups.size(); ++i)
+            keys[i].~key();
+    };
+
+    for (int useSharedKeys = 0; useSharedKeys <= 1; ++useSharedKeys) {
+        Encoder enc;
+        if (useSharedKeys)
+            enc.setSharedKeys(sk);
+        enc.beginDictionary();
+        for (size_t i = 0; i < present.size(); ++i) {
+            enc.writeKey(slice(present[i]));
+            enc.writeInt(i);
+        }
+        enc.endDictionary();
+        Retained<Doc> doc = enc.finishDoc();
+        const Dict *dict = doc->asDict();
+        REQUIRE(dict->count() == present.size());
+        {
+            INFO("immutable, sharedKeys=" << useSharedKeys);
+            check(dict);
+        }
+        {
+            INFO("mutable, sharedKeys=" << useSharedKeys);
+            Retained<MutableDict> mdict = MutableDict::newDict(dict);
+            mdict->remove(slice(present[0]));
+            mdict->set(slice(present[0]), 1234);
+            check(mdict);
+        }
+    }
+}
+
+
 #pragma mark - PERSISTENCE:
 
 
@@ -234,6 +709,57 @@ private:
 };
 
 
+TEST_CASE("training", "[SharedKeys]") {
+    // "rare" is seen before "a", but "a" is more common. One of the common keys is too long to
+    // be shared, and "not shared" has an ineligible character:
+    Retained<Doc> doc = Doc::fromJSON(R"([
+        {"rare": 1, "b": 2},
+        {"a": 1, "b": 2, "long key that can't be shared": 0},
+        {"a": 1, "b": {"a": 2, "c": 3}, "long key that can't be shared": 0},
+        {"long key that can't be shared": 0, "not shared": 0}
+    ])"_sl);
+    SharedKeysTrainer trainer;
+    for (Array::iterator i(doc->asArray()); i; ++i)
+        trainer.addSample(i.value());
+    CHECK(trainer.sampleCount() == 4);
+
+    auto freqs = trainer.keysByFrequency();
+    std::vector<std::pair<std::string,size_t>> freqList;
+    for (auto &kf : freqs)
+        freqList.emplace_back(std::string(kf.key), kf.count);
+    CHECK(freqList == (std::vector<std::pair<std::string,size_t>>{
+        {"b", 3}, {"a", 3}, {"long key that can't be shared", 3}, {"rare", 1}, {"c", 1},
+        {"not shared", 1}}));
+
+    Retained<SharedKeys> sk = new SharedKeys();
+    CHECK(trainer.train(sk) == 4);
+    CHECK(sk->count() == 4);
+    CHECK(sk->decode(0) == "b"_sl);
+    CHECK(sk->decode(1) == "a"_sl);
+    CHECK(sk->decode(2) == "rare"_sl);
+    CHECK(sk->decode(3) == "c"_sl);
+
+    // Training again doesn't renumber or duplicate keys:
+    CHECK(trainer.train(sk) == 0);
+    CHECK(sk->count() == 4);
+
+    // Only the most frequent keys are added if there isn't room for all of them:
+    Retained<SharedKeys> small = new SharedKeys();
+    small->setMaxCount(2);
+    CHECK(trainer.train(small) == 2);
+    CHECK(small->decode(0) == "b"_sl);
+    CHECK(small->decode(1) == "a"_sl);
+
+    // Keys already present keep their numbers:
+    Retained<SharedKeys> existing = new SharedKeys();
+    int key;
+    REQUIRE(existing->encodeAndAdd("c"_sl, key));
+    CHECK(trainer.train(existing) == 3);
+    CHECK(existing->decode(0) == "c"_sl);
+    CHECK(existing->decode(1) == "b"_sl);
+}
+
+
 TEST_CASE("basic persistence", "[SharedKeys]") {
     Client::reset();
     Client client1;
@@ -21,7 +21,9 @@
 #include "Bitmap.hh"
 #include "TempArray.hh"
 #include "sliceIO.hh"
+#include "StringTable.hh"
 #include <iostream>
+#include <set>
 
 using namespace std;
 
@@ -110,3 +112,42 @@ TEST_CASE("Bitmap") {
     CHECK(b.bitCount() == 13);
     CHECK(b.indexOfBit(8) == 4);
 }
+
+
+TEST_CASE("StringTable") {
+    // Keys of many lengths, including ones that share long prefixes:
+    std::vector<std::string> keys;
+    for (int i = 0; i < 2000; ++i)
+        keys.push_back(std::string(i % 41, 'x') + std::to_string(i));
+    keys.push_back("");
+
+    StringTable table;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto result = table.insert(slice(keys[i]), uint32_t(i));
+        CHECK(result.second);
+        CHECK(result.first->second == i);
+    }
+    CHECK(table.count() == keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto entry = table.find(slice(keys[i]));
+        REQUIRE(entry);
+        CHECK(entry->second == i);
+        auto result = table.insert(slice(keys[i]), 9999);
+        CHECK(!result.second);
+        CHECK(result.first == entry);
+    }
+    CHECK(table.find("nope"_sl) == nullptr);
+    CHECK(table.find("xxxxxxxxxxxxxxxxxxxxx"_sl) == nullptr);
+
+    // Remove the odd entries:
+    CHECK(table.removeIf([](StringTable::entry_t &e) {return (e.second & 1) != 0;})
+          == keys.size() / 2);
+    for (size_t i = 0; i < keys.size(); ++i)
+        CHECK((table.find(slice(keys[i])) != nullptr) == (i % 2 == 0));
+
+    // The hash shouldn't collide much, even on similar keys:
+    std::set<StringTable::hash_t> hashes;
+    for (auto &key : keys)
+        hashes.insert(StringTable::hashCode(slice(key)));
+    CHECK(hashes.size() >= keys.size() - 1);
+}
@@ -25,9 +25,13 @@
 #include "Pointer.hh"
 #include "varint.hh"
 #include "DeepIterator.hh"
+#include "Encoder.hh"
 #include "SharedKeys.hh"
 #include "Doc.hh"
+#include <algorithm>
+#include <random>
 #include <sstream>
+#include <thread>
 
 #undef NOMINMAX
 
@@ -216,4 +220,181 @@ namespace fleece {
         CHECK(Doc::sharedKeys(root) == nullptr);
     }
 
+
+    static alloc_slice encodeInt(int i) {
+        Encoder enc;
+        enc.beginArray();
+        enc.writeInt(i);
+        enc.endArray();
+        return enc.finish();
+    }
+
+
+    TEST_CASE("Many Docs", "[SharedKeys]") {
+        // Register lots of Docs, then unregister them in random order, checking that the
+        // remaining ones can still be found. (The data is kept alive, so the addresses of
+        // unregistered Docs don't get reused.)
+        static constexpr int kNumDocs = 1000;
+        Retained<SharedKeys> sk = new SharedKeys();
+        vector<alloc_slice> data;
+        vector<Retained<Doc>> docs;
+        for (int i = 0; i < kNumDocs; ++i) {
+            data.push_back(encodeInt(i));
+            docs.push_back(new Doc(data.back(), Doc::kTrusted, (i % 2) ? sk.get() : nullptr));
+        }
+        vector<int> order(kNumDocs);
+        for (int i = 0; i < kNumDocs; ++i)
+            order[i] = i;
+        shuffle(order.begin(), order.end(), std::mt19937(1234));
+
+        for (int n = 0; n < kNumDocs; ++n) {
+            auto root = docs[order[n]]->root();
+            docs[order[n]] = nullptr;
+            CHECK(Scope::containing(root) == nullptr);
+            if (n % 50 == 0) {
+                for (int i = 0; i < kNumDocs; ++i) {
+                    if (docs[i]) {
+                        auto value = docs[i]->asArray()->get(0);
+                        REQUIRE(Scope::containing(value) == docs[i].get());
+                        CHECK(Doc::sharedKeys(value) == ((i % 2) ? sk.get() : nullptr));
+                        CHECK(value->asInt() == i);
+                    }
+                }
+                // Re-registering Docs reuses the space of unregistered ones:
+                Retained<Doc> again = new Doc(data[order[n]], Doc::kTrusted);
+                CHECK(Scope::containing(again->root()) == again.get());
+            }
+        }
+    }
+
+
+    TEST_CASE("Scope lookup hint", "[SharedKeys]") {
+        // Lookups remember the last Scope found, so make sure that doesn't return stale results:
+        alloc_slice data = readTestFile("1person.fleece");
+        Retained<SharedKeys> sk1 = new SharedKeys(), sk2 = new SharedKeys();
+        const Value *root;
+        {
+            Retained<Doc> doc = new Doc(data, Doc::kUntrusted, sk1);
+            root = doc->root();
+            CHECK(Doc::sharedKeys(root) == sk1);
+        }
+        CHECK(Doc::sharedKeys(root) == nullptr);
+        {
+            Retained<Doc> doc = new Doc(data, Doc::kUntrusted, sk2);
+            CHECK(doc->root() == root);
+            CHECK(Doc::sharedKeys(root) == sk2);
+        }
+
+        // A Scope covering the first half of a Doc's data takes precedence over the Doc there:
+        Retained<Doc> doc = new Doc(data, Doc::kUntrusted, sk1);
+        const Value *inFirstHalf = (const Value*)data.buf;
+        const Value *inSecondHalf = (const Value*)offsetby(data.buf, data.size / 2 + 2);
+        CHECK(Scope::containing(inSecondHalf) == doc.get());
+        CHECK(Scope::containing(inFirstHalf) == doc.get());
+        {
+            Scope firstHalf(data.upTo(data.size / 2), sk2);
+            CHECK(Scope::containing(inSecondHalf) == doc.get());
+            CHECK(Scope::containing(inFirstHalf) == &firstHalf);
+            CHECK(Scope::containing(inSecondHalf) == doc.get());
+            CHECK(Scope::sharedKeys(inFirstHalf) == sk2);
+        }
+        CHECK(Scope::containing(inFirstHalf) == doc.get());
+    }
+
+
+    TEST_CASE("Concurrent Docs", "[SharedKeys]") {
+        // Threads create and release Docs while other threads look up the Scopes of Docs that
+        // stay open:
+        static constexpr int kNumDocs = 200, kIterations = 50;
+        Retained<SharedKeys> sk = new SharedKeys();
+        vector<Retained<Doc>> openDocs;
+        for (int i = 0; i < kNumDocs; ++i)
+            openDocs.push_back(new Doc(encodeInt(i), Doc::kTrusted, sk));
+
+        atomic<int> failures {0};
+        auto churn = [&](int thread) {
+            for (int iter = 0; iter < kIterations; ++iter) {
+                vector<Retained<Doc>> docs;
+                for (int i = 0; i < kNumDocs; ++i)
+                    docs.push_back(new Doc(encodeInt(thread * kNumDocs + i), Doc::kTrusted));
+                for (auto &doc : docs) {
+                    if (Scope::containing(doc->root()) != doc.get())
+                        ++failures;
+                }
+            }
+        };
+        auto lookup = [&] {
+            for (int iter = 0; iter < 5 * kIterations; ++iter) {
+                for (int i = 0; i < kNumDocs; ++i) {
+                    auto value = openDocs[i]->asArray()->get(0);
+                    if (Scope::containing(value) != openDocs[i].get()
+                            || Doc::sharedKeys(value) != sk || value->asInt() != i)
+                        ++failures;
+                }
+            }
+        };
+
+        vector<thread> threads;
+        for (int t = 0; t < 2; ++t) {
+            threads.emplace_back(churn, t);
+            threads.emplace_back(lookup);
+        }
+        for (auto &t : threads)
+            t.join();
+        CHECK(failures == 0);
+    }
+
+
+    TEST_CASE("Concurrent short-lived Scopes", "[SharedKeys]") {
+        // Threads keep creating and releasing Scopes, including duplicates of a long-lived Doc,
+        // while other threads look up Values in their data. A lookup mustn't touch a Scope that's
+        // being destructed, and Doc::containing mustn't retain a Doc that's being freed.
+        static constexpr int kIterations = 2000;
+        Retained<SharedKeys> sk = new SharedKeys();
+        alloc_slice shared = encodeInt(1), transient = encodeInt(2), plain = encodeInt(3);
+        Retained<Doc> longLived = new Doc(shared, Doc::kTrusted, sk);
+        const Value *sharedValue = longLived->asArray()->get(0);
+        const Value *transientValue = Value::fromTrustedData(transient)->asArray()->get(0);
+        const Value *plainValue = Value::fromTrustedData(plain)->asArray()->get(0);
+
+        atomic<bool> done {false};
+        atomic<int> failures {0};
+        auto churn = [&] {
+            for (int iter = 0; iter < kIterations; ++iter) {
+                Retained<Doc> duplicate = new Doc(shared, Doc::kTrusted, sk);
+                Retained<Doc> doc = new Doc(transient, Doc::kTrusted, sk);
+                Scope scope(plain, sk);
+            }
+        };
+        auto lookup = [&] {
+            while (!done) {
+                RetainedConst<Doc> doc = Doc::containing(sharedValue);
+                if (!doc || doc->data() != shared || Doc::sharedKeys(sharedValue) != sk)
+                    ++failures;
+                doc = Doc::containing(transientValue);
+                if (doc && doc->data() != transient)
+                    ++failures;
+                SharedKeys *foundSK = Doc::sharedKeys(transientValue);
+                if (foundSK && foundSK != sk)
+                    ++failures;
+                foundSK = Doc::sharedKeys(plainValue);
+                if (foundSK && foundSK != sk)
+                    ++failures;
+            }
+        };
+
+        vector<thread> churners, lookers;
+        for (int t = 0; t < 2; ++t) {
+            churners.emplace_back(churn);
+            lookers.emplace_back(lookup);
+        }
+        for (auto &t : churners)
+            t.join();
+        done = true;
+        for (auto &t : lookers)
+            t.join();
+        CHECK(failures == 0);
+        CHECK(Doc::sharedKeys(transientValue) == nullptr);
+    }
+
 }
@@ -17,9 +17,16 @@
 //
 
 #include "fleece/Fleece.hh"
+#include "Doc.hh"
+#include "DeepIterator.hh"
+#include "Encoder.hh"
+#include "SharedKeys.hh"
 #include <stdio.h>
+#include <chrono>
 #include <iostream>
 #include <sstream>
+#include <string>
+#include <vector>
 #ifndef _MSC_VER
 #include <unistd.h>
 #define _isatty isatty
@@ -38,7 +45,10 @@ static void usage(void) {
     fprintf(stderr, "usage: fleece [--hex] encode [JSON file]\n");
     fprintf(stderr, "       fleece [--hex] decode [Fleece file]\n");
     fprintf(stderr, "       fleece dump [Fleece file]\n");
+    fprintf(stderr, "       fleece [--max-keys N] sharedkeys [JSON file]\n");
     fprintf(stderr, "  Reads stdin unless a file is given; always writes to stdout.\n");
+    fprintf(stderr, "  sharedkeys compares adding shared keys as they're found, with choosing them by\n");
+    fprintf(stderr, "  frequency; if the input is an array, each item is treated as a document.\n");
 }
 
 
@@ -118,9 +128,116 @@ static void writeOutput(slice output, bool asHex =false) {
 }
 
 
+// Statistics about one way of choosing shared keys, for the `sharedkeys` command.
+struct SharedKeysStats {
+    size_t dataSize = 0, narrowKeys = 0, longIntKeys = 0, stringKeys = 0;
+    double nsPerLookup = 0;
+};
+
+
+// Encodes each sample as a separate document, then times looking up their top-level keys.
+static SharedKeysStats measureSharedKeys(const vector<const impl::Value*> &samples,
+                                         impl::SharedKeys *sk)
+{
+    SharedKeysStats stats;
+    vector<Retained<impl::Doc>> docs;
+    vector<vector<string>> docKeys;
+    for (auto sample : samples) {
+        impl::Encoder enc;
+        enc.setSharedKeys(sk);
+        enc.writeValue(sample);
+        docs.push_back(enc.finishDoc());
+        stats.dataSize += docs.back()->data().size;
+
+        vector<string> keys;
+        if (auto dict = sample->asDict(); dict) {
+            for (impl::Dict::iterator i(dict); i; ++i)
+                keys.emplace_back(i.keyString());
+        }
+        docKeys.push_back(move(keys));
+
+        for (impl::DeepIterator i(docs.back()->root()); i; ++i) {
+            if (auto dict = i.value()->asDict(); dict) {
+                for (impl::Dict::iterator di(dict); di; ++di) {
+                    auto key = di.key();
+                    if (!key->isInteger())
+                        ++stats.stringKeys;
+                    else if (key->asInt() < 2048)
+                        ++stats.narrowKeys;
+                    else
+                        ++stats.longIntKeys;
+                }
+            }
+        }
+    }
+
+    // Take the fastest of several passes over all the keys:
+    size_t nLookups = 0;
+    double best = 1e30;
+    for (int pass = 0; pass < 10; ++pass) {
+        size_t found = 0;
+        auto start = chrono::steady_clock::now();
+        for (size_t d = 0; d < docs.size(); ++d) {
+            auto dict = docs[d]->asDict();
+            if (!dict)
+                continue;
+            for (auto &key : docKeys[d])
+                found += (dict->get(slice(key)) != nullptr);
+        }
+        chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+        best = min(best, elapsed.count());
+        nLookups = found;
+    }
+    stats.nsPerLookup = nLookups ? best / nLookups : 0;
+    return stats;
+}
+
+
+// Implements the `sharedkeys` command.
+static void reportSharedKeys(slice json, size_t maxKeys) {
+    Retained<impl::Doc> input = impl::Doc::fromJSON(json);
+    vector<const impl::Value*> samples;
+    if (auto array = input->asArray(); array) {
+        for (impl::Array::iterator i(array); i; ++i)
+            samples.push_back(i.value());
+    } else {
+        samples.push_back(input->root());
+    }
+
+    // First-come-first-served: keys are added as the encoder finds them.
+    Retained<impl::SharedKeys> firstCome = new impl::SharedKeys();
+    if (maxKeys)
+        firstCome->setMaxCount(maxKeys);
+    SharedKeysStats before = measureSharedKeys(samples, firstCome);
+
+    // Trained: the most frequent keys are added first, then the encoder may add more.
+    impl::SharedKeysTrainer trainer;
+    for (auto sample : samples)
+        trainer.addSample(sample);
+    Retained<impl::SharedKeys> trained = new impl::SharedKeys();
+    if (maxKeys)
+        trained->setMaxCount(maxKeys);
+    trainer.train(trained);
+    SharedKeysStats after = measureSharedKeys(samples, trained);
+
+    printf("%zu documents, %zu distinct keys\n",
+           samples.size(), trainer.keysByFrequency().size());
+    printf("                      first-come      trained\n");
+    printf("Shared keys:        %12zu %12zu\n", firstCome->count(), trained->count());
+    printf("Narrow key uses:    %12zu %12zu\n", before.narrowKeys, after.narrowKeys);
+    printf("Long key uses:      %12zu %12zu\n", before.longIntKeys, after.longIntKeys);
+    printf("String key uses:    %12zu %12zu\n", before.stringKeys, after.stringKeys);
+    printf("Encoded size:       %12zu %12zu  (%+.1f%%)\n", before.dataSize, after.dataSize,
+           100.0 * ((double)after.dataSize / before.dataSize - 1.0));
+    printf("Key lookup (ns):    %12.1f %12.1f  (%+.1f%%)\n", before.nsPerLookup, after.nsPerLookup,
+           100.0 * (after.nsPerLookup / before.nsPerLookup - 1.0));
+}
+
+
 int main(int argc, const char * argv[]) {
     try {
-        bool encode = false, decode = false, dump = false, hex = false;
+        bool encode = false, decode = false, dump = false, sharedKeys = false, hex = false;
+        size_t maxKeys = 0;
 
         int i;
         for (i = 1; i < argc; ++i) {
@@ -135,8 +252,12 @@ int main(int argc, const char * argv[]) {
                     decode = true;
                 } else if (strcmp(arg, "--dump") == 0) {
                     dump = true;
+                } else if (strcmp(arg, "--sharedkeys") == 0) {
+                    sharedKeys = true;
                 } else if (strcmp(arg, "--hex") == 0) {
                     hex = true;
+                } else if (strcmp(arg, "--max-keys") == 0 && i + 1 < argc) {
+                    maxKeys = strtoul(argv[++i], nullptr, 10);
                 } else if (strcmp(arg, "--help") == 0) {
                     usage();
                     return 0;
@@ -145,7 +266,7 @@ int main(int argc, const char * argv[]) {
                     usage();
                     return 1;
                 }
-            } else if (encode+decode+dump == 0) {
+            } else if (encode+decode+dump+sharedKeys == 0) {
                 // Also allow mode without '--' prefix, if none was chosen yet:
                 if (strcmp(arg, "encode") == 0) {
                     encode = true;
@@ -153,6 +274,8 @@ int main(int argc, const char * argv[]) {
                     decode = true;
                 } else if (strcmp(arg, "dump") == 0) {
                     dump = true;
+                } else if (strcmp(arg, "sharedkeys") == 0) {
+                    sharedKeys = true;
                 } else {
                     break;
                 }
@@ -161,8 +284,8 @@ int main(int argc, const char * argv[]) {
             }
         }
 
-        if (encode + decode + dump != 1) {
-            fprintf(stderr, "Choose one of --encode, --decode, or --dump\n");
+        if (encode + decode + dump + sharedKeys != 1) {
+            fprintf(stderr, "Choose one of --encode, --decode, --dump, or --sharedkeys\n");
             usage();
             return 1;
         }
@@ -206,6 +329,8 @@ int main(int argc, const char * argv[]) {
             if (!output)
                 throw "Couldn't parse input as Fleece";
             writeOutput(output);
+        } else if (sharedKeys) {
+            reportSharedKeys(input, maxKeys);
         }
 
         return 0;
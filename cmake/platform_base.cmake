@@ -14,8 +14,11 @@ function(set_source_files_base)
         Fleece/Core/Dict.cc
         Fleece/Core/Doc.cc
         Fleece/Core/Encoder.cc
+        Fleece/Core/Encoder+Parallel.cc
         Fleece/Core/JSONConverter.cc
+        Fleece/Core/JSONConverter+Parallel.cc
         Fleece/Core/JSONDelta.cc
+        Fleece/Core/ParallelEncoding.cc
         Fleece/Core/Path.cc
         Fleece/Core/Pointer.cc
         Fleece/Core/SharedKeys.cc
@@ -35,6 +38,7 @@ function(set_source_files_base)
         Fleece/Support/NumConversion.cc
         Fleece/Support/JSON5.cc
         Fleece/Support/JSONEncoder.cc
+        Fleece/Support/JSONScanner.cc
         Fleece/Support/LibC++Debug.cc
         Fleece/Support/ParseDate.cc
         Fleece/Support/RefCounted.cc
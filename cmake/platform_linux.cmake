@@ -30,6 +30,12 @@ function(setup_build)
     target_link_libraries(
         FleeceStatic INTERFACE
 	    dl
+        pthread
+    )
+
+    target_link_libraries(
+        Fleece PRIVATE
+        pthread
     )
 
     target_compile_definitions(